@@ -0,0 +1,213 @@
+/* minimal responder for the benchmark: answers every request with
+ * BENCH_RESPONSE_SIZE bytes (or echoes stdin if BENCH_ECHO is set)
+ *
+ * usage: afcgi-bench-server [-t threads] [-u] [-c max_connections] [-o coalesce bytes] ADDRESS
+ *   ADDRESS: unix socket path or host:port
+ *
+ * without -o the header, every body chunk and the end request are separate writes; on tcp that relies on
+ * the TCP_NODELAY libafcgi sets on accepted connections, or each response waits for a delayed ack
+ */
+
+#include "libafcgi.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define UNUSED(x) ((void)(x))
+#define CONST_STR_LEN(x) (x), (sizeof(x) - 1)
+
+#define BENCH_BODY_CHUNK (64*1024)
+
+typedef struct {
+	gsize response_size;
+	gboolean echo;
+} bench_request;
+
+static GBytes *body_chunk; /* shared by all responses */
+
+static gint listen_address(const gchar *address) {
+	const gchar *colon = strrchr(address, ':');
+	gint fd;
+
+	if (NULL == colon || '/' == address[0]) {
+		struct sockaddr_un sun;
+		if (strlen(address) >= sizeof(sun.sun_path)) {
+			fprintf(stderr, "socket path too long: %s\n", address);
+			return -1;
+		}
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		strcpy(sun.sun_path, address);
+		unlink(address);
+		if (-1 == (fd = socket(AF_UNIX, SOCK_STREAM, 0))) goto error;
+		if (-1 == bind(fd, (struct sockaddr*) &sun, sizeof(sun))) goto error;
+	} else {
+		struct addrinfo hints, *res;
+		gchar *host = g_strndup(address, colon - address);
+		gint on = 1, r;
+
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_flags = AI_PASSIVE;
+		r = getaddrinfo(host, colon + 1, &hints, &res);
+		g_free(host);
+		if (0 != r) {
+			fprintf(stderr, "can't resolve %s: %s\n", address, gai_strerror(r));
+			return -1;
+		}
+		fd = socket(res->ai_family, SOCK_STREAM, 0);
+		if (-1 != fd) {
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+			r = bind(fd, res->ai_addr, res->ai_addrlen);
+		}
+		freeaddrinfo(res);
+		if (-1 == fd || -1 == r) goto error;
+	}
+
+	if (-1 == listen(fd, 1024)) goto error;
+	return fd;
+
+error:
+	fprintf(stderr, "can't listen on %s: %s\n", address, g_strerror(errno));
+	return -1;
+}
+
+static void bench_new_request(fastcgi_connection *fcon) {
+	bench_request *br = fcon->data;
+	const gchar *size = fastcgi_connection_environ_lookup(fcon, CONST_STR_LEN("BENCH_RESPONSE_SIZE"));
+
+	if (NULL == br) fcon->data = br = g_slice_new0(bench_request);
+	br->response_size = size ? (gsize) g_ascii_strtoull(size, NULL, 10) : 0;
+	br->echo = (NULL != fastcgi_connection_environ_lookup(fcon, CONST_STR_LEN("BENCH_ECHO")));
+	fastcgi_send_out(fcon, g_string_new("Status: 200\r\nContent-Type: application/octet-stream\r\n\r\n"));
+}
+
+static void bench_received_stdin(fastcgi_connection *fcon, GByteArray *data) {
+	bench_request *br = fcon->data;
+	gsize left;
+
+	if (NULL != data) {
+		if (br->echo) {
+			fastcgi_consume_input(fcon, data->len);
+			fastcgi_send_out_bytearray(fcon, data);
+		} else {
+			fastcgi_release_input(fcon, data);
+		}
+		return;
+	}
+
+	for (left = br->response_size; left > 0; ) {
+		gsize n = MIN(left, BENCH_BODY_CHUNK);
+		fastcgi_send_out_bytes(fcon, g_bytes_new_from_bytes(body_chunk, 0, n));
+		left -= n;
+	}
+	fastcgi_end_request(fcon, 0, FCGI_REQUEST_COMPLETE);
+}
+
+static void bench_request_aborted(fastcgi_connection *fcon) {
+	fastcgi_end_request(fcon, 0, FCGI_REQUEST_COMPLETE);
+}
+
+static void bench_reset_connection(fastcgi_connection *fcon) {
+	if (fcon->data) g_slice_free(bench_request, fcon->data);
+	fcon->data = NULL;
+}
+
+static const fastcgi_callbacks bench_callbacks = {
+	NULL, bench_new_request, NULL, bench_received_stdin, NULL, bench_request_aborted, bench_reset_connection,
+	NULL, NULL, NULL, NULL, NULL, NULL, NULL
+};
+
+static gboolean setup_server(fastcgi_server *fsrv, gboolean uring, gsize coalesce) {
+	fastcgi_server_set_output_coalescing(fsrv, coalesce);
+	if (uring && !fastcgi_server_set_backend(fsrv, FASTCGI_BACKEND_URING)) {
+		fprintf(stderr, "io_uring backend not available\n");
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static void sigterm_cb(struct ev_loop *loop, ev_signal *w, int revents) {
+	UNUSED(w);
+	UNUSED(revents);
+	ev_break(loop, EVBREAK_ALL);
+}
+
+int main(int argc, char **argv) {
+	gint threads = 1, max_connections = 1024, opt, fd;
+	gboolean uring = FALSE;
+	gsize coalesce = 0;
+	guint8 *fill;
+
+	while (-1 != (opt = getopt(argc, argv, "t:uc:o:"))) {
+		switch (opt) {
+		case 't': threads = atoi(optarg); break;
+		case 'u': uring = TRUE; break;
+		case 'c': max_connections = atoi(optarg); break;
+		case 'o': coalesce = (gsize) g_ascii_strtoull(optarg, NULL, 10); break;
+		default: goto usage;
+		}
+	}
+	if (optind + 1 != argc || threads < 0 || max_connections < 1) goto usage;
+
+	signal(SIGPIPE, SIG_IGN);
+	if (-1 == (fd = listen_address(argv[optind]))) return 1;
+
+	fill = g_malloc(BENCH_BODY_CHUNK);
+	memset(fill, 'x', BENCH_BODY_CHUNK);
+	body_chunk = g_bytes_new_take(fill, BENCH_BODY_CHUNK);
+
+	if (1 == threads) {
+		struct ev_loop *loop = ev_default_loop(0);
+		fastcgi_server *fsrv = fastcgi_server_create(loop, fd, &bench_callbacks, max_connections);
+		ev_signal sigint, sigterm;
+
+		if (!setup_server(fsrv, uring, coalesce)) return 1;
+		ev_signal_init(&sigint, sigterm_cb, SIGINT);
+		ev_signal_init(&sigterm, sigterm_cb, SIGTERM);
+		ev_signal_start(loop, &sigint);
+		ev_signal_start(loop, &sigterm);
+
+		ev_run(loop, 0);
+
+		ev_signal_stop(loop, &sigint);
+		ev_signal_stop(loop, &sigterm);
+		fastcgi_server_free(fsrv);
+	} else {
+		fastcgi_threaded_server *tsrv;
+		sigset_t set;
+		gint sig;
+		guint i;
+
+		/* the workers inherit the mask, the signals are only taken by sigwait() */
+		sigemptyset(&set);
+		sigaddset(&set, SIGINT);
+		sigaddset(&set, SIGTERM);
+		pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+		tsrv = fastcgi_threaded_server_create(fd, &bench_callbacks, max_connections, threads, FASTCGI_THREADED_REUSEPORT);
+		for (i = 0; i < tsrv->workers_count; i++) {
+			if (!setup_server(tsrv->workers[i], uring, coalesce)) return 1;
+		}
+		fastcgi_threaded_server_start(tsrv);
+		sigwait(&set, &sig);
+		fastcgi_threaded_server_free(tsrv);
+	}
+
+	g_bytes_unref(body_chunk);
+	return 0;
+
+usage:
+	fprintf(stderr, "usage: %s [-t threads (0: one per cpu)] [-u (io_uring)] [-c max_connections] [-o coalesce bytes (0: off)] ADDRESS\n"
+		"  ADDRESS: unix socket path or host:port\n", argv[0]);
+	return 1;
+}
@@ -0,0 +1,613 @@
+/* FastCGI load generator: keeps N connections busy with the same request
+ * and prints one JSON object with throughput, latency and cpu usage
+ *
+ * usage: afcgi-bench -s ADDRESS [options], see --help
+ */
+
+#include "libafcgi.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define UNUSED(x) ((void)(x))
+
+#define BENCH_RECORD_SIZE 32768
+#define BENCH_RETRY 0.01 /* seconds before reconnecting after an error */
+
+typedef struct bench bench;
+typedef struct bench_conn bench_conn;
+
+struct bench {
+	struct ev_loop *loop;
+
+	/* options */
+	gchar *address;
+	gint concurrency;
+	gdouble duration, warmup;
+	gboolean close_conn;
+	gint params_size, body_size, response_size;
+	gboolean echo;
+	gchar *spawn;
+	gint server_pid;
+	gchar *label;
+
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	gboolean tcp;
+
+	GByteArray *request; /* sent on every connection */
+	gsize params_len; /* FCGI_PARAMS content in request */
+	bench_conn *conns;
+	ev_timer warmup_timer, end_timer;
+
+	/* measurement */
+	gboolean measuring;
+	ev_tstamp start, end;
+	guint64 requests, errors;
+	GArray *latencies; /* guint32 microseconds */
+	struct rusage ru_start, ru_end;
+	gint64 server_cpu_start, server_cpu_end; /* microseconds, -1: unknown */
+};
+
+struct bench_conn {
+	bench *b;
+	gint fd;
+	ev_io io_watcher;
+	ev_timer retry_timer;
+
+	gsize sent; /* of b->request */
+	ev_tstamp started;
+	guint generation; /* incremented for each request */
+
+	/* response parser */
+	guint8 header[FCGI_HEADER_LEN];
+	guint header_used;
+	guint8 type;
+	gsize content_remaining, padding_remaining;
+	guint8 end_body[8];
+	guint end_used;
+};
+
+static guint8 read_buffer[64*1024];
+
+static void conn_start(bench_conn *c);
+
+/* request */
+
+static void append_record(GByteArray *out, guint8 type, const guint8 *data, gsize len) {
+	static const guint8 padding[8] = { 0 };
+	guint8 header[FCGI_HEADER_LEN];
+	guint8 padlen = (8 - (len & 0x7)) % 8;
+
+	header[0] = FCGI_VERSION_1;
+	header[1] = type;
+	header[2] = 0;
+	header[3] = 1; /* requestID */
+	header[4] = (guint8) (len >> 8);
+	header[5] = (guint8) len;
+	header[6] = padlen;
+	header[7] = 0;
+	g_byte_array_append(out, header, sizeof(header));
+	if (len) g_byte_array_append(out, data, len);
+	if (padlen) g_byte_array_append(out, padding, padlen);
+}
+
+/* a stream is sent in records of up to BENCH_RECORD_SIZE bytes, closed with an empty one */
+static void append_stream(GByteArray *out, guint8 type, const guint8 *data, gsize len) {
+	while (len > 0) {
+		gsize n = MIN(len, BENCH_RECORD_SIZE);
+		append_record(out, type, data, n);
+		data += n;
+		len -= n;
+	}
+	append_record(out, type, NULL, 0);
+}
+
+static void append_length(GByteArray *out, gsize len) {
+	if (len < 128) {
+		guint8 l = len;
+		g_byte_array_append(out, &l, 1);
+	} else {
+		guint8 l[4] = { (guint8) ((len >> 24) | 0x80), (guint8) (len >> 16), (guint8) (len >> 8), (guint8) len };
+		g_byte_array_append(out, l, 4);
+	}
+}
+
+static void append_param(GByteArray *out, const gchar *key, const gchar *value) {
+	gsize keylen = strlen(key), valuelen = strlen(value);
+	append_length(out, keylen);
+	append_length(out, valuelen);
+	g_byte_array_append(out, (const guint8*) key, keylen);
+	g_byte_array_append(out, (const guint8*) value, valuelen);
+}
+
+static void build_request(bench *b) {
+	GByteArray *params = g_byte_array_new();
+	guint8 begin[8] = { 0, FCGI_RESPONDER, b->close_conn ? 0 : FCGI_KEEP_CONN, 0, 0, 0, 0, 0 };
+	gchar *s;
+
+	append_param(params, "GATEWAY_INTERFACE", "CGI/1.1");
+	append_param(params, "REQUEST_METHOD", b->body_size > 0 ? "POST" : "GET");
+	append_param(params, "SCRIPT_NAME", "/bench");
+	s = g_strdup_printf("%d", b->body_size);
+	append_param(params, "CONTENT_LENGTH", s);
+	g_free(s);
+	s = g_strdup_printf("%d", b->response_size);
+	append_param(params, "BENCH_RESPONSE_SIZE", s);
+	g_free(s);
+	if (b->echo) append_param(params, "BENCH_ECHO", "1");
+
+	if ((gsize) b->params_size > params->len) {
+		/* "BENCH_PADDING" (13) with a value up to the requested size */
+		gsize room = b->params_size - params->len, len = 0;
+		if (room >= 1 + 1 + 13) len = room - 1 - 1 - 13;
+		if (len >= 128) len = room - 1 - 4 - 13;
+		s = g_malloc(len + 1);
+		memset(s, 'p', len);
+		s[len] = '\0';
+		append_param(params, "BENCH_PADDING", s);
+		g_free(s);
+	}
+
+	b->request = g_byte_array_new();
+	append_record(b->request, FCGI_BEGIN_REQUEST, begin, sizeof(begin));
+	append_stream(b->request, FCGI_PARAMS, params->data, params->len);
+	b->params_len = params->len;
+	s = g_malloc0(b->body_size + 1);
+	memset(s, 'b', b->body_size);
+	append_stream(b->request, FCGI_STDIN, (const guint8*) s, b->body_size);
+	g_free(s);
+
+	g_byte_array_free(params, TRUE);
+}
+
+/* target address */
+
+static gboolean resolve_address(bench *b) {
+	const gchar *colon = strrchr(b->address, ':');
+
+	if (NULL == colon || '/' == b->address[0]) {
+		struct sockaddr_un *sun = (struct sockaddr_un*) &b->addr;
+		if (strlen(b->address) >= sizeof(sun->sun_path)) {
+			fprintf(stderr, "socket path too long: %s\n", b->address);
+			return FALSE;
+		}
+		sun->sun_family = AF_UNIX;
+		strcpy(sun->sun_path, b->address);
+		b->addrlen = sizeof(*sun);
+		b->tcp = FALSE;
+	} else {
+		struct addrinfo hints, *res;
+		gchar *host = g_strndup(b->address, colon - b->address);
+		gint r;
+
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		r = getaddrinfo(host, colon + 1, &hints, &res);
+		g_free(host);
+		if (0 != r) {
+			fprintf(stderr, "can't resolve %s: %s\n", b->address, gai_strerror(r));
+			return FALSE;
+		}
+		memcpy(&b->addr, res->ai_addr, res->ai_addrlen);
+		b->addrlen = res->ai_addrlen;
+		b->tcp = TRUE;
+		freeaddrinfo(res);
+	}
+	return TRUE;
+}
+
+/* blocking connect attempts until the server is up (or the timeout is reached) */
+static gboolean wait_for_server(bench *b, gdouble timeout) {
+	ev_tstamp deadline = ev_time() + timeout;
+
+	for (;;) {
+		gint fd = socket(b->addr.ss_family, SOCK_STREAM, 0);
+		gint r = connect(fd, (struct sockaddr*) &b->addr, b->addrlen), err = errno, status;
+		close(fd);
+		if (0 == r) return TRUE;
+		if (b->spawn && b->server_pid == waitpid(b->server_pid, &status, WNOHANG)) {
+			fprintf(stderr, "server exited before accepting connections\n");
+			b->server_pid = -1;
+			return FALSE;
+		}
+		if (ev_time() > deadline) {
+			fprintf(stderr, "can't connect to %s: %s\n", b->address, g_strerror(err));
+			return FALSE;
+		}
+		ev_sleep(0.01);
+	}
+}
+
+/* cpu time of another process in microseconds, -1 if unknown (needs /proc) */
+static gint64 process_cpu(gint pid) {
+	gchar *path, *contents = NULL, *p;
+	gint64 result = -1;
+
+	if (pid <= 0) return -1;
+	path = g_strdup_printf("/proc/%d/stat", pid);
+	if (g_file_get_contents(path, &contents, NULL, NULL) && NULL != (p = strrchr(contents, ')'))) {
+		/* after "(comm)": state ppid pgrp session tty_nr tpgid flags minflt cminflt majflt cmajflt utime stime */
+		gchar **fields = g_strsplit(p + 2, " ", 14);
+		if (g_strv_length(fields) >= 13) {
+			long ticks = sysconf(_SC_CLK_TCK);
+			guint64 t = g_ascii_strtoull(fields[11], NULL, 10) + g_ascii_strtoull(fields[12], NULL, 10);
+			result = (gint64) (t * G_USEC_PER_SEC / (ticks > 0 ? ticks : 100));
+		}
+		g_strfreev(fields);
+	}
+	g_free(contents);
+	g_free(path);
+	return result;
+}
+
+static gint64 rusage_cpu(const struct rusage *ru) {
+	return (gint64) ru->ru_utime.tv_sec * G_USEC_PER_SEC + ru->ru_utime.tv_usec
+		+ (gint64) ru->ru_stime.tv_sec * G_USEC_PER_SEC + ru->ru_stime.tv_usec;
+}
+
+/* connections */
+
+static void conn_close(bench_conn *c) {
+	if (-1 == c->fd) return;
+	ev_io_stop(c->b->loop, &c->io_watcher);
+	if (c->b->close_conn && c->b->tcp) {
+		/* reset instead of leaving TIME_WAIT sockets behind, they would use up the local ports */
+		struct linger l = { 1, 0 };
+		setsockopt(c->fd, SOL_SOCKET, SO_LINGER, &l, sizeof(l));
+	}
+	close(c->fd);
+	c->fd = -1;
+}
+
+static void conn_error(bench_conn *c) {
+	if (c->b->measuring) c->b->errors++;
+	conn_close(c);
+	ev_timer_set(&c->retry_timer, BENCH_RETRY, 0.);
+	ev_timer_start(c->b->loop, &c->retry_timer);
+}
+
+static void conn_done(bench_conn *c) {
+	bench *b = c->b;
+	ev_tstamp now = ev_time();
+
+	if (0 != c->end_body[4]) {
+		conn_error(c); /* protocolStatus, e.g. FCGI_OVERLOADED */
+		return;
+	}
+
+	if (b->measuring) {
+		guint32 usec = (guint32) MIN((now - c->started) * 1e6, (gdouble) G_MAXUINT32);
+		b->requests++;
+		g_array_append_val(b->latencies, usec);
+	}
+
+	if (b->close_conn) conn_close(c);
+	conn_start(c);
+}
+
+/* returns FALSE if the connection is gone */
+static gboolean conn_parse(bench_conn *c, const guint8 *data, gsize len) {
+	while (len > 0) {
+		gsize n;
+
+		if (c->header_used < FCGI_HEADER_LEN) {
+			n = MIN(len, FCGI_HEADER_LEN - c->header_used);
+			memcpy(c->header + c->header_used, data, n);
+			c->header_used += n;
+			data += n;
+			len -= n;
+			if (c->header_used < FCGI_HEADER_LEN) break;
+			c->type = c->header[1];
+			c->content_remaining = (c->header[4] << 8) | c->header[5];
+			c->padding_remaining = c->header[6];
+		}
+
+		n = MIN(len, c->content_remaining);
+		if (FCGI_END_REQUEST == c->type && n > 0) {
+			gsize m = MIN(n, sizeof(c->end_body) - c->end_used);
+			memcpy(c->end_body + c->end_used, data, m);
+			c->end_used += m;
+		}
+		data += n;
+		len -= n;
+		c->content_remaining -= n;
+
+		n = MIN(len, c->padding_remaining);
+		data += n;
+		len -= n;
+		c->padding_remaining -= n;
+
+		if (0 == c->content_remaining && 0 == c->padding_remaining) {
+			c->header_used = 0;
+			if (FCGI_END_REQUEST == c->type) {
+				if (len > 0 || c->end_used != sizeof(c->end_body)) {
+					/* only one request per connection at a time, nothing may follow */
+					conn_error(c);
+				} else {
+					conn_done(c);
+				}
+				return FALSE;
+			}
+		}
+	}
+	return TRUE;
+}
+
+static void conn_write(bench_conn *c) {
+	GByteArray *req = c->b->request;
+
+	while (c->sent < req->len) {
+		gssize r = write(c->fd, req->data + c->sent, req->len - c->sent);
+		if (-1 == r) {
+			if (EAGAIN == errno || EINTR == errno) break;
+			conn_error(c);
+			return;
+		}
+		c->sent += r;
+	}
+
+	if (c->sent == req->len) {
+		ev_io_stop(c->b->loop, &c->io_watcher);
+		ev_io_set(&c->io_watcher, c->fd, EV_READ);
+		ev_io_start(c->b->loop, &c->io_watcher);
+	}
+}
+
+static void conn_read(bench_conn *c) {
+	for (;;) {
+		gssize r = read(c->fd, read_buffer, sizeof(read_buffer));
+		if (0 == r) {
+			conn_error(c); /* closed before FCGI_END_REQUEST */
+			return;
+		}
+		if (-1 == r) {
+			if (EAGAIN == errno || EINTR == errno) return;
+			conn_error(c);
+			return;
+		}
+		if (!conn_parse(c, read_buffer, r)) return;
+	}
+}
+
+static void conn_io_cb(struct ev_loop *loop, ev_io *w, int revents) {
+	bench_conn *c = w->data;
+	UNUSED(loop);
+
+	/* read first: the server may answer (echo) while we are still sending */
+	if (revents & EV_READ) {
+		guint generation = c->generation;
+		conn_read(c);
+		/* the connection was closed or a new request started */
+		if (-1 == c->fd || c->generation != generation) return;
+	}
+	if (revents & EV_WRITE) conn_write(c);
+}
+
+static void conn_retry_cb(struct ev_loop *loop, ev_timer *w, int revents) {
+	UNUSED(loop);
+	UNUSED(revents);
+	conn_start(w->data);
+}
+
+static void conn_start(bench_conn *c) {
+	bench *b = c->b;
+
+	if (-1 == c->fd) {
+		c->fd = socket(b->addr.ss_family, SOCK_STREAM, 0);
+		if (-1 == c->fd) {
+			conn_error(c);
+			return;
+		}
+		fcntl(c->fd, F_SETFL, O_NONBLOCK | O_RDWR);
+		fcntl(c->fd, F_SETFD, FD_CLOEXEC);
+		if (b->tcp) {
+			gint on = 1;
+			setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		}
+		if (-1 == connect(c->fd, (struct sockaddr*) &b->addr, b->addrlen) && EINPROGRESS != errno) {
+			conn_error(c);
+			return;
+		}
+	}
+
+	c->generation++;
+	c->sent = 0;
+	c->header_used = 0;
+	c->end_used = 0;
+	c->started = ev_time();
+
+	/* the first write happens when the socket is writable (connect finished) */
+	ev_io_stop(b->loop, &c->io_watcher);
+	ev_io_set(&c->io_watcher, c->fd, EV_READ | EV_WRITE);
+	ev_io_start(b->loop, &c->io_watcher);
+}
+
+/* measurement */
+
+static void warmup_cb(struct ev_loop *loop, ev_timer *w, int revents) {
+	bench *b = w->data;
+	UNUSED(loop);
+	UNUSED(revents);
+
+	b->measuring = TRUE;
+	b->start = ev_time();
+	getrusage(RUSAGE_SELF, &b->ru_start);
+	b->server_cpu_start = process_cpu(b->server_pid);
+}
+
+static void end_cb(struct ev_loop *loop, ev_timer *w, int revents) {
+	bench *b = w->data;
+	UNUSED(revents);
+
+	/* requests still running are not counted */
+	b->measuring = FALSE;
+	b->end = ev_time();
+	getrusage(RUSAGE_SELF, &b->ru_end);
+	b->server_cpu_end = process_cpu(b->server_pid);
+	ev_break(loop, EVBREAK_ALL);
+}
+
+static gint compare_guint32(gconstpointer a, gconstpointer b) {
+	guint32 x = *(const guint32*) a, y = *(const guint32*) b;
+	return (x > y) - (x < y);
+}
+
+static guint32 percentile(GArray *sorted, gdouble p) {
+	guint i;
+	if (0 == sorted->len) return 0;
+	i = (guint) (p * sorted->len);
+	if (i >= sorted->len) i = sorted->len - 1;
+	return g_array_index(sorted, guint32, i);
+}
+
+static void report(bench *b) {
+	gdouble duration = b->end - b->start;
+	gdouble client_cpu = (gdouble) (rusage_cpu(&b->ru_end) - rusage_cpu(&b->ru_start));
+	guint64 n = MAX(b->requests, 1);
+	gchar *label = g_strescape(b->label ? b->label : "", NULL);
+	gchar *address = g_strescape(b->address, NULL);
+	gchar *server_cpu;
+
+	if (b->server_cpu_start >= 0 && b->server_cpu_end >= 0) {
+		server_cpu = g_strdup_printf("%.2f", (gdouble) (b->server_cpu_end - b->server_cpu_start) / n);
+	} else {
+		server_cpu = g_strdup("null");
+	}
+
+	g_array_sort(b->latencies, compare_guint32);
+	printf("{\"label\": \"%s\", \"address\": \"%s\", \"transport\": \"%s\", \"concurrency\": %d, \"keepalive\": %s, "
+		"\"params_size\": %u, \"body_size\": %d, \"response_size\": %d, \"echo\": %s, "
+		"\"duration\": %.3f, \"requests\": %" G_GUINT64_FORMAT ", \"errors\": %" G_GUINT64_FORMAT ", \"rps\": %.1f, "
+		"\"latency_us\": {\"p50\": %u, \"p99\": %u, \"p999\": %u, \"max\": %u}, "
+		"\"cpu_us_per_request\": {\"client\": %.2f, \"server\": %s}}\n",
+		label, address, b->tcp ? "tcp" : "unix", b->concurrency, b->close_conn ? "false" : "true",
+		(guint) b->params_len, b->body_size, b->response_size, b->echo ? "true" : "false",
+		duration, b->requests, b->errors, duration > 0 ? b->requests / duration : 0.,
+		percentile(b->latencies, 0.5), percentile(b->latencies, 0.99), percentile(b->latencies, 0.999),
+		b->latencies->len ? g_array_index(b->latencies, guint32, b->latencies->len - 1) : 0,
+		client_cpu / n, server_cpu);
+	fflush(stdout);
+
+	g_free(server_cpu);
+	g_free(address);
+	g_free(label);
+}
+
+static gint spawn_server(const gchar *cmd) {
+	gint pid = fork();
+	if (0 == pid) {
+		gchar *exec_cmd = g_strconcat("exec ", cmd, NULL);
+		execl("/bin/sh", "sh", "-c", exec_cmd, (char*) NULL);
+		_exit(127);
+	}
+	if (-1 == pid) fprintf(stderr, "fork failed: %s\n", g_strerror(errno));
+	return pid;
+}
+
+int main(int argc, char **argv) {
+	bench b;
+	GError *error = NULL;
+	GOptionContext *context;
+	gint i, status;
+	GOptionEntry entries[] = {
+		{ "socket", 's', 0, G_OPTION_ARG_STRING, &b.address, "unix socket path or host:port", "ADDRESS" },
+		{ "concurrency", 'c', 0, G_OPTION_ARG_INT, &b.concurrency, "parallel connections (16)", "N" },
+		{ "duration", 'd', 0, G_OPTION_ARG_DOUBLE, &b.duration, "measured seconds (5)", "SECONDS" },
+		{ "warmup", 'w', 0, G_OPTION_ARG_DOUBLE, &b.warmup, "seconds before measuring (1)", "SECONDS" },
+		{ "close", 'C', 0, G_OPTION_ARG_NONE, &b.close_conn, "new connection for each request (no keep-alive)", NULL },
+		{ "params-size", 'p', 0, G_OPTION_ARG_INT, &b.params_size, "FCGI_PARAMS bytes per request, padded up to (256)", "BYTES" },
+		{ "body-size", 'b', 0, G_OPTION_ARG_INT, &b.body_size, "FCGI_STDIN bytes per request (0)", "BYTES" },
+		{ "response-size", 'r', 0, G_OPTION_ARG_INT, &b.response_size, "response body bytes (128)", "BYTES" },
+		{ "echo", 'e', 0, G_OPTION_ARG_NONE, &b.echo, "ask the server to echo the body instead", NULL },
+		{ "spawn", 'x', 0, G_OPTION_ARG_STRING, &b.spawn, "start the server with this shell command, stop it afterwards", "COMMAND" },
+		{ "server-pid", 'P', 0, G_OPTION_ARG_INT, &b.server_pid, "measure the cpu time of this (already running) server", "PID" },
+		{ "label", 'l', 0, G_OPTION_ARG_STRING, &b.label, "copied to the output", "TEXT" },
+		{ NULL, 0, 0, 0, NULL, NULL, NULL }
+	};
+
+	memset(&b, 0, sizeof(b));
+	b.concurrency = 16;
+	b.duration = 5;
+	b.warmup = 1;
+	b.params_size = 256;
+	b.response_size = 128;
+
+	context = g_option_context_new("- FastCGI load generator");
+	g_option_context_set_summary(context, "Prints one JSON object with req/s, latency percentiles and cpu time per request.");
+	g_option_context_add_main_entries(context, entries, NULL);
+	if (!g_option_context_parse(context, &argc, &argv, &error)) {
+		fprintf(stderr, "%s\n", error->message);
+		return 1;
+	}
+	g_option_context_free(context);
+	if (NULL == b.address || b.concurrency < 1 || b.duration <= 0 || b.warmup < 0 || b.params_size < 0
+	    || b.body_size < 0 || b.response_size < 0) {
+		fprintf(stderr, "invalid options, see --help\n");
+		return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	if (!resolve_address(&b)) return 1;
+	build_request(&b);
+
+	if (b.spawn) {
+		if (-1 == (b.server_pid = spawn_server(b.spawn))) return 1;
+	}
+	if (!wait_for_server(&b, 5.)) goto out;
+
+	b.loop = ev_default_loop(0);
+	b.latencies = g_array_new(FALSE, FALSE, sizeof(guint32));
+	b.server_cpu_start = b.server_cpu_end = -1;
+
+	b.conns = g_new0(bench_conn, b.concurrency);
+	for (i = 0; i < b.concurrency; i++) {
+		bench_conn *c = &b.conns[i];
+		c->b = &b;
+		c->fd = -1;
+		ev_init(&c->io_watcher, conn_io_cb);
+		c->io_watcher.data = c;
+		ev_init(&c->retry_timer, conn_retry_cb);
+		c->retry_timer.data = c;
+		conn_start(c);
+	}
+
+	ev_timer_init(&b.warmup_timer, warmup_cb, b.warmup, 0.);
+	b.warmup_timer.data = &b;
+	ev_timer_start(b.loop, &b.warmup_timer);
+	ev_timer_init(&b.end_timer, end_cb, b.warmup + b.duration, 0.);
+	b.end_timer.data = &b;
+	ev_timer_start(b.loop, &b.end_timer);
+
+	ev_run(b.loop, 0);
+
+	for (i = 0; i < b.concurrency; i++) {
+		conn_close(&b.conns[i]);
+		ev_timer_stop(b.loop, &b.conns[i].retry_timer);
+	}
+	report(&b);
+
+	g_free(b.conns);
+	g_array_free(b.latencies, TRUE);
+
+out:
+	if (b.spawn && b.server_pid > 0) {
+		kill(b.server_pid, SIGTERM);
+		waitpid(b.server_pid, &status, 0);
+	}
+	g_byte_array_free(b.request, TRUE);
+	return (0 == b.requests) ? 1 : 0;
+}
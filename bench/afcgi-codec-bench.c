@@ -0,0 +1,199 @@
+/* microbenchmark for the sans-I/O codec: decodes and encodes a typical request
+ * stream in memory and prints one JSON object per case
+ *
+ * usage: afcgi-codec-bench [-d seconds per case] [-f fragment size]
+ */
+
+#include "libafcgi.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CODEC_BENCH_REQUESTS 64 /* per buffer */
+
+typedef struct {
+	const gchar *key, *value;
+} codec_param;
+
+/* roughly what a web server sends for a GET */
+static const codec_param params[] = {
+	{ "GATEWAY_INTERFACE", "CGI/1.1" },
+	{ "SERVER_SOFTWARE", "lighttpd/1.4" },
+	{ "SERVER_NAME", "www.example.com" },
+	{ "SERVER_ADDR", "192.0.2.1" },
+	{ "SERVER_PORT", "443" },
+	{ "SERVER_PROTOCOL", "HTTP/1.1" },
+	{ "REMOTE_ADDR", "198.51.100.7" },
+	{ "REMOTE_PORT", "52114" },
+	{ "REQUEST_METHOD", "GET" },
+	{ "REQUEST_URI", "/index.php?page=1&sort=date" },
+	{ "QUERY_STRING", "page=1&sort=date" },
+	{ "SCRIPT_NAME", "/index.php" },
+	{ "SCRIPT_FILENAME", "/srv/www/index.php" },
+	{ "DOCUMENT_ROOT", "/srv/www" },
+	{ "HTTPS", "on" },
+	{ "HTTP_HOST", "www.example.com" },
+	{ "HTTP_USER_AGENT", "Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 Firefox/128.0" },
+	{ "HTTP_ACCEPT", "text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8" },
+	{ "HTTP_ACCEPT_LANGUAGE", "en-US,en;q=0.5" },
+	{ "HTTP_ACCEPT_ENCODING", "gzip, deflate, br" },
+	{ "HTTP_COOKIE", "session=0123456789abcdef0123456789abcdef; theme=dark" },
+};
+#define PARAMS_COUNT (sizeof(params) / sizeof(params[0]))
+
+typedef struct {
+	const gchar *name;
+	guint64 iterations, bytes, records, params;
+	gint64 usec;
+} codec_result;
+
+static volatile gsize sink; /* keeps the compiler from dropping the work */
+
+/* encodes CODEC_BENCH_REQUESTS requests into buf (if not NULL); returns the size */
+static gsize encode_requests(guint8 *buf, guint64 *records, guint64 *nparams) {
+	guint8 content[4096];
+	gsize pos = 0, len, i, j;
+
+	for (i = 0; i < CODEC_BENCH_REQUESTS; i++) {
+		guint16 id = 1 + (i % 4);
+
+		if (buf) fastcgi_record_encode_begin_request(buf + pos, id, FCGI_RESPONDER, FCGI_KEEP_CONN);
+		pos += 16;
+
+		for (len = 0, j = 0; j < PARAMS_COUNT; j++) {
+			gsize keylen = strlen(params[j].key), valuelen = strlen(params[j].value);
+			len += fastcgi_param_encode(content + len, params[j].key, keylen, params[j].value, valuelen);
+		}
+		if (buf) fastcgi_record_encode(buf + pos, FCGI_PARAMS, id, content, len);
+		pos += FASTCGI_RECORD_SIZE(len);
+		if (buf) fastcgi_record_encode(buf + pos, FCGI_PARAMS, id, NULL, 0);
+		pos += FCGI_HEADER_LEN;
+		if (buf) fastcgi_record_encode(buf + pos, FCGI_STDIN, id, NULL, 0);
+		pos += FCGI_HEADER_LEN;
+
+		*records += 4;
+		*nparams += PARAMS_COUNT;
+	}
+	return pos;
+}
+
+/* decodes input in pieces of fragment bytes, also decoding the parameters */
+static void decode_requests(const guint8 *input, gsize len, gsize fragment, guint64 *records, guint64 *nparams) {
+	fastcgi_decoder dec;
+	guint8 parambuf[4096];
+	gsize parambuf_used = 0, pos, end;
+
+	fastcgi_decoder_init(&dec);
+	for (pos = 0; pos < len; pos = end) {
+		gsize piece = 0;
+		end = MIN(pos + fragment, len);
+
+		for (;;) {
+			const guint8 *chunk = NULL;
+			gsize chunklen = 0, used = 0;
+			enum fastcgi_decoder_event ev = fastcgi_decoder_next(&dec, input + pos + piece, end - pos - piece, &used, &chunk, &chunklen);
+			piece += used;
+
+			if (FASTCGI_DECODER_NEED_MORE == ev) break;
+			if (FASTCGI_DECODER_RECORD == ev) {
+				(*records)++;
+				if (FCGI_PARAMS != dec.header.type) fastcgi_decoder_skip_record(&dec);
+			} else if (FASTCGI_DECODER_CONTENT == ev) {
+				/* the pairs are small, so it's fine to collect them for the whole record */
+				memcpy(parambuf + parambuf_used, chunk, chunklen);
+				parambuf_used += chunklen;
+				if (0 == dec.content_remaining) {
+					fastcgi_param param;
+					gsize p = 0;
+					gssize n;
+					while (0 < (n = fastcgi_param_decode(parambuf + p, parambuf_used - p, &param))) {
+						sink += param.keylen + param.valuelen;
+						(*nparams)++;
+						p += n;
+					}
+					parambuf_used = 0;
+				}
+			}
+		}
+	}
+}
+
+static void run_decode(codec_result *res, const guint8 *input, gsize len, gsize fragment, gdouble duration) {
+	gint64 start = g_get_monotonic_time(), deadline = start + (gint64) (duration * G_USEC_PER_SEC), now;
+
+	do {
+		decode_requests(input, len, fragment, &res->records, &res->params);
+		res->iterations++;
+		res->bytes += len;
+	} while ((now = g_get_monotonic_time()) < deadline);
+	res->usec = now - start;
+}
+
+static void run_encode(codec_result *res, guint8 *output, gdouble duration) {
+	gint64 start = g_get_monotonic_time(), deadline = start + (gint64) (duration * G_USEC_PER_SEC), now;
+
+	do {
+		res->bytes += encode_requests(output, &res->records, &res->params);
+		sink += output[8];
+		res->iterations++;
+	} while ((now = g_get_monotonic_time()) < deadline);
+	res->usec = now - start;
+}
+
+static void report(const codec_result *res, gsize fragment) {
+	gdouble secs = (gdouble) res->usec / G_USEC_PER_SEC;
+
+	printf("{\"case\": \"%s\", \"fragment\": %" G_GSIZE_FORMAT ", \"seconds\": %.3f, "
+		"\"requests_per_sec\": %.0f, \"records_per_sec\": %.0f, \"params_per_sec\": %.0f, \"mbytes_per_sec\": %.1f}\n",
+		res->name, fragment, secs,
+		(gdouble) res->iterations * CODEC_BENCH_REQUESTS / secs,
+		(gdouble) res->records / secs, (gdouble) res->params / secs,
+		(gdouble) res->bytes / secs / (1024*1024));
+	fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+	gdouble duration = 1;
+	gsize fragment = 4096, len;
+	guint64 dummy = 0;
+	guint8 *buf;
+	gint opt;
+	codec_result res;
+
+	while (-1 != (opt = getopt(argc, argv, "d:f:"))) {
+		switch (opt) {
+		case 'd': duration = g_ascii_strtod(optarg, NULL); break;
+		case 'f': fragment = (gsize) g_ascii_strtoull(optarg, NULL, 10); break;
+		default: goto usage;
+		}
+	}
+	if (optind != argc || duration <= 0 || 0 == fragment) goto usage;
+
+	len = encode_requests(NULL, &dummy, &dummy);
+	buf = g_malloc(len);
+	encode_requests(buf, &dummy, &dummy);
+
+	memset(&res, 0, sizeof(res));
+	res.name = "decode";
+	run_decode(&res, buf, len, len, duration);
+	report(&res, len);
+
+	memset(&res, 0, sizeof(res));
+	res.name = "decode";
+	run_decode(&res, buf, len, fragment, duration);
+	report(&res, fragment);
+
+	memset(&res, 0, sizeof(res));
+	res.name = "encode";
+	run_encode(&res, buf, duration);
+	report(&res, len);
+
+	g_free(buf);
+	return 0;
+
+usage:
+	fprintf(stderr, "usage: %s [-d seconds per case] [-f fragment size]\n", argv[0]);
+	return 1;
+}
@@ -0,0 +1,59 @@
+#!/bin/sh
+# runs the benchmark matrix and prints one JSON object per run (see afcgi-bench)
+#
+# usage: run.sh BENCH SERVER [more afcgi-bench options]
+# environment: BENCH_DURATION (seconds per run, 3), BENCH_THREADS (server workers, 1),
+#              BENCH_CONCURRENCY (16), BENCH_PORT (loopback tcp port, 9797),
+#              BENCH_COALESCE (server -o, output coalescing max copy bytes; 0: off, default)
+#
+# the tcp numbers assume TCP_NODELAY on both ends: libafcgi sets it on accepted connections and
+# afcgi-bench on its own. without BENCH_COALESCE every response is several small writes.
+
+bench=$1
+server=$2
+if [ -z "$bench" -o -z "$server" ]; then
+	echo "usage: $0 BENCH SERVER [afcgi-bench options]" >&2
+	exit 1
+fi
+shift 2
+
+duration=${BENCH_DURATION:-3}
+threads=${BENCH_THREADS:-1}
+concurrency=${BENCH_CONCURRENCY:-16}
+coalesce=${BENCH_COALESCE:-0}
+sock="${TMPDIR:-/tmp}/afcgi-bench.$$.sock"
+tcp="127.0.0.1:${BENCH_PORT:-9797}"
+failed=0
+
+trap 'rm -f "$sock"' EXIT
+
+for backend in libev uring; do
+	case $backend in
+	libev) uring_flag="" ;;
+	uring) uring_flag="-u" ;;
+	esac
+	for address in "$sock" "$tcp"; do
+		for conn in keepalive close; do
+			case $conn in
+			keepalive) conn_flag="" ;;
+			close) conn_flag="-C" ;;
+			esac
+			for size in small large; do
+				case $size in
+				small) size_flags="-p 256 -b 0 -r 128" ;;
+				large) size_flags="-p 1024 -b 16384 -r 65536" ;;
+				esac
+				if ! "$bench" -s "$address" -d "$duration" -c "$concurrency" $conn_flag $size_flags \
+				    -l "$backend $conn $size" -x "$server -t $threads -o $coalesce $uring_flag $address" "$@"; then
+					if [ $backend = uring ]; then
+						echo "io_uring backend not available, skipped" >&2
+						continue 4
+					fi
+					failed=1
+				fi
+			done
+		done
+	done
+done
+
+exit $failed
@@ -4,18 +4,167 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#ifdef HAVE_SYS_SENDFILE_H
+# include <sys/sendfile.h>
+#endif
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <unistd.h>
 #include <string.h>
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+# include <pthread.h>
+# include <sched.h>
+#endif
+#ifdef HAVE_LIBURING
+# include <liburing.h>
+# include <poll.h>
+#endif
+
+/* max number of chunks to combine in one writev() */
+#ifndef IOV_MAX
+# ifdef UIO_MAXIOV
+#  define IOV_MAX UIO_MAXIOV
+# else
+#  define IOV_MAX 16
+# endif
+#endif
+#define FASTCGI_IOV_MAX (IOV_MAX > 1024 ? 1024 : IOV_MAX)
+
+#define FASTCGI_DEFAULT_READ_BUFFER_SIZE (64*1024)
+
+#define FASTCGI_DEFAULT_ACCEPT_BUDGET 32
+
+#define FASTCGI_DEFAULT_WRITE_LOW_WATERMARK (64*1024)
+#define FASTCGI_DEFAULT_WRITE_HIGH_WATERMARK (256*1024)
+
+/* seconds until the connection limit is restored after running out of fds, unless a connection gets closed first */
+#define FASTCGI_EMFILE_RETRY 1.0
+
+/* seconds between the stats snapshots of a threaded server worker */
+#define FASTCGI_STATS_PUBLISH_INTERVAL 0.1
+
+/* timer wheel for the connection timeouts */
+#define FASTCGI_WHEEL_SLOTS 512 /* power of 2 */
+#define FASTCGI_WHEEL_TICK 0.25 /* seconds */
+#define FASTCGI_WHEEL_DUE G_MAXUINT64 /* wheel_tick of connections in wheel->due */
+
+enum { FASTCGI_TIMEOUT_NONE, FASTCGI_TIMEOUT_IDLE, FASTCGI_TIMEOUT_READ, FASTCGI_TIMEOUT_REQUEST };
+
+/* hashed timer wheel: a connection sits in the slot of the tick its earliest deadline falls into,
+ * deadlines further away than one round stay in the slot for more rounds */
+typedef struct fastcgi_timer_wheel {
+	ev_timer tick_watcher;
+	ev_tstamp start; /* time of tick 0 */
+	guint64 now; /* last processed tick */
+	GQueue slots[FASTCGI_WHEEL_SLOTS];
+	GQueue due; /* taken from the current slot, being checked by fastcgi_wheel_tick_cb */
+} fastcgi_timer_wheel;
+
+/* max number of request objects kept for reuse per server */
+#define FASTCGI_MAX_FREE_REQUESTS 64
+/* default for fastcgi_server_set_free_connections */
+#define FASTCGI_DEFAULT_MAX_FREE_CONNECTIONS 64
+
+/* worker thread states (fastcgi_thread_worker.state) */
+enum { FASTCGI_WORKER_RUNNING, FASTCGI_WORKER_STOP, FASTCGI_WORKER_SHUTDOWN };
+
+typedef struct fastcgi_thread_worker {
+	fastcgi_threaded_server *tsrv;
+	guint id;
+	gint cpu; /* -1: not pinned */
+	GThread *thread;
+	struct ev_loop *loop;
+	ev_async wakeup_watcher;
+	gint state; /* atomic */
+	ev_timer stats_watcher; /* publishes the stats every FASTCGI_STATS_PUBLISH_INTERVAL */
+	GMutex stats_lock;
+	fastcgi_server_stats stats; /* snapshot for fastcgi_threaded_server_get_stats, protected by stats_lock */
+} fastcgi_thread_worker;
+
+#ifdef HAVE_LIBURING
+#define FASTCGI_URING_ENTRIES 512
+/* provided receive buffers per server */
+#define FASTCGI_URING_BUFFERS 128 /* power of 2 */
+#define FASTCGI_URING_BUFFER_SIZE (16*1024)
+#define FASTCGI_URING_BGID 1
+/* max chunks per sendmsg */
+#define FASTCGI_URING_IOV_MAX 64
+
+/* user_data of submitted operations */
+typedef struct fastcgi_uring_op {
+	enum { FASTCGI_URING_ACCEPT, FASTCGI_URING_RECV, FASTCGI_URING_SEND, FASTCGI_URING_POLLOUT } type;
+	gboolean pending;
+	gpointer ctx; /* fastcgi_server for accept, fastcgi_connection otherwise */
+} fastcgi_uring_op;
+
+struct fastcgi_uring {
+	struct io_uring ring;
+	struct io_uring_buf_ring *buf_ring;
+	guint8 *buffers;
+	guint pending; /* operations the kernel still has to complete */
+	fastcgi_uring_op accept_op;
+	ev_io ring_watcher; /* completions */
+	ev_prepare submit_watcher; /* submits everything queued in a loop iteration at once */
+};
+
+struct fastcgi_uring_connection {
+	fastcgi_uring_op recv_op, send_op;
+	struct msghdr msg;
+	struct iovec iov[FASTCGI_URING_IOV_MAX];
+};
+
+static void fastcgi_uring_accept(fastcgi_server *fsrv);
+static void fastcgi_uring_cancel_accept(fastcgi_server *fsrv);
+static void fastcgi_uring_free(fastcgi_server *fsrv);
+static void fastcgi_uring_check_idle(fastcgi_server *fsrv);
+static void fastcgi_uring_connection_start(fastcgi_connection *fcon);
+static void fastcgi_uring_connection_free(fastcgi_connection *fcon);
+static gboolean fastcgi_uring_connection_busy(fastcgi_connection *fcon);
+static void fastcgi_uring_recv(fastcgi_connection *fcon);
+static void fastcgi_uring_send(fastcgi_connection *fcon);
+#endif
+
+/* max number of unused queue links / receive buffers kept per server */
+#define FASTCGI_POOL_MAX_LINKS 1024
+#define FASTCGI_POOL_MAX_BLOCKS 16
+#define FASTCGI_POOL_MAX_SMALL_BLOCKS 64
+
+/* receive buffers hold the payload of a complete record; short chunks get a small one */
+#define FASTCGI_POOL_BLOCK_SIZE (G_MAXUINT16 + 1)
+#define FASTCGI_POOL_SMALL_BLOCK_SIZE 4096
+
+/* max payload per record when splitting large data: multiple of 8, so no padding is needed */
+#define FASTCGI_RECORD_CHUNK_SIZE (G_MAXUINT16 & ~7u)
+
+/* buffer size for the pread() fallback if sendfile() isn't available */
+#define FASTCGI_FILE_READ_SIZE (16*1024)
+
+/* fd shared by all links of a file response, closed with the last link */
+typedef struct fastcgi_queue_file {
+	gint refcount;
+	gint fd;
+	const fastcgi_allocator *allocator; /* the one of the queue's pool it was created for */
+} fastcgi_queue_file;
 
 typedef struct fastcgi_queue_link {
 	GList queue_link;
-	enum { FASTCGI_QUEUE_STRING, FASTCGI_QUEUE_BYTEARRAY } elem_type;
+	enum { FASTCGI_QUEUE_STRING, FASTCGI_QUEUE_BYTEARRAY, FASTCGI_QUEUE_FILE, FASTCGI_QUEUE_BYTES, FASTCGI_QUEUE_STATIC, FASTCGI_QUEUE_INLINE } elem_type;
+	/* FASTCGI_QUEUE_FILE, FASTCGI_QUEUE_BYTES: range of the file/GBytes to send
+	 * FASTCGI_QUEUE_STATIC: length of the (not owned) memory in queue_link.data
+	 * FASTCGI_QUEUE_INLINE: length of inline_data */
+	goffset offset;
+	gsize length;
+	guint8 inline_data[16]; /* small records: header, end request */
+	gsize pool_block; /* FASTCGI_QUEUE_BYTEARRAY from fastcgi_pool_get_block: its block size, 0: not from the pool */
 } fastcgi_queue_link;
 
 /* some util functions */
 #define GSTR_LEN(x) ((x) ? (x)->str : ""), ((x) ? (x)->len : 0)
 #define GBARR_LEN(x) ((x)->data), ((x)->len)
+#define CONST_STR_LEN(x) (x), (sizeof(x) - 1)
 #define UNUSED(x) ((void)(x))
 #define ERROR(...) g_printerr("libafcgi.c:" G_STRINGIFY(__LINE__) ": " __VA_ARGS__)
 
@@ -34,32 +183,246 @@ static void fd_init(int fd) {
 #endif
 }
 
-static fastcgi_queue_link* fastcgi_queue_link_new_string(GString *s) {
-	fastcgi_queue_link *l = g_slice_new0(fastcgi_queue_link);
+/* allocator == NULL: g_slice */
+static gpointer fastcgi_mem_alloc(const fastcgi_allocator *allocator, gsize size) {
+	if (NULL == allocator) return g_slice_alloc(size);
+	return allocator->alloc(size, allocator->ctx);
+}
+
+static gpointer fastcgi_mem_alloc0(const fastcgi_allocator *allocator, gsize size) {
+	gpointer mem = fastcgi_mem_alloc(allocator, size);
+	memset(mem, 0, size);
+	return mem;
+}
+
+static void fastcgi_mem_free(const fastcgi_allocator *allocator, gpointer mem, gsize size) {
+	if (NULL == allocator) {
+		g_slice_free1(size, mem);
+	} else {
+		allocator->free(mem, size, allocator->ctx);
+	}
+}
+
+static void fastcgi_pool_init(fastcgi_pool *pool) {
+	pool->blocks = g_ptr_array_new();
+	pool->small_blocks = g_ptr_array_new();
+}
+
+static void fastcgi_pool_free_blocks(GPtrArray *blocks) {
+	guint i;
+	for (i = 0; i < blocks->len; i++) {
+		g_byte_array_free(g_ptr_array_index(blocks, i), TRUE);
+	}
+	g_ptr_array_set_size(blocks, 0);
+}
+
+static void fastcgi_pool_trim(fastcgi_pool *pool) {
+	while (pool->links) {
+		GList *l = pool->links;
+		pool->links = l->next;
+		fastcgi_mem_free(pool->allocator, l, sizeof(fastcgi_queue_link));
+	}
+	pool->links_count = 0;
+	fastcgi_pool_free_blocks(pool->blocks);
+	fastcgi_pool_free_blocks(pool->small_blocks);
+	pool->resident = 0;
+}
+
+static void fastcgi_pool_clear(fastcgi_pool *pool) {
+	fastcgi_pool_trim(pool);
+	g_ptr_array_free(pool->blocks, TRUE);
+	g_ptr_array_free(pool->small_blocks, TRUE);
+	pool->blocks = NULL;
+	pool->small_blocks = NULL;
+}
+
+/* size class for size bytes: FASTCGI_POOL_SMALL_BLOCK_SIZE or FASTCGI_POOL_BLOCK_SIZE */
+static gsize fastcgi_pool_block_size(gsize size) {
+	return (size <= FASTCGI_POOL_SMALL_BLOCK_SIZE) ? FASTCGI_POOL_SMALL_BLOCK_SIZE : FASTCGI_POOL_BLOCK_SIZE;
+}
+
+/* returns an empty buffer with room for fastcgi_pool_block_size(size) bytes */
+static GByteArray* fastcgi_pool_get_block(fastcgi_pool *pool, gsize size) {
+	gsize block_size = fastcgi_pool_block_size(size);
+	GPtrArray *blocks = (FASTCGI_POOL_SMALL_BLOCK_SIZE == block_size) ? pool->small_blocks : pool->blocks;
+	if (blocks->len > 0) {
+		pool->block_hits++;
+		pool->resident -= block_size;
+		return g_ptr_array_remove_index_fast(blocks, blocks->len - 1);
+	}
+	pool->block_misses++;
+	return g_byte_array_sized_new(block_size);
+}
+
+/* kills buf; only for buffers from fastcgi_pool_get_block, block_size as returned by fastcgi_pool_block_size */
+static void fastcgi_pool_put_block(fastcgi_pool *pool, GByteArray *buf, gsize block_size) {
+	GPtrArray *blocks = pool->blocks;
+	guint max = FASTCGI_POOL_MAX_BLOCKS;
+	if (FASTCGI_POOL_SMALL_BLOCK_SIZE == block_size) {
+		blocks = pool->small_blocks;
+		max = FASTCGI_POOL_MAX_SMALL_BLOCKS;
+	}
+	/* a block that grew beyond its size isn't worth keeping */
+	if (blocks->len >= max || buf->len > block_size) {
+		g_byte_array_free(buf, TRUE);
+		return;
+	}
+	g_byte_array_set_size(buf, 0);
+	g_ptr_array_add(blocks, buf);
+	pool->resident += block_size;
+}
+
+/* kills buf; a buffer from receive_chunk with its length unchanged */
+static void fastcgi_pool_put_chunk(fastcgi_pool *pool, GByteArray *buf) {
+	fastcgi_pool_put_block(pool, buf, fastcgi_pool_block_size(buf->len));
+}
+
+static fastcgi_queue_link* fastcgi_queue_link_alloc(fastcgi_queue *queue) {
+	fastcgi_pool *pool = queue->pool;
+	fastcgi_queue_link *l;
+	if (!pool) return g_slice_new0(fastcgi_queue_link);
+	if (!pool->links) {
+		pool->link_misses++;
+		return fastcgi_mem_alloc0(pool->allocator, sizeof(fastcgi_queue_link));
+	}
+	pool->link_hits++;
+	l = (fastcgi_queue_link*) pool->links;
+	pool->links = l->queue_link.next;
+	pool->links_count--;
+	pool->resident -= sizeof(fastcgi_queue_link);
+	memset(l, 0, sizeof(*l));
+	return l;
+}
+
+static void fastcgi_queue_link_release(fastcgi_queue *queue, fastcgi_queue_link *l) {
+	fastcgi_pool *pool = queue ? queue->pool : NULL;
+	if (!pool) {
+		g_slice_free(fastcgi_queue_link, l);
+		return;
+	}
+	if (pool->links_count >= FASTCGI_POOL_MAX_LINKS) {
+		fastcgi_mem_free(pool->allocator, l, sizeof(fastcgi_queue_link));
+		return;
+	}
+	l->queue_link.next = pool->links;
+	pool->links = &l->queue_link;
+	pool->links_count++;
+	pool->resident += sizeof(fastcgi_queue_link);
+}
+
+static fastcgi_queue_link* fastcgi_queue_link_new_string(fastcgi_queue *queue, GString *s) {
+	fastcgi_queue_link *l = fastcgi_queue_link_alloc(queue);
 	l->queue_link.data = s;
 	l->elem_type = FASTCGI_QUEUE_STRING;
 	return l;
 }
 
-static fastcgi_queue_link* fastcgi_queue_link_new_bytearray(GByteArray *a) {
-	fastcgi_queue_link *l = g_slice_new0(fastcgi_queue_link);
+static fastcgi_queue_link* fastcgi_queue_link_new_bytearray(fastcgi_queue *queue, GByteArray *a) {
+	fastcgi_queue_link *l = fastcgi_queue_link_alloc(queue);
 	l->queue_link.data = a;
-	l->elem_type = FASTCGI_QUEUE_BYTEARRAY ;
+	l->elem_type = FASTCGI_QUEUE_BYTEARRAY;
+	return l;
+}
+
+static fastcgi_queue_file* fastcgi_queue_file_new(fastcgi_queue *queue, gint fd) {
+	const fastcgi_allocator *allocator = queue->pool ? queue->pool->allocator : NULL;
+	fastcgi_queue_file *file = fastcgi_mem_alloc0(allocator, sizeof(fastcgi_queue_file));
+	file->refcount = 1;
+	file->fd = fd;
+	file->allocator = allocator;
+	return file;
+}
+
+static void fastcgi_queue_file_release(fastcgi_queue_file *file) {
+	g_assert(file->refcount > 0);
+	if (0 != --file->refcount) return;
+	close(file->fd);
+	fastcgi_mem_free(file->allocator, file, sizeof(fastcgi_queue_file));
+}
+
+static fastcgi_queue_link* fastcgi_queue_link_new_file(fastcgi_queue *queue, fastcgi_queue_file *file, goffset offset, gsize length) {
+	fastcgi_queue_link *l = fastcgi_queue_link_alloc(queue);
+	file->refcount++;
+	l->queue_link.data = file;
+	l->elem_type = FASTCGI_QUEUE_FILE;
+	l->offset = offset;
+	l->length = length;
+	return l;
+}
+
+static fastcgi_queue_link* fastcgi_queue_link_new_bytes(fastcgi_queue *queue, GBytes *bytes, gsize offset, gsize length) {
+	fastcgi_queue_link *l = fastcgi_queue_link_alloc(queue);
+	l->queue_link.data = bytes;
+	l->elem_type = FASTCGI_QUEUE_BYTES;
+	l->offset = offset;
+	l->length = length;
 	return l;
 }
 
+static fastcgi_queue_link* fastcgi_queue_link_new_static(fastcgi_queue *queue, const guint8 *data, gsize length) {
+	fastcgi_queue_link *l = fastcgi_queue_link_alloc(queue);
+	l->queue_link.data = (gpointer) data;
+	l->elem_type = FASTCGI_QUEUE_STATIC;
+	l->length = length;
+	return l;
+}
+
+static gsize fastcgi_queue_link_length(fastcgi_queue_link *l) {
+	switch (l->elem_type) {
+	case FASTCGI_QUEUE_STRING:
+		return ((GString*) l->queue_link.data)->len;
+	case FASTCGI_QUEUE_BYTEARRAY:
+		return ((GByteArray*) l->queue_link.data)->len;
+	case FASTCGI_QUEUE_FILE:
+	case FASTCGI_QUEUE_BYTES:
+	case FASTCGI_QUEUE_STATIC:
+	case FASTCGI_QUEUE_INLINE:
+		return l->length;
+	}
+	g_error("invalid fastcgi_queue_link type\n");
+	return 0;
+}
+
+/* bytes the link keeps in memory; shared GBytes are counted for every slice */
+static gsize fastcgi_queue_link_memory(fastcgi_queue_link *l) {
+	switch (l->elem_type) {
+	case FASTCGI_QUEUE_FILE:
+	case FASTCGI_QUEUE_STATIC:
+		return 0;
+	default:
+		return fastcgi_queue_link_length(l);
+	}
+}
+
 static void fastcgi_queue_link_free(fastcgi_queue *queue, fastcgi_queue_link *l) {
+	if (queue) {
+		gsize mem = fastcgi_queue_link_memory(l);
+		queue->length -= fastcgi_queue_link_length(l);
+		queue->memory -= mem;
+		if (queue->memory_total) *queue->memory_total -= mem;
+	}
 	switch (l->elem_type) {
 	case FASTCGI_QUEUE_STRING:
-		if (queue) queue->length -= ((GString*)l->queue_link.data)->len;
 		g_string_free(l->queue_link.data, TRUE);
 		break;
 	case FASTCGI_QUEUE_BYTEARRAY:
-		if (queue) queue->length -= ((GByteArray*)l->queue_link.data)->len;
-		g_byte_array_free(l->queue_link.data, TRUE);
+		if (0 != l->pool_block && queue && queue->pool) {
+			fastcgi_pool_put_block(queue->pool, l->queue_link.data, l->pool_block);
+		} else {
+			g_byte_array_free(l->queue_link.data, TRUE);
+		}
+		break;
+	case FASTCGI_QUEUE_FILE:
+		fastcgi_queue_file_release(l->queue_link.data);
+		break;
+	case FASTCGI_QUEUE_BYTES:
+		g_bytes_unref(l->queue_link.data);
+		break;
+	case FASTCGI_QUEUE_STATIC:
+	case FASTCGI_QUEUE_INLINE:
 		break;
 	}
-	g_slice_free(fastcgi_queue_link, l);
+	fastcgi_queue_link_release(queue, l);
 }
 
 static fastcgi_queue_link *fastcgi_queue_peek_head(fastcgi_queue *queue) {
@@ -70,8 +433,24 @@ static fastcgi_queue_link *fastcgi_queue_pop_head(fastcgi_queue *queue) {
 	return (fastcgi_queue_link*) g_queue_pop_head_link(&queue->queue);
 }
 
+/* the open record (see stream_send_coalesced) stops growing */
+static void fastcgi_queue_close_record(fastcgi_queue *queue) {
+	queue->open_header = NULL;
+	queue->open_record = NULL;
+}
+
+static void fastcgi_queue_push(fastcgi_queue *queue, fastcgi_queue_link *l) {
+	gsize mem = fastcgi_queue_link_memory(l);
+	fastcgi_queue_close_record(queue);
+	g_queue_push_tail_link(&queue->queue, (GList*) l);
+	queue->length += fastcgi_queue_link_length(l);
+	queue->memory += mem;
+	if (queue->memory_total) *queue->memory_total += mem;
+}
+
 void fastcgi_queue_clear(fastcgi_queue *queue) {
 	fastcgi_queue_link *l;
+	fastcgi_queue_close_record(queue);
 	queue->offset = 0;
 	while (NULL != (l = fastcgi_queue_pop_head(queue))) {
 		fastcgi_queue_link_free(queue, l);
@@ -83,87 +462,272 @@ void fastcgi_queue_append_string(fastcgi_queue *queue, GString *buf) {
 	fastcgi_queue_link *l;
 	if (!buf) return;
 	if (!buf->len) { g_string_free(buf, TRUE); return; }
-	l = fastcgi_queue_link_new_string(buf);
-	g_queue_push_tail_link(&queue->queue, (GList*) l);
-	queue->length += buf->len;
+	l = fastcgi_queue_link_new_string(queue, buf);
+	fastcgi_queue_push(queue, l);
 }
 
 void fastcgi_queue_append_bytearray(fastcgi_queue *queue, GByteArray *buf) {
 	fastcgi_queue_link *l;
 	if (!buf) return;
 	if (!buf->len) { g_byte_array_free(buf, TRUE); return; }
-	l = fastcgi_queue_link_new_bytearray(buf);
-	g_queue_push_tail_link(&queue->queue, (GList*) l);
-	queue->length += buf->len;
+	l = fastcgi_queue_link_new_bytearray(queue, buf);
+	fastcgi_queue_push(queue, l);
 }
 
-/* return values: 0 ok, -1 error, -2 con closed */
-gint fastcgi_queue_write(int fd, fastcgi_queue *queue, gsize max_write) {
+/* buf is from fastcgi_pool_get_block(queue->pool) and goes back there when it was written */
+static void fastcgi_queue_append_pool_block(fastcgi_queue *queue, GByteArray *buf, gsize block_size) {
+	fastcgi_queue_link *l;
+	g_assert(NULL != queue->pool && buf->len > 0);
+	l = fastcgi_queue_link_new_bytearray(queue, buf);
+	l->pool_block = block_size;
+	fastcgi_queue_push(queue, l);
+}
+
+/* takes over the reference; doesn't copy the data */
+void fastcgi_queue_append_bytes(fastcgi_queue *queue, GBytes *bytes) {
+	fastcgi_queue_link *l;
+	gsize len;
+	if (!bytes) return;
+	len = g_bytes_get_size(bytes);
+	if (!len) { g_bytes_unref(bytes); return; }
+	l = fastcgi_queue_link_new_bytes(queue, bytes, 0, len);
+	fastcgi_queue_push(queue, l);
+}
+
+/* references bytes */
+static void fastcgi_queue_append_bytes_range(fastcgi_queue *queue, GBytes *bytes, gsize offset, gsize length) {
+	fastcgi_queue_link *l = fastcgi_queue_link_new_bytes(queue, g_bytes_ref(bytes), offset, length);
+	fastcgi_queue_push(queue, l);
+}
+
+/* data must stay valid until the queue is done with it */
+static void fastcgi_queue_append_static(fastcgi_queue *queue, const guint8 *data, gsize length) {
+	fastcgi_queue_link *l;
+	if (!length) return;
+	l = fastcgi_queue_link_new_static(queue, data, length);
+	fastcgi_queue_push(queue, l);
+}
+
+/* returns length bytes of inline storage in a new queue element */
+static guint8* fastcgi_queue_append_inline(fastcgi_queue *queue, gsize length) {
+	fastcgi_queue_link *l = fastcgi_queue_link_alloc(queue);
+	g_assert(length <= sizeof(l->inline_data));
+	l->elem_type = FASTCGI_QUEUE_INLINE;
+	l->length = length;
+	fastcgi_queue_push(queue, l);
+	return l->inline_data;
+}
+
+static void fastcgi_queue_append_file_range(fastcgi_queue *queue, fastcgi_queue_file *file, goffset offset, gsize length) {
+	fastcgi_queue_link *l = fastcgi_queue_link_new_file(queue, file, offset, length);
+	fastcgi_queue_push(queue, l);
+}
+
+void fastcgi_queue_append_file(fastcgi_queue *queue, gint fd, goffset offset, gsize length) {
+	fastcgi_queue_file *file = fastcgi_queue_file_new(queue, fd);
+	if (length > 0) fastcgi_queue_append_file_range(queue, file, offset, length);
+	fastcgi_queue_file_release(file);
+}
+
+/* drop len bytes from the front of the queue */
+static void fastcgi_queue_skip(fastcgi_queue *queue, gsize len) {
+	while (len > 0) {
+		fastcgi_queue_link *l = fastcgi_queue_peek_head(queue);
+		gsize avail = fastcgi_queue_link_length(l) - queue->offset;
+		if (len < avail) {
+			queue->offset += len;
+			return;
+		}
+		len -= avail;
+		queue->offset = 0;
+		fastcgi_queue_link_free(queue, fastcgi_queue_pop_head(queue));
+	}
+}
+
+/* fill iov with up to iov_max chunks from the queue, but not more than max_write bytes;
+ * stops at the first file chunk.
+ * returns number of used iovec entries, *len is set to the total length */
+static guint fastcgi_queue_fill_iovec(fastcgi_queue *queue, struct iovec *iov, guint iov_max, gsize max_write, gsize *len) {
+	GList *it;
+	gsize offset = queue->offset, total = 0;
+	guint n = 0;
+
+	/* the iovecs point into the queue */
+	fastcgi_queue_close_record(queue);
+
+	for (it = g_queue_peek_head_link(&queue->queue); it && n < iov_max && total < max_write; it = it->next) {
+		fastcgi_queue_link *l = (fastcgi_queue_link*) it;
+		gsize datalen;
+		gchar *data;
+		switch (l->elem_type) {
+		case FASTCGI_QUEUE_STRING:
+			data = ((GString*) l->queue_link.data)->str;
+			datalen = ((GString*) l->queue_link.data)->len;
+			break;
+		case FASTCGI_QUEUE_BYTEARRAY:
+			data = (gchar*) ((GByteArray*) l->queue_link.data)->data;
+			datalen = ((GByteArray*) l->queue_link.data)->len;
+			break;
+		case FASTCGI_QUEUE_BYTES:
+			data = (gchar*) g_bytes_get_data(l->queue_link.data, NULL) + l->offset;
+			datalen = l->length;
+			break;
+		case FASTCGI_QUEUE_STATIC:
+			data = l->queue_link.data;
+			datalen = l->length;
+			break;
+		case FASTCGI_QUEUE_INLINE:
+			data = (gchar*) l->inline_data;
+			datalen = l->length;
+			break;
+		case FASTCGI_QUEUE_FILE:
+			*len = total;
+			return n;
+		default:
+			g_error("invalid fastcgi_queue_link type\n");
+		}
+		data += offset; datalen -= offset;
+		offset = 0;
+		if (datalen > max_write - total) datalen = max_write - total;
+		iov[n].iov_base = data;
+		iov[n].iov_len = datalen;
+		total += datalen;
+		n++;
+	}
+
+	*len = total;
+	return n;
+}
+
+/* send up to len bytes of a file chunk at (chunk) offset to fd;
+ * returns number of bytes written or -1 (errno set) like write() */
+static gssize fastcgi_queue_sendfile(int fd, fastcgi_queue_link *l, gsize offset, gsize len, fastcgi_server_stats *stats) {
+	fastcgi_queue_file *file = l->queue_link.data;
+	off_t file_offset = l->offset + offset;
+	guint8 buf[FASTCGI_FILE_READ_SIZE];
+	gsize done = 0;
+	gssize r;
+
+#ifdef HAVE_SYS_SENDFILE_H
+	r = sendfile(fd, file->fd, &file_offset, len);
+	if (stats) stats->write_syscalls++;
+	if (-1 == r && (EINVAL == errno || ENOSYS == errno)) {
+		/* fd type not supported for sendfile(), use read() + write() */
+		file_offset = l->offset + offset;
+	} else if (0 == r) {
+		goto truncated;
+	} else {
+		return r;
+	}
+#endif
+
+	/* one buffer at a time until len is written or the socket is full */
+	while (done < len) {
+		gssize w;
+
+		r = pread(file->fd, buf, MIN(len - done, sizeof(buf)), file_offset + done);
+		if (stats) stats->write_syscalls++;
+		if (-1 == r) {
+			ERROR("pread from fd=%d failed, %s\n", file->fd, g_strerror(errno));
+			errno = EIO;
+			return -1;
+		}
+		if (0 == r) goto truncated;
+
+		w = write(fd, buf, r);
+		if (stats) stats->write_syscalls++;
+		if (-1 == w) return (done > 0) ? (gssize) done : -1;
+		done += w;
+		if (w < r) break;
+	}
+	return done;
+
+truncated:
+	/* can't send less than we announced in the record header */
+	ERROR("file fd=%d is shorter than expected\n", file->fd);
+	errno = EIO;
+	return -1;
+}
+
+#ifdef TCP_CORK
+/* more than one syscall: more chunks than fit into one writev(), or a file chunk mixed with buffered data */
+static gboolean fastcgi_queue_needs_cork(fastcgi_queue *queue) {
+	GList *it;
+
+	if (queue->queue.length > FASTCGI_IOV_MAX) return TRUE;
+	if (queue->queue.length < 2) return FALSE;
+	for (it = g_queue_peek_head_link(&queue->queue); NULL != it; it = it->next) {
+		if (FASTCGI_QUEUE_FILE == ((fastcgi_queue_link*) it)->elem_type) return TRUE;
+	}
+	return FALSE;
+}
+#endif
+
+/* return values: 0 ok, -1 error, -2 con closed
+ * counts the write syscalls and EAGAINs in stats (if not NULL) */
+static gint fastcgi_queue_writev(int fd, fastcgi_queue *queue, gsize max_write, fastcgi_server_stats *stats) {
+	struct iovec iov[FASTCGI_IOV_MAX];
 	gsize rem_write = max_write;
-	g_assert(rem_write <= G_MAXSSIZE);
 #ifdef TCP_CORK
 	int corked = 0;
 #endif
+	g_assert(rem_write <= G_MAXSSIZE);
 
 #ifdef TCP_CORK
-	/* Linux: put a cork into the socket as we want to combine the write() calls
-	 * but only if we really have multiple chunks
+	/* Linux: put a cork into the socket as we want to combine the writev() calls
+	 * but only if we really need more than one
 	 */
-	if (queue->queue.length > 1) {
+	if (fastcgi_queue_needs_cork(queue)) {
 		corked = 1;
 		setsockopt(fd, IPPROTO_TCP, TCP_CORK, &corked, sizeof(corked));
 	}
 #endif
 
 	while (rem_write > 0 && queue->length > 0) {
-		fastcgi_queue_link *l = fastcgi_queue_peek_head(queue);
-		gsize towrite, datalen;
+		gsize towrite;
+		guint niov = fastcgi_queue_fill_iovec(queue, iov, FASTCGI_IOV_MAX, rem_write, &towrite);
 		gssize res;
-		gchar *data;
-		switch (l->elem_type) {
-		case FASTCGI_QUEUE_STRING:
-			data = ((GString*) l->queue_link.data)->str;
-			datalen = towrite = ((GString*) l->queue_link.data)->len;
-			break;
-		case FASTCGI_QUEUE_BYTEARRAY:
-			data = (gchar*) ((GByteArray*) l->queue_link.data)->data;
-			datalen = towrite = ((GByteArray*) l->queue_link.data)->len;
-			break;
-		default:
-			g_error("invalid fastcgi_queue_link type\n");
+
+		if (0 == niov) {
+			/* file chunk at the head */
+			fastcgi_queue_link *l = fastcgi_queue_peek_head(queue);
+			towrite = MIN(l->length - queue->offset, rem_write);
+			res = fastcgi_queue_sendfile(fd, l, queue->offset, towrite, stats);
+		} else {
+			res = writev(fd, iov, niov);
+			if (stats) stats->write_syscalls++;
 		}
-		towrite -= queue->offset; data += queue->offset;
-		if (towrite > rem_write) towrite = rem_write;
-		res = write(fd, data, towrite);
 		if (-1 == res) {
+			int err = errno;
 #ifdef TCP_CORK
 			if (corked) {
+				/* fails on unix sockets, keep errno of the write */
 				corked = 0;
 				setsockopt(fd, IPPROTO_TCP, TCP_CORK, &corked, sizeof(corked));
 			}
 #endif
-			switch (errno) {
-			case EINTR:
+			switch (err) {
 			case EAGAIN:
 #if EWOULDBLOCK != EAGAIN
 			case EWOULDBLOCK:
 #endif
+				if (stats) stats->write_eagain++;
+				return 0; /* try again later */
+			case EINTR:
 				return 0; /* try again later */
 			case ECONNRESET:
 			case EPIPE:
 				return -2;
 			default:
-				ERROR("write to fd=%d failed, %s\n", fd, g_strerror(errno) );
+				ERROR("writev to fd=%d failed, %s\n", fd, g_strerror(err) );
 				return -1;
 			}
-		} else {
-			queue->offset += res;
-			rem_write -= res;
-			if (queue->offset == datalen) {
-				queue->offset = 0;
-				fastcgi_queue_link_free(queue, fastcgi_queue_pop_head(queue));
-			}
 		}
+
+		fastcgi_queue_skip(queue, res);
+		rem_write -= res;
+		/* short write: socket buffer is full, don't waste a syscall on EAGAIN */
+		if ((gsize) res < towrite) break;
 	}
 
 #ifdef TCP_CORK
@@ -176,6 +740,10 @@ gint fastcgi_queue_write(int fd, fastcgi_queue *queue, gsize max_write) {
 	return 0;
 }
 
+/* return values: 0 ok, -1 error, -2 con closed */
+gint fastcgi_queue_write(int fd, fastcgi_queue *queue, gsize max_write) {
+	return fastcgi_queue_writev(fd, queue, max_write, NULL);
+}
 
 static void ev_io_add_events(struct ev_loop *loop, ev_io *watcher, int events) {
 	if ((watcher->events & events) == events) return;
@@ -192,683 +760,3887 @@ static void ev_io_rem_events(struct ev_loop *loop, ev_io *watcher, int events) {
 }
 /* end: some util functions */
 
-static const guint8 __padding[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+/* arena: bump allocator, everything is released at once */
+#define FASTCGI_ARENA_CHUNK_SIZE 4096
+#define FASTCGI_ARENA_MAX_KEEP (64*1024) /* larger chunks aren't kept by fastcgi_arena_reset */
 
-static void append_padding_str(GString *s, guint8 padlen) {
-	g_string_append_len(s, (const gchar*) __padding, padlen);
-}
+struct fastcgi_arena_chunk {
+	struct fastcgi_arena_chunk *next;
+	gsize size, used;
+	guint8 data[];
+};
+
+static gpointer fastcgi_arena_alloc(fastcgi_arena *arena, gsize size) {
+	struct fastcgi_arena_chunk *c = arena->chunks;
+	gpointer p;
+
+	size = (size + 7) & ~(gsize) 7;
+	if (NULL == c || c->size - c->used < size) {
+		/* chunks grow, so the first chunk is the largest one */
+		gsize csize = (NULL != c) ? 2 * c->size : FASTCGI_ARENA_CHUNK_SIZE;
+		if (csize < size) csize = size;
+		c = fastcgi_mem_alloc(arena->allocator, sizeof(struct fastcgi_arena_chunk) + csize);
+		c->size = csize;
+		c->used = 0;
+		c->next = arena->chunks;
+		arena->chunks = c;
+		arena->size += csize;
+	}
 
-static void append_padding_bytearray(GByteArray *a, guint8 padlen) {
-	g_byte_array_append(a, __padding, padlen);
+	p = c->data + c->used;
+	c->used += size;
+	return p;
 }
 
-/* returns padding length */
-static guint8 stream_build_fcgi_record(GByteArray *buf, guint8 type, guint16 requestid, guint16 datalen) {
-	guint8 padlen = (8 - (datalen & 0x7)) % 8; /* padding must be < 8 */
-
-	/* alloc enough space */
-	g_byte_array_set_size(buf, FCGI_HEADER_LEN);
-	buf->len = 0;
-
-	buf->data[buf->len++] = FCGI_VERSION_1;
-	buf->data[buf->len++] = type;
-	buf->data[buf->len++] = (guint8) (requestid >> 8);
-	buf->data[buf->len++] = (guint8) (requestid);
-	buf->data[buf->len++] = (guint8) (datalen >> 8);
-	buf->data[buf->len++] = (guint8) (datalen);
-	buf->data[buf->len++] = padlen;
-	buf->data[buf->len++] = 0;
-	return padlen;
+static gchar* fastcgi_arena_strndup(fastcgi_arena *arena, const gchar *s, gsize len) {
+	gchar *d = fastcgi_arena_alloc(arena, len + 1);
+	memcpy(d, s, len);
+	d[len] = '\0';
+	return d;
 }
 
-/* returns padding length */
-static guint8 stream_send_fcgi_record(fastcgi_queue *out, guint8 type, guint16 requestid, guint16 datalen) {
-	GByteArray *record = g_byte_array_sized_new(FCGI_HEADER_LEN);
-	guint8 padlen = stream_build_fcgi_record(record, type, requestid, datalen);
-	fastcgi_queue_append_bytearray(out, record);
-	return padlen;
+static void fastcgi_arena_chunk_free(fastcgi_arena *arena, struct fastcgi_arena_chunk *c) {
+	arena->size -= c->size;
+	fastcgi_mem_free(arena->allocator, c, sizeof(struct fastcgi_arena_chunk) + c->size);
 }
 
-static void stream_send_data(fastcgi_queue *out, guint8 type, guint16 requestid, const guint8 *data, size_t datalen) {
-	while (datalen > 0) {
-		guint16 tosend = (datalen > G_MAXUINT16) ? G_MAXUINT16 : datalen;
-		guint8 padlen = stream_send_fcgi_record(out, type, requestid, tosend);
-		GByteArray *buf = g_byte_array_sized_new(tosend + padlen);
-		g_byte_array_append(buf, data, tosend);
-		append_padding_bytearray(buf, padlen);
-		fastcgi_queue_append_bytearray(out, buf);
-		data += tosend;
-		datalen -= tosend;
+static void fastcgi_arena_clear(fastcgi_arena *arena) {
+	while (NULL != arena->chunks) {
+		struct fastcgi_arena_chunk *c = arena->chunks;
+		arena->chunks = c->next;
+		fastcgi_arena_chunk_free(arena, c);
 	}
 }
 
-/* kills string */
-static void stream_send_string(fastcgi_queue *out, guint8 type, guint16 requestid, GString *data) {
-	if (data->len > G_MAXUINT16) {
-		stream_send_data(out, type, requestid, (const guint8*) GSTR_LEN(data));
-		g_string_free(data, TRUE);
-	} else {
-		guint8 padlen = stream_send_fcgi_record(out, type, requestid, data->len);
-		append_padding_str(data, padlen);
-		fastcgi_queue_append_string(out, data);
+/* release everything but keep the largest chunk for reuse (unless a handler made it huge) */
+static void fastcgi_arena_reset(fastcgi_arena *arena) {
+	struct fastcgi_arena_chunk *c = arena->chunks;
+	if (NULL == c) return;
+	if (c->size > FASTCGI_ARENA_MAX_KEEP) {
+		fastcgi_arena_clear(arena);
+		return;
+	}
+	while (NULL != c->next) {
+		struct fastcgi_arena_chunk *n = c->next;
+		c->next = n->next;
+		fastcgi_arena_chunk_free(arena, n);
 	}
+	c->used = 0;
 }
+/* end: arena */
 
-/* kills bytearray */
-static void stream_send_bytearray(fastcgi_queue *out, guint8 type, guint16 requestid, GByteArray *data) {
-	if (data->len > G_MAXUINT16) {
-		stream_send_data(out, type, requestid, GBARR_LEN(data));
-		g_byte_array_free(data, TRUE);
-	} else {
-		guint8 padlen = stream_send_fcgi_record(out, type, requestid, data->len);
-		append_padding_bytearray(data, padlen);
-		fastcgi_queue_append_bytearray(out, data);
+/* environ: flat array of key/value pairs with an open addressing index (linear probing, at most half full).
+ * keys and values are copied into the request arena: a pair may be split across FCGI_PARAMS records,
+ * and the lookups return '\0' terminated strings */
+static guint32 environ_hash(const gchar *key, gsize keylen) {
+	guint32 h = 2166136261u; /* FNV-1a */
+	gsize i;
+	for (i = 0; i < keylen; i++) {
+		h = (h ^ (guint8) key[i]) * 16777619u;
 	}
+	return h;
 }
 
-static void stream_send_end_request(fastcgi_queue *out, guint16 requestID, gint32 appStatus, enum FCGI_ProtocolStatus status) {
-	GByteArray *record;
-
-	record = g_byte_array_sized_new(16);
-	stream_build_fcgi_record(record, FCGI_END_REQUEST, requestID, 8);
-
-	/* alloc enough space */
-	g_byte_array_set_size(record, 16);
-	record->len = 8;
-
-	appStatus = htonl(appStatus);
-	g_byte_array_append(record, (const guchar*) &appStatus, sizeof(appStatus));
-	record->data[record->len++] = status;
-	g_byte_array_append(record, __padding, 3);
-	fastcgi_queue_append_bytearray(out, record);
+static fastcgi_environ_entry* environ_find(const fastcgi_environ *env, guint32 hash, const gchar *key, gsize keylen) {
+	guint mask = 2 * env->size - 1, slot;
+	if (0 == env->size) return NULL;
+	for (slot = hash & mask; 0 != env->index[slot]; slot = (slot + 1) & mask) {
+		fastcgi_environ_entry *e = &env->entries[env->index[slot] - 1];
+		if (e->hash == hash && e->keylen == keylen && 0 == memcmp(e->key, key, keylen)) return e;
+	}
+	return NULL;
 }
 
+static void environ_index_add(fastcgi_environ *env, guint i) {
+	guint mask = 2 * env->size - 1, slot;
+	for (slot = env->entries[i].hash & mask; 0 != env->index[slot]; slot = (slot + 1) & mask) ;
+	env->index[slot] = i + 1;
+}
 
-static void write_queue(fastcgi_connection *fcon) {
-	if (fcon->closing) return;
+/* perfect hash for the well known variables: slot = (3*key[3] + 3*key[keylen-2] + keylen) & 31
+ * (the table has to be regenerated when the list changes) */
+static const struct {
+	const gchar *name;
+	gsize len;
+	enum fastcgi_env_var var;
+} environ_known_table[32] = {
+	/*  0 */ { CONST_STR_LEN("REQUEST_URI"), FASTCGI_ENV_REQUEST_URI },
+	/*  1 */ { NULL, 0, 0 },
+	/*  2 */ { NULL, 0, 0 },
+	/*  3 */ { CONST_STR_LEN("SERVER_PORT"), FASTCGI_ENV_SERVER_PORT },
+	/*  4 */ { CONST_STR_LEN("REMOTE_ADDR"), FASTCGI_ENV_REMOTE_ADDR },
+	/*  5 */ { CONST_STR_LEN("HTTPS"), FASTCGI_ENV_HTTPS },
+	/*  6 */ { CONST_STR_LEN("CONTENT_LENGTH"), FASTCGI_ENV_CONTENT_LENGTH },
+	/*  7 */ { NULL, 0, 0 },
+	/*  8 */ { NULL, 0, 0 },
+	/*  9 */ { CONST_STR_LEN("HTTP_USER_AGENT"), FASTCGI_ENV_HTTP_USER_AGENT },
+	/* 10 */ { NULL, 0, 0 },
+	/* 11 */ { NULL, 0, 0 },
+	/* 12 */ { CONST_STR_LEN("QUERY_STRING"), FASTCGI_ENV_QUERY_STRING },
+	/* 13 */ { CONST_STR_LEN("SCRIPT_NAME"), FASTCGI_ENV_SCRIPT_NAME },
+	/* 14 */ { CONST_STR_LEN("REMOTE_PORT"), FASTCGI_ENV_REMOTE_PORT },
+	/* 15 */ { NULL, 0, 0 },
+	/* 16 */ { NULL, 0, 0 },
+	/* 17 */ { CONST_STR_LEN("SCRIPT_FILENAME"), FASTCGI_ENV_SCRIPT_FILENAME },
+	/* 18 */ { CONST_STR_LEN("HTTP_HOST"), FASTCGI_ENV_HTTP_HOST },
+	/* 19 */ { CONST_STR_LEN("PATH_INFO"), FASTCGI_ENV_PATH_INFO },
+	/* 20 */ { CONST_STR_LEN("SERVER_NAME"), FASTCGI_ENV_SERVER_NAME },
+	/* 21 */ { NULL, 0, 0 },
+	/* 22 */ { CONST_STR_LEN("HTTP_COOKIE"), FASTCGI_ENV_HTTP_COOKIE },
+	/* 23 */ { NULL, 0, 0 },
+	/* 24 */ { CONST_STR_LEN("CONTENT_TYPE"), FASTCGI_ENV_CONTENT_TYPE },
+	/* 25 */ { CONST_STR_LEN("DOCUMENT_ROOT"), FASTCGI_ENV_DOCUMENT_ROOT },
+	/* 26 */ { CONST_STR_LEN("REQUEST_METHOD"), FASTCGI_ENV_REQUEST_METHOD },
+	/* 27 */ { NULL, 0, 0 },
+	/* 28 */ { NULL, 0, 0 },
+	/* 29 */ { NULL, 0, 0 },
+	/* 30 */ { CONST_STR_LEN("SERVER_PROTOCOL"), FASTCGI_ENV_SERVER_PROTOCOL },
+	/* 31 */ { NULL, 0, 0 },
+};
 
-	if (fastcgi_queue_write(fcon->fd, &fcon->write_queue, 256*1024) < 0) {
-		fastcgi_connection_close(fcon);
-		return;
-	}
+/* returns -1 if key is not one of the well known variables */
+static gint environ_known_var(const gchar *key, gsize keylen) {
+	guint slot;
+	if (keylen < 4) return -1;
+	slot = (3 * (guint8) key[3] + 3 * (guint8) key[keylen - 2] + keylen) & 31;
+	if (environ_known_table[slot].len != keylen || 0 != memcmp(environ_known_table[slot].name, key, keylen)) return -1;
+	return environ_known_table[slot].var;
+}
 
-	if (fcon->fsrv->callbacks->cb_wrote_data) {
-		fcon->fsrv->callbacks->cb_wrote_data(fcon);
-	}
+static void environ_insert(fastcgi_environ *env, fastcgi_arena *arena, const gchar *key, gsize keylen, const gchar *value, gsize valuelen) {
+	guint32 hash = environ_hash(key, keylen);
+	fastcgi_environ_entry *e = environ_find(env, hash, key, keylen);
+	gint var;
 
-	if (!fcon->closing) {
-		if (fcon->write_queue.length > 0) {
-			ev_io_add_events(fcon->fsrv->loop, &fcon->fd_watcher, EV_WRITE);
-		} else {
-			ev_io_rem_events(fcon->fsrv->loop, &fcon->fd_watcher, EV_WRITE);
-			if (0 == fcon->requestID) {
-				if (!(fcon->flags & FCGI_KEEP_CONN)) {
-					fastcgi_connection_close(fcon);
-				}
-			}
+	if (NULL == e) {
+		if (env->count == env->size) {
+			/* the old arrays stay in the arena until reset */
+			guint i, size = (0 != env->size) ? 2 * env->size : 32;
+			fastcgi_environ_entry *entries = fastcgi_arena_alloc(arena, size * sizeof(fastcgi_environ_entry));
+			if (0 != env->count) memcpy(entries, env->entries, env->count * sizeof(fastcgi_environ_entry));
+			env->entries = entries;
+			env->size = size;
+			env->index = fastcgi_arena_alloc(arena, 2 * size * sizeof(guint));
+			memset(env->index, 0, 2 * size * sizeof(guint));
+			for (i = 0; i < env->count; i++) environ_index_add(env, i);
 		}
+		e = &env->entries[env->count];
+		e->key = fastcgi_arena_strndup(arena, key, keylen);
+		e->keylen = keylen;
+		e->hash = hash;
+		environ_index_add(env, env->count++);
+		var = environ_known_var(key, keylen);
+		if (var >= 0) env->known[var] = env->count;
 	}
+	/* later values replace earlier ones */
+	e->value = fastcgi_arena_strndup(arena, value, valuelen);
+	e->valuelen = valuelen;
 }
 
-static GByteArray* read_chunk(fastcgi_connection *fcon, guint maxlen) {
-	gssize res;
-	GByteArray *buf;
-	int tmp_errno;
+/* end: environ */
 
-	buf = g_byte_array_sized_new(maxlen);
-	g_byte_array_set_size(buf, maxlen);
-	if (0 == maxlen) return buf;
+/* codec: records and name-value pairs in memory, no I/O */
 
-	res = read(fcon->fd, buf->data, maxlen);
-	if (res == -1) {
-		tmp_errno = errno;
-		g_byte_array_free(buf, TRUE);
-		errno = tmp_errno;
-		return NULL;
-	} else if (res == 0) {
-		g_byte_array_free(buf, TRUE);
-		errno = ECONNRESET;
-		return NULL;
-	} else {
-		g_byte_array_set_size(buf, res);
-		return buf;
-	}
-}
+static const guint8 __padding[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
 
-/* read content + padding, but only returns content data. decrements counters */
-static GByteArray *read_content(fastcgi_connection *fcon) {
-	GByteArray *buf;
+guint8 fastcgi_record_encode_header(guint8 *buf, guint8 type, guint16 requestID, guint16 contentLength) {
+	guint8 padlen = (8 - (contentLength & 0x7)) % 8; /* padding must be < 8 */
 
-	buf = read_chunk(fcon, fcon->content_remaining + fcon->padding_remaining);
-	if (!buf) return NULL;
-	if (buf->len > fcon->content_remaining) {
-		fcon->padding_remaining -= (buf->len - fcon->content_remaining);
-		g_byte_array_set_size(buf, fcon->content_remaining);
-		fcon->content_remaining = 0;
-	} else {
-		fcon->content_remaining -= buf->len;
-	}
-	return buf;
+	buf[0] = FCGI_VERSION_1;
+	buf[1] = type;
+	buf[2] = (guint8) (requestID >> 8);
+	buf[3] = (guint8) (requestID);
+	buf[4] = (guint8) (contentLength >> 8);
+	buf[5] = (guint8) (contentLength);
+	buf[6] = padlen;
+	buf[7] = 0;
+	return padlen;
 }
 
-static gboolean read_append_chunk(fastcgi_connection *fcon, GByteArray *buf) {
-	gssize res;
-	int tmp_errno;
-	guint curlen = buf->len;
-	const guint maxlen = fcon->content_remaining + fcon->padding_remaining;
-	if (0 == maxlen) return TRUE;
-
-	g_byte_array_set_size(buf, curlen + maxlen);
-	res = read(fcon->fd, buf->data + curlen, maxlen);
-	if (res == -1) {
-		tmp_errno = errno;
-		g_byte_array_set_size(buf, curlen);
-		errno = tmp_errno;
-		return FALSE;
-	} else if (res == 0) {
-		g_byte_array_set_size(buf, curlen);
-		errno = ECONNRESET;
-		return FALSE;
+gsize fastcgi_record_encode(guint8 *buf, guint8 type, guint16 requestID, const guint8 *content, guint16 len) {
+	guint8 padlen = fastcgi_record_encode_header(buf, type, requestID, len);
+	if (len > 0) memcpy(buf + FCGI_HEADER_LEN, content, len);
+	memcpy(buf + FCGI_HEADER_LEN + len, __padding, padlen);
+	return FCGI_HEADER_LEN + len + padlen;
+}
+
+gsize fastcgi_record_encode_begin_request(guint8 *buf, guint16 requestID, enum FCGI_Role role, guint8 flags) {
+	fastcgi_record_encode_header(buf, FCGI_BEGIN_REQUEST, requestID, 8);
+	buf[8] = (guint8) (role >> 8);
+	buf[9] = (guint8) role;
+	buf[10] = flags;
+	memcpy(buf + 11, __padding, 5);
+	return 16;
+}
+
+gsize fastcgi_record_encode_end_request(guint8 *buf, guint16 requestID, gint32 appStatus, enum FCGI_ProtocolStatus status) {
+	fastcgi_record_encode_header(buf, FCGI_END_REQUEST, requestID, 8);
+	appStatus = htonl(appStatus);
+	memcpy(buf + 8, &appStatus, sizeof(appStatus));
+	buf[12] = status;
+	memcpy(buf + 13, __padding, 3);
+	return 16;
+}
+
+gsize fastcgi_param_encoded_size(gsize keylen, gsize valuelen) {
+	return (keylen < 128 ? 1 : 4) + (valuelen < 128 ? 1 : 4) + keylen + valuelen;
+}
+
+static guint8* param_encode_length(guint8 *buf, guint32 len) {
+	if (len < 128) {
+		*buf++ = len;
 	} else {
-		/* remove padding data */
-		if (res > fcon->content_remaining) {
-			fcon->padding_remaining -= res - fcon->content_remaining;
-			res = fcon->content_remaining;
-		}
-		g_byte_array_set_size(buf, curlen + res);
-		fcon->content_remaining -= res;
-		return TRUE;
+		*buf++ = (len >> 24) | 0x80;
+		*buf++ = len >> 16;
+		*buf++ = len >> 8;
+		*buf++ = len;
 	}
+	return buf;
+}
+
+gsize fastcgi_param_encode(guint8 *buf, const gchar *key, gsize keylen, const gchar *value, gsize valuelen) {
+	guint8 *p = param_encode_length(buf, keylen);
+	p = param_encode_length(p, valuelen);
+	memcpy(p, key, keylen);
+	p += keylen;
+	memcpy(p, value, valuelen);
+	p += valuelen;
+	return p - buf;
 }
 
-static gboolean read_key_value(fastcgi_connection *fcon, GByteArray *buf, guint *pos, gchar **key, guint *keylen, gchar **value, guint *valuelen) {
-	const unsigned char *data = (const unsigned char*) buf->data;
+gssize fastcgi_param_decode(const guint8 *data, gsize len, fastcgi_param *param) {
 	guint32 klen, vlen;
-	guint p = *pos, len = buf->len;
+	gsize p = 0;
 
-	if (len - p < 2) return FALSE;
+	if (len < 2) return 0;
 
 	klen = data[p++];
 	if (klen & 0x80) {
-		if (len - p < 100) return FALSE;
+		if (len - p < 3) return 0;
 		klen = ((klen & 0x7f) << 24) | (data[p] << 16) | (data[p+1] << 8) | data[p+2];
 		p += 3;
 	}
+	if (len - p < 1) return 0;
 	vlen = data[p++];
 	if (vlen & 0x80) {
-		if (len - p < 100) return FALSE;
+		if (len - p < 3) return 0;
 		vlen = ((vlen & 0x7f) << 24) | (data[p] << 16) | (data[p+1] << 8) | data[p+2];
 		p += 3;
 	}
-	if (klen > FASTCGI_MAX_KEYLEN || vlen > FASTCGI_MAX_VALUELEN) {
-		fastcgi_connection_close(fcon);
-		return FALSE;
-	}
-	if (len - p < klen + vlen) return FALSE;
-	*key = (gchar*) &buf->data[p];
-	*keylen = klen;
+	/* checked before the data is complete, so nobody buffers a huge pair */
+	if (klen > FASTCGI_MAX_KEYLEN || vlen > FASTCGI_MAX_VALUELEN) return -1;
+	if (len - p < klen + vlen) return 0;
+
+	param->key = (const gchar*) &data[p];
+	param->keylen = klen;
 	p += klen;
-	*value = (gchar*) &buf->data[p];
-	*valuelen = vlen;
+	param->value = (const gchar*) &data[p];
+	param->valuelen = vlen;
 	p += vlen;
-	*pos = p;
-	return TRUE;
+	return p;
 }
 
-static void parse_params(const fastcgi_callbacks *fcbs, fastcgi_connection *fcon) {
-	if (!fcon->current_header.contentLength) {
-		fcbs->cb_new_request(fcon);
-		g_byte_array_set_size(fcon->parambuf, 0);
-	} else {
-		guint pos = 0, keylen = 0, valuelen = 0;
-		gchar *key = NULL, *value = NULL;
-		while (read_key_value(fcon, fcon->parambuf, &pos, &key, &keylen, &value, &valuelen)) {
-			GString *gkey = g_string_new_len(key, keylen);
-			GString *gvalue = g_string_new_len(value, valuelen);
-			g_hash_table_insert(fcon->environ, gkey, gvalue);
-		}
-		if (!fcon->closing)
-			g_byte_array_remove_range(fcon->parambuf, 0, pos);
-	}
+void fastcgi_decoder_init(fastcgi_decoder *dec) {
+	memset(dec, 0, sizeof(*dec));
 }
 
-static void parse_get_values(fastcgi_connection *fcon) {
-	/* just send the request back and don't insert results */
-	GByteArray *tmp = g_byte_array_sized_new(0);
-	stream_send_bytearray(&fcon->write_queue, FCGI_GET_VALUES_RESULT, 0, fcon->buffer);
-	*fcon->buffer = *tmp;
-	/* TODO: provide get-values result */
+void fastcgi_decoder_skip_record(fastcgi_decoder *dec) {
+	dec->skip = TRUE;
 }
 
-static void read_queue(fastcgi_connection *fcon) {
-	gssize res;
-	GByteArray *buf;
-	const fastcgi_callbacks *fcbs = fcon->fsrv->callbacks;
-
-	for (;;) {
-		if (fcon->closing || fcon->read_suspended) return;
+enum fastcgi_decoder_event fastcgi_decoder_next(fastcgi_decoder *dec, const guint8 *input, gsize len, gsize *used, const guint8 **chunk, gsize *chunklen) {
+	gsize pos = 0, n;
 
-		if (fcon->headerbuf_used < 8) {
-			const unsigned char *data = fcon->headerbuf;
-			res = read(fcon->fd, fcon->headerbuf + fcon->headerbuf_used, 8 - fcon->headerbuf_used);
-			if (0 == res) { errno = ECONNRESET; goto handle_error; }
-			if (-1 == res) goto handle_error;
-			fcon->headerbuf_used += res;
-			if (fcon->headerbuf_used < 8) return; /* need more data */
-
-			fcon->current_header.version = data[0];
-			fcon->current_header.type = data[1];
-			fcon->current_header.requestID = (data[2] << 8) | (data[3]);
-			fcon->current_header.contentLength = (data[4] << 8) | (data[5]);
-			fcon->current_header.paddingLength = data[6];
-			fcon->content_remaining = fcon->current_header.contentLength;
-			fcon->padding_remaining = fcon->current_header.paddingLength;
-			fcon->first = TRUE;
-			g_byte_array_set_size(fcon->buffer, 0);
+	if (dec->headerbuf_used < FCGI_HEADER_LEN) {
+		const guint8 *data = dec->headerbuf;
+		n = MIN(FCGI_HEADER_LEN - dec->headerbuf_used, len);
+		memcpy(dec->headerbuf + dec->headerbuf_used, input, n);
+		dec->headerbuf_used += n;
+		*used = n;
+		if (dec->headerbuf_used < FCGI_HEADER_LEN) return FASTCGI_DECODER_NEED_MORE;
 
-			if (fcon->current_header.version != FCGI_VERSION_1) {
-				fastcgi_connection_close(fcon);
-				return;
-			}
-		}
+		dec->header.version = data[0];
+		dec->header.type = data[1];
+		dec->header.requestID = (data[2] << 8) | (data[3]);
+		dec->header.contentLength = (data[4] << 8) | (data[5]);
+		dec->header.paddingLength = data[6];
+		dec->content_remaining = dec->header.contentLength;
+		dec->padding_remaining = dec->header.paddingLength;
+		dec->skip = FALSE;
+		return FASTCGI_DECODER_RECORD;
+	}
 
-		if (fcon->current_header.type != FCGI_BEGIN_REQUEST &&
-		    (0 != fcon->current_header.requestID) && fcon->current_header.requestID != fcon->requestID) {
-		    /* ignore packet data */
-			if (0 != fcon->content_remaining + fcon->padding_remaining) {
-				if (NULL == (buf = read_content(fcon))) goto handle_error;
-				g_byte_array_free(buf, TRUE);
-			}
-			if (0 == fcon->content_remaining + fcon->padding_remaining) {
-				fcon->headerbuf_used = 0;
-			}
-			continue;
+	if (dec->content_remaining > 0) {
+		n = MIN(dec->content_remaining, len);
+		dec->content_remaining -= n;
+		if (!dec->skip && n > 0) {
+			*chunk = input;
+			*chunklen = n;
+			*used = n;
+			return FASTCGI_DECODER_CONTENT;
 		}
-
-		if (fcon->first || fcon->content_remaining) {
-			fcon->first = FALSE;
-			switch (fcon->current_header.type) {
-			case FCGI_BEGIN_REQUEST:
-				if (8 != fcon->current_header.contentLength || 0 == fcon->current_header.requestID) goto error;
-				if (!read_append_chunk(fcon, fcon->buffer)) goto handle_error;
-				if (0 == fcon->content_remaining) {
-					if (fcon->requestID) {
-						stream_send_end_request(&fcon->write_queue, fcon->current_header.requestID, 0, FCGI_CANT_MPX_CONN);
-					} else {
-						unsigned char *data = (unsigned char*) fcon->buffer->data;
-						fcon->requestID = fcon->current_header.requestID;
-						fcon->role = (data[0] << 8) | (data[1]);
-						fcon->flags = data[2];
-						g_byte_array_set_size(fcon->parambuf, 0);
-					}
-				}
-				break;
-			case FCGI_ABORT_REQUEST:
-				if (0 != fcon->current_header.contentLength || 0 == fcon->current_header.requestID) goto error;
-				fcbs->cb_request_aborted(fcon);
-				break;
-			case FCGI_END_REQUEST:
-				goto error; /* invalid type */
-			case FCGI_PARAMS:
-				if (0 == fcon->current_header.requestID) goto error;
-				if (!read_append_chunk(fcon, fcon->parambuf)) goto handle_error;
-				parse_params(fcbs, fcon);
-				break;
-			case FCGI_STDIN:
-				if (0 == fcon->current_header.requestID) goto error;
-				buf = NULL;
-				if (0 != fcon->content_remaining &&
-				    NULL == (buf = read_content(fcon))) goto handle_error;
-				if (fcbs->cb_received_stdin) {
-					fcbs->cb_received_stdin(fcon, buf);
-				} else {
-					g_byte_array_free(buf, TRUE);
-				}
-				break;
-			case FCGI_STDOUT:
-				goto error; /* invalid type */
-			case FCGI_STDERR:
-				goto error; /* invalid type */
-			case FCGI_DATA:
-				if (0 == fcon->current_header.requestID) goto error;
-				buf = NULL;
-				if (0 != fcon->content_remaining &&
-				    NULL == (buf = read_content(fcon))) goto handle_error;
-				if (fcbs->cb_received_data) {
-					fcbs->cb_received_data(fcon, buf);
-				} else {
-					g_byte_array_free(buf, TRUE);
-				}
-				break;
-			case FCGI_GET_VALUES:
-				if (0 != fcon->current_header.requestID) goto error;
-				if (!read_append_chunk(fcon, fcon->buffer)) goto handle_error;
-				if (0 == fcon->content_remaining)
-					parse_get_values(fcon);
-				break;
-			case FCGI_GET_VALUES_RESULT:
-				goto error; /* invalid type */
-				break;
-			case FCGI_UNKNOWN_TYPE:
-				/* we didn't send anything fancy, so this is not expected */
-				goto error; /* invalid type */
-			default:
-				break;
-			}
+		pos = n;
+		if (dec->content_remaining > 0) {
+			*used = pos;
+			return FASTCGI_DECODER_NEED_MORE;
 		}
+	}
 
-		if (0 == fcon->content_remaining) {
-			if (0 == fcon->padding_remaining) {
-				fcon->headerbuf_used = 0;
-			} else {
-				if (NULL == (buf = read_chunk(fcon, fcon->padding_remaining))) goto handle_error;
-				fcon->padding_remaining -= buf->len;
-				if (0 == fcon->padding_remaining) {
-					fcon->headerbuf_used = 0;
-				}
-				g_byte_array_free(buf, TRUE);
-			}
-		}
+	n = MIN(dec->padding_remaining, len - pos);
+	pos += n;
+	dec->padding_remaining -= n;
+	*used = pos;
+	if (dec->padding_remaining > 0) return FASTCGI_DECODER_NEED_MORE;
 
-	}
+	dec->headerbuf_used = 0;
+	return FASTCGI_DECODER_RECORD_END;
+}
 
-	return;
+/* end: codec */
 
-handle_error:
-	switch (errno) {
-	case EINTR:
-	case EAGAIN:
-#if EWOULDBLOCK != EAGAIN
-	case EWOULDBLOCK:
-#endif
-		return; /* try again later */
-	case ECONNRESET:
-		break;
-	default:
-		ERROR("read from fd=%d failed, %s\n", fcon->fd, g_strerror(errno) );
-		break;
-	}
+static void stream_count_record(fastcgi_queue *out, guint8 type) {
+	if (out->records) out->records[type <= FCGI_MAXTYPE ? type : 0]++;
+}
 
-error:
-	if (0 != fcon->requestID)
-		fcbs->cb_request_aborted(fcon);
-	fastcgi_connection_close(fcon);
+/* returns padding length */
+static guint8 stream_send_fcgi_record(fastcgi_queue *out, guint8 type, guint16 requestid, guint16 datalen) {
+	stream_count_record(out, type);
+	return fastcgi_record_encode_header(fastcgi_queue_append_inline(out, FCGI_HEADER_LEN), type, requestid, datalen);
 }
 
-static void fastcgi_connection_fd_cb(struct ev_loop *loop, ev_io *w, int revents) {
-	fastcgi_connection *fcon = (fastcgi_connection*) w->data;
-	UNUSED(loop);
+static void stream_send_padding(fastcgi_queue *out, guint8 padlen) {
+	fastcgi_queue_append_static(out, __padding, padlen);
+}
 
-	if (revents & EV_READ) {
-		read_queue(fcon);
+/* kills bytes */
+static void stream_send_bytes(fastcgi_queue *out, guint8 type, guint16 requestid, GBytes *data) {
+	gsize offset = 0, len = g_bytes_get_size(data);
+	while (len > 0) {
+		guint16 tosend = (len > FASTCGI_RECORD_CHUNK_SIZE) ? FASTCGI_RECORD_CHUNK_SIZE : len;
+		guint8 padlen = stream_send_fcgi_record(out, type, requestid, tosend);
+		fastcgi_queue_append_bytes_range(out, data, offset, tosend);
+		stream_send_padding(out, padlen);
+		offset += tosend;
+		len -= tosend;
 	}
+	g_bytes_unref(data);
+}
 
-	if (revents & EV_WRITE) {
-		write_queue(fcon);
+/* kills string */
+static void stream_send_string(fastcgi_queue *out, guint8 type, guint16 requestid, GString *data) {
+	if (data->len > G_MAXUINT16) {
+		gsize len = data->len;
+		stream_send_bytes(out, type, requestid, g_bytes_new_take(g_string_free(data, FALSE), len));
+	} else {
+		guint8 padlen = stream_send_fcgi_record(out, type, requestid, data->len);
+		if (data->len + padlen < data->allocated_len) {
+			/* fits without realloc */
+			g_string_append_len(data, (const gchar*) __padding, padlen);
+			padlen = 0;
+		}
+		fastcgi_queue_append_string(out, data);
+		stream_send_padding(out, padlen);
 	}
 }
 
-static void _g_string_destroy(gpointer data) {
-	g_string_free(data, TRUE);
+/* kills bytearray */
+static void stream_send_bytearray(fastcgi_queue *out, guint8 type, guint16 requestid, GByteArray *data) {
+	if (data->len > G_MAXUINT16) {
+		stream_send_bytes(out, type, requestid, g_byte_array_free_to_bytes(data));
+	} else {
+		guint8 padlen = stream_send_fcgi_record(out, type, requestid, data->len);
+		fastcgi_queue_append_bytearray(out, data);
+		stream_send_padding(out, padlen);
+	}
 }
 
-static fastcgi_connection *fastcgi_connecion_create(fastcgi_server *fsrv, gint fd, guint id) {
-	fastcgi_connection *fcon = g_slice_new0(fastcgi_connection);
-
-	fcon->fsrv = fsrv;
-	fcon->fcon_id = id;
-
-	fcon->buffer = g_byte_array_sized_new(0);
-	fcon->parambuf = g_byte_array_sized_new(0);
-	fcon->environ = g_hash_table_new_full((GHashFunc) g_string_hash, (GEqualFunc) g_string_equal, _g_string_destroy, _g_string_destroy);
-
-	fcon->fd = fd;
-	fd_init(fcon->fd);
-	ev_io_init(&fcon->fd_watcher, fastcgi_connection_fd_cb, fcon->fd, EV_READ);
-	fcon->fd_watcher.data = fcon;
-	ev_io_start(fcon->fsrv->loop, &fcon->fd_watcher);
-
-	return fcon;
+/* kills data; a block of block_size from fastcgi_pool_get_block(out->pool) with at most FASTCGI_RECORD_CHUNK_SIZE bytes */
+static void stream_send_pool_block(fastcgi_queue *out, guint8 type, guint16 requestid, GByteArray *data, gsize block_size) {
+	guint8 padlen = stream_send_fcgi_record(out, type, requestid, data->len);
+	fastcgi_queue_append_pool_block(out, data, block_size);
+	stream_send_padding(out, padlen);
 }
 
-static void fastcgi_connection_free(fastcgi_connection *fcon) {
-	fcon->fsrv->callbacks->cb_reset_connection(fcon);
-
-	if (fcon->fd != -1) {
-		ev_io_stop(fcon->fsrv->loop, &fcon->fd_watcher);
-		close(fcon->fd);
-		fcon->fd = -1;
+/* takes ownership of fd */
+static void stream_send_file(fastcgi_queue *out, guint8 type, guint16 requestid, gint fd, goffset offset, gsize len) {
+	fastcgi_queue_file *file = fastcgi_queue_file_new(out, fd);
+	while (len > 0) {
+		guint16 tosend = (len > FASTCGI_RECORD_CHUNK_SIZE) ? FASTCGI_RECORD_CHUNK_SIZE : len;
+		guint8 padlen = stream_send_fcgi_record(out, type, requestid, tosend);
+		fastcgi_queue_append_file_range(out, file, offset, tosend);
+		stream_send_padding(out, padlen);
+		offset += tosend;
+		len -= tosend;
 	}
+	fastcgi_queue_file_release(file);
+}
 
-	fastcgi_queue_clear(&fcon->write_queue);
-	g_hash_table_destroy(fcon->environ);
-	g_byte_array_free(fcon->buffer, TRUE);
-	g_byte_array_free(fcon->parambuf, TRUE);
+/* copies data (0 < len <= FASTCGI_RECORD_CHUNK_SIZE) into the open record if it belongs to the same stream
+ * and has room, otherwise into a new record that stays open until something else is queued or written.
+ * returns TRUE if no new record was needed */
+static gboolean stream_send_coalesced(fastcgi_queue *out, guint8 type, guint16 requestid, const guint8 *data, gsize len) {
+	GByteArray *rec = out->open_record;
+	gsize contentlen = 0, had_len = 0;
+	gboolean appended = FALSE;
+	guint8 padlen;
 
-	g_slice_free(fastcgi_connection, fcon);
-}
+	if (NULL != rec) {
+		const guint8 *h = out->open_header;
+		contentlen = (h[4] << 8) | h[5];
+		if (h[1] == type && ((h[2] << 8) | h[3]) == requestid && contentlen + len <= FASTCGI_RECORD_CHUNK_SIZE) {
+			appended = TRUE;
+			had_len = rec->len;
+			g_byte_array_set_size(rec, contentlen);
+		}
+	}
 
-void fastcgi_connection_close(fastcgi_connection *fcon) {
-	fcon->closing = TRUE;
-	if (fcon->fd != -1) {
-		ev_io_stop(fcon->fsrv->loop, &fcon->fd_watcher);
-		close(fcon->fd);
-		fcon->fd = -1;
+	if (!appended) {
+		guint8 *header = fastcgi_queue_append_inline(out, FCGI_HEADER_LEN);
+		stream_count_record(out, type);
+		if (out->pool) {
+			/* grows up to a full record */
+			rec = fastcgi_pool_get_block(out->pool, FASTCGI_POOL_BLOCK_SIZE);
+			fastcgi_queue_append_pool_block(out, g_byte_array_append(rec, data, len), FASTCGI_POOL_BLOCK_SIZE);
+		} else {
+			rec = g_byte_array_new();
+			fastcgi_queue_append_bytearray(out, g_byte_array_append(rec, data, len));
+		}
+		out->open_header = header;
+		out->open_record = rec;
+		contentlen = 0;
+		had_len = len;
+	} else {
+		g_byte_array_append(rec, data, len);
 	}
 
-	fastcgi_queue_clear(&fcon->write_queue);
+	padlen = fastcgi_record_encode_header(out->open_header, type, requestid, contentlen + len);
+	g_byte_array_append(rec, __padding, padlen);
 
-	g_byte_array_set_size(fcon->buffer, 0);
-	g_byte_array_set_size(fcon->parambuf, 0);
-	g_hash_table_remove_all(fcon->environ);
+	/* the link was pushed with had_len bytes */
+	out->length += rec->len - had_len;
+	out->memory += rec->len - had_len;
+	if (out->memory_total) *out->memory_total += rec->len - had_len;
 
-	ev_prepare_start(fcon->fsrv->loop, &fcon->fsrv->closing_watcher);
+	return appended;
 }
 
-static void fastcgi_server_fd_cb(struct ev_loop *loop, ev_io *w, int revents) {
-	fastcgi_server *fsrv = (fastcgi_server*) w->data;
-	fastcgi_connection *fcon;
-	void (*cb_new_connection)(fastcgi_connection *fcon) = fsrv->callbacks->cb_new_connection;
-
-	g_assert(revents & EV_READ);
+static void stream_send_end_request(fastcgi_queue *out, guint16 requestID, gint32 appStatus, enum FCGI_ProtocolStatus status) {
+	stream_count_record(out, FCGI_END_REQUEST);
+	fastcgi_record_encode_end_request(fastcgi_queue_append_inline(out, 16), requestID, appStatus, status);
+}
 
-	for (;;) {
-		gint fd = accept(fsrv->fd, NULL, NULL);
-		if (-1 == fd) {
-			switch (errno) {
-			case EAGAIN:
-#if EWOULDBLOCK != EAGAIN
-			case EWOULDBLOCK:
-#endif
-			case EINTR:
-				/* we were stopped _before_ we had a connection */
-			case ECONNABORTED: /* this is a FreeBSD thingy */
-				/* we were stopped _after_ we had a connection */
-				return;
-			case EMFILE:
-				if (0 == fsrv->max_connections) {
-					fsrv->max_connections = fsrv->connections->len / 2;
-				} else {
-					fsrv->max_connections = fsrv->max_connections / 2;
-				}
-				ERROR("dropped connection limit to %u as we got EMFILE\n", fsrv->max_connections);
-				ev_io_rem_events(loop, w, EV_READ);
-				return;
-			default:
-				ERROR("accept failed on fd=%d with error: %s\nshutting down\n", fsrv->fd, g_strerror(errno));
-				fastcgi_server_stop(fsrv);
-				return;
-			}
-		}
+static void fastcgi_histogram_add(fastcgi_histogram *h, ev_tstamp seconds) {
+	guint64 usec = (seconds > 0) ? (guint64) (seconds * 1e6) : 0;
+	guint i;
 
-		fcon = fastcgi_connecion_create(fsrv, fd, fsrv->connections->len);
-		g_ptr_array_add(fsrv->connections, fcon);
-		if (cb_new_connection) {
-			cb_new_connection(fcon);
-		}
+	if (0 == usec) {
+		i = 0;
+	} else if (usec >= (G_GUINT64_CONSTANT(1) << (FASTCGI_HISTOGRAM_BUCKETS - 2))) {
+		i = FASTCGI_HISTOGRAM_BUCKETS - 1;
+	} else {
+		i = g_bit_storage((gulong) usec);
+	}
+	h->count++;
+	h->sum_usec += usec;
+	h->buckets[i]++;
+}
 
-		if (fsrv->connections->len >= fsrv->max_connections) {
-			ev_io_rem_events(loop, w, EV_READ);
-			return;
-		}
+/* called before queueing FCGI_STDOUT */
+static void fastcgi_request_stdout_sent(fastcgi_request *req) {
+	if (req->stdout_sent) return;
+	req->stdout_sent = TRUE;
+	fastcgi_histogram_add(&req->fcon->fsrv->stats.first_stdout_latency, ev_time() - req->received);
+}
 
-		if (fsrv->do_shutdown) return;
-	}
+/* timeouts: the wheel entry may be early (activity only updates fcon->last_activity),
+ * it gets rechecked in its tick. it must not be late, see fastcgi_connection_schedule_timeout */
+static gboolean fastcgi_request_waits_for_input(fastcgi_request *req) {
+	return !req->params_done || !req->stdin_closed;
 }
 
-static void fastcgi_cleanup_connections(fastcgi_server *fsrv) {
-	guint i;
+/* earliest deadline; < 0 if no timeout applies */
+static ev_tstamp fastcgi_connection_deadline(fastcgi_connection *fcon, guint *kind) {
+	fastcgi_server *fsrv = fcon->fsrv;
+	ev_tstamp deadline = -1, oldest = -1;
+	gboolean waits_for_input = (fcon->decoder.headerbuf_used > 0); /* within a record */
+	guint k = FASTCGI_TIMEOUT_NONE;
 
-	for (i = 0; i < fsrv->connections->len; ) {
-		fastcgi_connection *fcon = g_ptr_array_index(fsrv->connections, i);
-		if (fcon->closing) {
-			fastcgi_connection *t_fcon;
-			guint l = fsrv->connections->len-1;
-			t_fcon = g_ptr_array_index(fsrv->connections, i) = g_ptr_array_index(fsrv->connections, l);
-			g_ptr_array_set_size(fsrv->connections, l);
-			t_fcon->fcon_id = i;
-			fastcgi_connection_free(fcon);
-		} else {
-			i++;
+	if (NULL != fcon->request) {
+		oldest = fcon->request->started;
+		waits_for_input = waits_for_input || fastcgi_request_waits_for_input(fcon->request);
+	} else if (g_hash_table_size(fcon->requests) > 0) {
+		GHashTableIter iter;
+		gpointer value;
+		g_hash_table_iter_init(&iter, fcon->requests);
+		while (g_hash_table_iter_next(&iter, NULL, &value)) {
+			fastcgi_request *req = value;
+			if (oldest < 0 || req->started < oldest) oldest = req->started;
+			waits_for_input = waits_for_input || fastcgi_request_waits_for_input(req);
 		}
 	}
-}
 
-static void fastcgi_closing_cb(struct ev_loop *loop, ev_prepare *w, int revents) {
-	UNUSED(revents);
-	ev_prepare_stop(loop, w);
-	fastcgi_cleanup_connections((fastcgi_server*) w->data);
+	if (0 != fsrv->idle_timeout && oldest < 0) {
+		deadline = fcon->last_activity + fsrv->idle_timeout;
+		k = FASTCGI_TIMEOUT_IDLE;
+	}
+	if (0 != fsrv->read_timeout && waits_for_input && !fcon->read_suspended) {
+		ev_tstamp d = fcon->last_activity + fsrv->read_timeout;
+		if (deadline < 0 || d < deadline) { deadline = d; k = FASTCGI_TIMEOUT_READ; }
+	}
+	if (0 != fsrv->request_timeout && oldest >= 0) {
+		ev_tstamp d = oldest + fsrv->request_timeout;
+		if (deadline < 0 || d < deadline) { deadline = d; k = FASTCGI_TIMEOUT_REQUEST; }
+	}
+
+	if (kind) *kind = k;
+	return deadline;
 }
 
-fastcgi_server *fastcgi_server_create(struct ev_loop *loop, gint socketfd, const fastcgi_callbacks *callbacks, guint max_connections) {
-	fastcgi_server *fsrv = g_slice_new0(fastcgi_server);
+static void fastcgi_wheel_remove(fastcgi_timer_wheel *wheel, fastcgi_connection *fcon) {
+	if (0 == fcon->wheel_tick) return;
+	if (FASTCGI_WHEEL_DUE == fcon->wheel_tick) {
+		g_queue_unlink(&wheel->due, &fcon->wheel_link);
+	} else {
+		g_queue_unlink(&wheel->slots[fcon->wheel_tick & (FASTCGI_WHEEL_SLOTS - 1)], &fcon->wheel_link);
+	}
+	fcon->wheel_tick = 0;
+}
 
-	fsrv->callbacks = callbacks;
+static void fastcgi_wheel_insert(fastcgi_timer_wheel *wheel, fastcgi_connection *fcon, ev_tstamp deadline) {
+	gdouble t = (deadline - wheel->start) / FASTCGI_WHEEL_TICK;
+	guint64 tick = (t < (gdouble) wheel->now) ? wheel->now + 1 : (guint64) t + 1; /* never early */
 
-	fsrv->max_connections = max_connections;
+	/* an earlier check reschedules itself; FASTCGI_WHEEL_DUE is later than every tick */
+	if (0 != fcon->wheel_tick && fcon->wheel_tick <= tick) return;
 
-	fsrv->connections = g_ptr_array_sized_new(fsrv->max_connections);
+	fastcgi_wheel_remove(wheel, fcon);
+	fcon->wheel_tick = tick;
+	fcon->wheel_link.data = fcon;
+	g_queue_push_tail_link(&wheel->slots[tick & (FASTCGI_WHEEL_SLOTS - 1)], &fcon->wheel_link);
+}
 
-	fsrv->loop = loop;
-	fsrv->fd = socketfd;
-	fd_init(fsrv->fd);
-	ev_io_init(&fsrv->fd_watcher, fastcgi_server_fd_cb, fsrv->fd, EV_READ);
-	fsrv->fd_watcher.data = fsrv;
-	ev_io_start(fsrv->loop, &fsrv->fd_watcher);
+/* call after changes that may move the deadline forward; O(1) unless the connection multiplexes */
+static void fastcgi_connection_schedule_timeout(fastcgi_connection *fcon) {
+	fastcgi_timer_wheel *wheel = fcon->fsrv->wheel;
+	ev_tstamp deadline;
 
-	ev_prepare_init(&fsrv->closing_watcher, fastcgi_closing_cb);
-	fsrv->closing_watcher.data = fsrv;
+	if (NULL == wheel || fcon->closing) return;
 
-	return fsrv;
+	deadline = fastcgi_connection_deadline(fcon, NULL);
+	if (deadline < 0) {
+		fastcgi_wheel_remove(wheel, fcon);
+	} else {
+		fastcgi_wheel_insert(wheel, fcon, deadline);
+	}
 }
 
-void fastcgi_server_stop(fastcgi_server *fsrv) {
-	if (fsrv->do_shutdown) return;
-	fsrv->do_shutdown = TRUE;
+/* reading is suspended while the user, the memory limit or unconsumed input wants it */
+static void fastcgi_connection_update_read(fastcgi_connection *fcon) {
+	gboolean suspend = fcon->user_suspended || fcon->memory_suspended || fcon->input_suspended;
+	if (suspend == fcon->read_suspended) return;
+	fcon->read_suspended = suspend;
+	if (!suspend) {
+		fcon->last_activity = ev_now(fcon->fsrv->loop); /* the peer wasn't late */
+		fastcgi_connection_schedule_timeout(fcon);
+	}
 
-	ev_io_stop(fsrv->loop, &fsrv->fd_watcher);
-	close(fsrv->fd);
-	fsrv->fd = -1;
+	if (suspend) {
+#ifdef HAVE_LIBURING
+		/* a pending recv still completes, its data is kept in fcon->readbuf */
+		if (fcon->uring) return;
+#endif
+		ev_io_rem_events(fcon->fsrv->loop, &fcon->fd_watcher, EV_READ);
+		return;
+	}
+
+#ifdef HAVE_LIBURING
+	if (fcon->uring) {
+		/* parse buffered data and submit the next recv from the event loop */
+		ev_feed_event(fcon->fsrv->loop, &fcon->fd_watcher, EV_READ);
+		return;
+	}
+#endif
+	ev_io_add_events(fcon->fsrv->loop, &fcon->fd_watcher, EV_READ);
+	/* buffered data won't trigger the watcher */
+	if (fcon->readbuf) ev_feed_event(fcon->fsrv->loop, &fcon->fd_watcher, EV_READ);
 }
 
-void fastcgi_server_free(fastcgi_server *fsrv) {
-	guint i;
-	void (*cb_request_aborted)(fastcgi_connection *fcon) = fsrv->callbacks->cb_request_aborted;
-	if (!fsrv->do_shutdown) fastcgi_server_stop(fsrv);
-	ev_prepare_stop(fsrv->loop, &fsrv->closing_watcher);
+/* suspends reading while more than the high watermark of delivered stdin/data isn't consumed yet */
+static void fastcgi_connection_input_backpressure(fastcgi_connection *fcon) {
+	fastcgi_server *fsrv = fcon->fsrv;
+	gboolean suspend;
 
-	for (i = 0; i < fsrv->connections->len; i++) {
-		fastcgi_connection *fcon = g_ptr_array_index(fsrv->connections, i);
-		cb_request_aborted(fcon);
-		fcon->closing = TRUE;
+	if (0 == fsrv->input_high_watermark) {
+		suspend = FALSE;
+	} else if (fcon->input_suspended) {
+		suspend = fcon->input_memory > fsrv->input_low_watermark;
+	} else {
+		suspend = fcon->input_memory >= fsrv->input_high_watermark;
 	}
-	fastcgi_cleanup_connections(fsrv);
-	g_ptr_array_free(fsrv->connections, TRUE);
+	if (suspend == fcon->input_suspended) return;
 
-	g_slice_free(fastcgi_server, fsrv);
+	fcon->input_suspended = suspend;
+	if (suspend) fsrv->stats.input_suspended++;
+	if (!fcon->closing) fastcgi_connection_update_read(fcon);
 }
 
-void fastcgi_end_request(fastcgi_connection *fcon, gint32 appStatus, enum FCGI_ProtocolStatus status) {
-	gboolean had_data = (fcon->write_queue.length > 0);
-
-	if (0 == fcon->requestID) return;
-	stream_send_end_request(&fcon->write_queue, fcon->requestID, appStatus, status);
-	fcon->requestID = 0;
-	if (!had_data) write_queue(fcon);
+/* counts a stdin/data chunk given to the application, and the block holding it */
+static void fastcgi_request_input_delivered(fastcgi_request *req, GByteArray *buf) {
+	gsize memory;
+	if (NULL == buf) return;
+	memory = fastcgi_pool_block_size(buf->len);
+	req->input_pending += buf->len;
+	req->input_memory += memory;
+	req->fcon->input_pending += buf->len;
+	req->fcon->input_memory += memory;
+	req->fcon->fsrv->memory.input += memory;
 }
 
-void fastcgi_suspend_read(fastcgi_connection *fcon) {
-	fcon->read_suspended = TRUE;
-	ev_io_rem_events(fcon->fsrv->loop, &fcon->fd_watcher, EV_READ);
+/* consumption is counted in bytes; the blocks are released in proportion, all of them with the last byte */
+static void fastcgi_request_input_consumed(fastcgi_request *req, gsize len) {
+	fastcgi_connection *fcon = req->fcon;
+	gsize memory;
+	if (len > req->input_pending) len = req->input_pending;
+	if (len == req->input_pending) {
+		memory = req->input_memory;
+	} else {
+		memory = (gsize) ((guint64) req->input_memory * len / req->input_pending);
+	}
+	req->input_pending -= len;
+	req->input_memory -= memory;
+	fcon->input_pending -= len;
+	fcon->input_memory -= memory;
+	fcon->fsrv->memory.input -= memory;
 }
 
-void fastcgi_resume_read(fastcgi_connection *fcon) {
-	fcon->read_suspended = FALSE;
-	ev_io_add_events(fcon->fsrv->loop, &fcon->fd_watcher, EV_READ);
+static void fastcgi_request_drop_producer(fastcgi_request *req) {
+	fastcgi_connection *fcon = req->fcon;
+	if (NULL == req->producer && NULL == req->req_producer) return;
+	req->producer = NULL;
+	req->req_producer = NULL;
+	req->producer_ctx = NULL;
+	req->producer_waiting = FALSE;
+	g_ptr_array_remove(fcon->producers, req);
 }
 
-void fastcgi_send_out(fastcgi_connection *fcon, GString *data) {
-	gboolean had_data = (fcon->write_queue.length > 0);
-	if (!data) {
-		stream_send_fcgi_record(&fcon->write_queue, FCGI_STDOUT, fcon->requestID, 0);
+/* asks the producers (round robin) for stdout until the write queue reaches the high watermark */
+static void fastcgi_request_finish(fastcgi_request *req, gint32 appStatus, enum FCGI_ProtocolStatus status);
+
+static void fastcgi_connection_produce(fastcgi_connection *fcon) {
+	fastcgi_server *fsrv = fcon->fsrv;
+	gboolean progress = TRUE;
+
+	if (NULL == fcon->producers || NULL != fcon->producing) return;
+
+	while (progress) {
+		guint i = 0;
+		progress = FALSE;
+
+		while (i < fcon->producers->len) {
+			fastcgi_request *req = g_ptr_array_index(fcon->producers, i);
+			GByteArray *buf;
+			gsize size, block_size;
+			gssize res;
+
+			if (fcon->closing || fcon->write_queue.length >= fsrv->write_high_watermark) return;
+			if (req->producer_waiting) { i++; continue; }
+
+			size = MIN(fsrv->write_high_watermark - fcon->write_queue.length, FASTCGI_RECORD_CHUNK_SIZE);
+			block_size = fastcgi_pool_block_size(size);
+			buf = fastcgi_pool_get_block(&fsrv->pool, size);
+			g_byte_array_set_size(buf, size);
+			fcon->producing = req;
+			if (req->producer) {
+				res = req->producer(fcon, req->producer_ctx, buf->data, buf->len);
+			} else {
+				res = req->req_producer(req, req->producer_ctx, buf->data, buf->len);
+			}
+			fcon->producing = NULL;
+			if (res > 0 && !fcon->closing) {
+				g_assert((gsize) res <= buf->len);
+				g_byte_array_set_size(buf, res);
+				fastcgi_request_stdout_sent(req);
+				stream_send_pool_block(&fcon->write_queue, FCGI_STDOUT, req->requestID, buf, block_size);
+				progress = TRUE;
+			} else {
+				fastcgi_pool_put_block(&fsrv->pool, buf, block_size);
+				if (req->end_pending) {
+					/* finished below */
+				} else if (0 == res) {
+					req->producer_waiting = TRUE;
+				} else if (res < 0) {
+					fastcgi_request_drop_producer(req);
+				}
+			}
+			if (req->end_pending) {
+				/* the callback ended the request: after the data it returned; our caller writes the queue */
+				fastcgi_request_finish(req, req->end_app_status, req->end_status);
+			}
+
+			/* removed producers don't advance */
+			if (i < fcon->producers->len && g_ptr_array_index(fcon->producers, i) == req) i++;
+		}
+	}
+}
+
+static void fastcgi_connection_drain(fastcgi_connection *fcon);
+
+/* the write queue ran empty: close the connection if it is done, hand it off while draining */
+static void fastcgi_connection_check_idle(fastcgi_connection *fcon) {
+	if (0 != g_hash_table_size(fcon->requests)) return;
+	if (!(fcon->flags & FCGI_KEEP_CONN)) {
+		fastcgi_connection_close(fcon);
+	} else if (fcon->fsrv->draining) {
+		fastcgi_connection_drain(fcon);
+	}
+}
+
+static void write_queue(fastcgi_connection *fcon) {
+	gsize had_length = fcon->write_queue.length;
+	if (fcon->closing) return;
+
+#ifdef HAVE_LIBURING
+	if (fcon->uring) {
+		fastcgi_uring_send(fcon);
+		return;
+	}
+#endif
+
+	if (fastcgi_queue_writev(fcon->fd, &fcon->write_queue, 256*1024, &fcon->fsrv->stats) < 0) {
+		fastcgi_connection_close(fcon);
+		return;
+	}
+	fcon->fsrv->stats.bytes_written += had_length - fcon->write_queue.length;
+	if (had_length != fcon->write_queue.length) fcon->last_activity = ev_now(fcon->fsrv->loop);
+
+	if (fcon->write_queue.length < fcon->fsrv->write_low_watermark) fastcgi_connection_produce(fcon);
+
+	if (fcon->fsrv->callbacks->cb_wrote_data) {
+		fcon->fsrv->callbacks->cb_wrote_data(fcon);
+	}
+
+	if (!fcon->closing) {
+		if (fcon->write_queue.length > 0) {
+			ev_io_add_events(fcon->fsrv->loop, &fcon->fd_watcher, EV_WRITE);
+		} else {
+			ev_io_rem_events(fcon->fsrv->loop, &fcon->fd_watcher, EV_WRITE);
+			fastcgi_connection_check_idle(fcon);
+		}
+	}
+}
+
+/* FALSE if the connection wasn't waiting for the end of the loop iteration */
+static gboolean fastcgi_connection_remove_flush(fastcgi_connection *fcon) {
+	if (NULL == fcon->flush_link.data) return FALSE;
+	g_queue_unlink(&fcon->fsrv->flushing, &fcon->flush_link);
+	fcon->flush_link.data = NULL;
+	return TRUE;
+}
+
+/* output was queued; if the queue was empty before (had_data == FALSE) nobody is going to write it yet */
+static void fastcgi_connection_queued(fastcgi_connection *fcon, gboolean had_data) {
+	fastcgi_server *fsrv = fcon->fsrv;
+
+	if (had_data) return;
+	if (0 == fsrv->coalesce_max_copy) {
+		write_queue(fcon);
+		return;
+	}
+	if (fcon->closing || NULL != fcon->flush_link.data) return;
+	fcon->flush_link.data = fcon;
+	g_queue_push_tail_link(&fsrv->flushing, &fcon->flush_link);
+	ev_prepare_start(fsrv->loop, &fsrv->flush_watcher);
+}
+
+/* output coalescing: small sends are copied into the open record; FALSE if data has to be queued as it is */
+static gboolean fastcgi_connection_coalesce(fastcgi_connection *fcon, guint8 type, guint16 requestID, const guint8 *data, gsize len) {
+	fastcgi_server *fsrv = fcon->fsrv;
+
+	if (0 == len || len > fsrv->coalesce_max_copy) return FALSE;
+	if (stream_send_coalesced(&fcon->write_queue, type, requestID, data, len)) fsrv->stats.sends_coalesced++;
+	return TRUE;
+}
+
+static void fastcgi_server_flush_cb(struct ev_loop *loop, ev_prepare *w, int revents) {
+	fastcgi_server *fsrv = (fastcgi_server*) w->data;
+	GList *l;
+	UNUSED(revents);
+
+	/* connections queueing more output from cb_wrote_data get appended and written in this round too */
+	while (NULL != (l = g_queue_pop_head_link(&fsrv->flushing))) {
+		fastcgi_connection *fcon = l->data;
+		l->data = NULL;
+		fsrv->stats.flushes_deferred++;
+		write_queue(fcon);
+	}
+	ev_prepare_stop(loop, w);
+}
+
+static fastcgi_request* fastcgi_connection_get_request(fastcgi_connection *fcon, guint16 requestID) {
+	if (NULL != fcon->request) {
+		return (fcon->request->requestID == requestID) ? fcon->request : NULL;
+	}
+	return g_hash_table_lookup(fcon->requests, GUINT_TO_POINTER(requestID));
+}
+
+static fastcgi_request* fastcgi_request_create(fastcgi_connection *fcon, guint16 requestID, guint16 role, guint8 flags) {
+	fastcgi_server *fsrv = fcon->fsrv;
+	fastcgi_request *req;
+
+	if (fsrv->free_requests->len > 0) {
+		req = g_ptr_array_remove_index_fast(fsrv->free_requests, fsrv->free_requests->len - 1);
+		fsrv->memory.free_requests -= req->memory;
+		req->memory = 0;
 	} else {
-		stream_send_string(&fcon->write_queue, FCGI_STDOUT, fcon->requestID, data);
+		req = fastcgi_mem_alloc0(fsrv->pool.allocator, sizeof(fastcgi_request));
+		req->parambuf = g_byte_array_sized_new(0);
+		req->arena.allocator = fsrv->pool.allocator;
 	}
-	if (!had_data) write_queue(fcon);
+
+	req->fcon = fcon;
+	req->requestID = requestID;
+	req->role = role;
+	req->flags = flags;
+
+	g_hash_table_insert(fcon->requests, GUINT_TO_POINTER(requestID), req);
+	fcon->flags = flags;
+	fsrv->cur_requests++;
+	fsrv->stats.requests_accepted++;
+	req->started = ev_now(fsrv->loop);
+	req->received = ev_time();
+
+	if (!fsrv->callbacks->cb_req_new) {
+		/* without multiplexing the connection has only one request */
+		fcon->request = req;
+		fcon->requestID = requestID;
+		fcon->role = role;
+		fcon->environ = &req->environ;
+	}
+
+	return req;
 }
 
-void fastcgi_send_err(fastcgi_connection *fcon, GString *data) {
-	gboolean had_data = (fcon->write_queue.length > 0);
-	if (!data) {
-		stream_send_fcgi_record(&fcon->write_queue, FCGI_STDERR, fcon->requestID, 0);
+/* updates fsrv->memory.params */
+static void fastcgi_request_account(fastcgi_request *req) {
+	gsize memory = req->arena.size + req->parambuf->len;
+	fastcgi_server *fsrv = req->fcon->fsrv;
+	fsrv->memory.params = fsrv->memory.params - req->memory + memory;
+	req->memory = memory;
+}
+
+static void fastcgi_request_free(fastcgi_request *req) {
+	fastcgi_connection *fcon = req->fcon;
+	fastcgi_server *fsrv = fcon->fsrv;
+	GByteArray *parambuf;
+	fastcgi_arena arena;
+
+	g_hash_table_remove(fcon->requests, GUINT_TO_POINTER(req->requestID));
+	fastcgi_request_drop_producer(req);
+	if (fcon->producing == req) fcon->producing = NULL;
+	fastcgi_request_input_consumed(req, req->input_pending);
+	fastcgi_connection_input_backpressure(fcon);
+	fsrv->cur_requests--;
+	fsrv->memory.params -= req->memory;
+	if (fcon->request == req) {
+		fcon->request = NULL;
+		fcon->requestID = 0;
+		fcon->environ = NULL;
+	}
+	fastcgi_connection_schedule_timeout(fcon); /* idle now? */
+
+	if (fsrv->callbacks->cb_req_reset) {
+		fsrv->callbacks->cb_req_reset(req);
+	}
+
+	if (fsrv->free_requests->len < FASTCGI_MAX_FREE_REQUESTS) {
+		/* keep the object, its arena and param buffer for the next request;
+		 * the param buffer keeps its allocation, its last length is the best guess for it */
+		gsize kept;
+		parambuf = req->parambuf;
+		arena = req->arena;
+		fastcgi_arena_reset(&arena);
+		kept = sizeof(fastcgi_request) + arena.size + parambuf->len;
+		g_byte_array_set_size(parambuf, 0);
+		memset(req, 0, sizeof(*req));
+		req->parambuf = parambuf;
+		req->arena = arena;
+		req->memory = kept;
+		fsrv->memory.free_requests += kept;
+		g_ptr_array_add(fsrv->free_requests, req);
+		return;
+	}
+
+	fastcgi_arena_clear(&req->arena);
+	g_byte_array_free(req->parambuf, TRUE);
+
+	fastcgi_mem_free(fsrv->pool.allocator, req, sizeof(fastcgi_request));
+}
+
+static void fastcgi_request_abort(fastcgi_request *req) {
+	const fastcgi_callbacks *fcbs = req->fcon->fsrv->callbacks;
+
+	if (req->aborted) return;
+	req->aborted = TRUE;
+	req->fcon->fsrv->stats.requests_aborted++;
+
+	if (fcbs->cb_req_new) {
+		if (fcbs->cb_req_aborted) fcbs->cb_req_aborted(req);
 	} else {
-		stream_send_string(&fcon->write_queue, FCGI_STDERR, fcon->requestID, data);
+		fcbs->cb_request_aborted(req->fcon);
 	}
-	if (!had_data) write_queue(fcon);
 }
 
-void fastcgi_send_out_bytearray(fastcgi_connection *fcon, GByteArray *data) {
-	gboolean had_data = (fcon->write_queue.length > 0);
-	if (!data) {
-		stream_send_fcgi_record(&fcon->write_queue, FCGI_STDOUT, fcon->requestID, 0);
+/* abort all active requests on a connection, for example before closing it */
+static void fastcgi_connection_abort_requests(fastcgi_connection *fcon) {
+	GHashTableIter iter;
+	gpointer key;
+	GArray *ids;
+	guint i;
+
+	if (NULL != fcon->request) {
+		fastcgi_request_abort(fcon->request);
+		return;
+	}
+	if (0 == g_hash_table_size(fcon->requests)) return;
+
+	/* callbacks may end (and free) requests, so don't iterate the table while calling them */
+	ids = g_array_sized_new(FALSE, FALSE, sizeof(guint16), g_hash_table_size(fcon->requests));
+	g_hash_table_iter_init(&iter, fcon->requests);
+	while (g_hash_table_iter_next(&iter, &key, NULL)) {
+		guint16 id = GPOINTER_TO_UINT(key);
+		g_array_append_val(ids, id);
+	}
+	for (i = 0; i < ids->len; i++) {
+		fastcgi_request *req = fastcgi_connection_get_request(fcon, g_array_index(ids, guint16, i));
+		if (NULL != req) fastcgi_request_abort(req);
+	}
+	g_array_free(ids, TRUE);
+}
+
+/* copies a stdin/data chunk into a pooled buffer; NULL for eof */
+static GByteArray* receive_chunk(fastcgi_pool *pool, const guint8 *data, gsize len) {
+	GByteArray *buf;
+	if (0 == len) return NULL;
+	buf = fastcgi_pool_get_block(pool, len);
+	g_byte_array_append(buf, data, len);
+	return buf;
+}
+
+/* append data to an array; returns a new array if buf is NULL */
+static GByteArray* append_chunk(GByteArray *buf, const guint8 *data, gsize len) {
+	if (!buf) buf = g_byte_array_sized_new(len);
+	g_byte_array_append(buf, data, len);
+	return buf;
+}
+
+/* parses complete pairs into the environ, returns number of bytes used.
+ * closes the connection on oversized pairs */
+static guint parse_key_values(fastcgi_request *req, const guint8 *data, guint len) {
+	fastcgi_param param;
+	guint pos = 0;
+	gssize n;
+
+	while (0 < (n = fastcgi_param_decode(data + pos, len - pos, &param))) {
+		environ_insert(&req->environ, &req->arena, param.key, param.keylen, param.value, param.valuelen);
+		pos += n;
+	}
+	if (n < 0) fastcgi_connection_close(req->fcon);
+	return pos;
+}
+
+static void parse_params(fastcgi_request *req, const guint8 *data, gsize len, gboolean eof) {
+	fastcgi_connection *fcon = req->fcon;
+	const fastcgi_callbacks *fcbs = fcon->fsrv->callbacks;
+
+	if (req->params_done) return; /* ignore params after the end marker */
+
+	if (eof) {
+		req->params_done = TRUE;
+		g_byte_array_set_size(req->parambuf, 0);
+		fastcgi_request_account(req); /* the callback may end the request */
+		if (fcbs->cb_req_new) {
+			fcbs->cb_req_new(req);
+		} else {
+			fcbs->cb_new_request(fcon);
+		}
+		return;
+	}
+
+	if (0 == req->parambuf->len) {
+		/* parse directly from the input, only buffer an incomplete pair */
+		guint pos = parse_key_values(req, data, len);
+		if (!fcon->closing && pos < len)
+			g_byte_array_append(req->parambuf, data + pos, len - pos);
 	} else {
-		stream_send_bytearray(&fcon->write_queue, FCGI_STDOUT, fcon->requestID, data);
+		guint pos;
+		g_byte_array_append(req->parambuf, data, len);
+		pos = parse_key_values(req, req->parambuf->data, req->parambuf->len);
+		if (!fcon->closing)
+			g_byte_array_remove_range(req->parambuf, 0, pos);
 	}
-	if (!had_data) write_queue(fcon);
+	fastcgi_request_account(req);
 }
 
-void fastcgi_send_err_bytearray(fastcgi_connection *fcon, GByteArray *data) {
+static void append_key_uint(GByteArray *buf, const gchar *key, guint keylen, guint value) {
+	gchar str[16];
+	gint len = g_snprintf(str, sizeof(str), "%u", value);
+	guint oldlen = buf->len;
+
+	g_byte_array_set_size(buf, oldlen + fastcgi_param_encoded_size(keylen, len));
+	fastcgi_param_encode(buf->data + oldlen, key, keylen, str, len);
+}
+
+static gboolean key_equal(const gchar *key, guint keylen, const gchar *s, guint slen) {
+	return keylen == slen && 0 == memcmp(key, s, slen);
+}
+
+static void parse_get_values(fastcgi_connection *fcon) {
+	fastcgi_server *fsrv = fcon->fsrv;
 	gboolean had_data = (fcon->write_queue.length > 0);
-	if (!data) {
-		stream_send_fcgi_record(&fcon->write_queue, FCGI_STDERR, fcon->requestID, 0);
-	} else {
-		stream_send_bytearray(&fcon->write_queue, FCGI_STDERR, fcon->requestID, data);
+	GByteArray *result = g_byte_array_sized_new(64);
+	fastcgi_param param;
+	guint pos = 0;
+	gssize n;
+
+	/* unknown names are omitted from the result */
+	while (0 < (n = fastcgi_param_decode(fcon->buffer->data + pos, fcon->buffer->len - pos, &param))) {
+		pos += n;
+		if (key_equal(param.key, param.keylen, CONST_STR_LEN("FCGI_MAX_CONNS"))) {
+			append_key_uint(result, param.key, param.keylen, fsrv->max_connections);
+		} else if (key_equal(param.key, param.keylen, CONST_STR_LEN("FCGI_MAX_REQS"))) {
+			append_key_uint(result, param.key, param.keylen, (0 != fsrv->max_requests) ? fsrv->max_requests : fsrv->max_connections);
+		} else if (key_equal(param.key, param.keylen, CONST_STR_LEN("FCGI_MPXS_CONNS"))) {
+			append_key_uint(result, param.key, param.keylen, (NULL != fsrv->callbacks->cb_req_new) ? 1 : 0);
+		}
+	}
+	if (n < 0) fastcgi_connection_close(fcon);
+	if (fcon->closing) {
+		g_byte_array_free(result, TRUE);
+		return;
 	}
+
+	stream_send_bytearray(&fcon->write_queue, FCGI_GET_VALUES_RESULT, 0, result);
 	if (!had_data) write_queue(fcon);
 }
 
-char** fastcgi_build_env(fastcgi_connection *con) {
-	GPtrArray *env = g_ptr_array_new();
-	GHashTableIter iter;
-	gpointer pkey, pvalue;
-
-	g_hash_table_iter_init(&iter, con->environ);
-	while (g_hash_table_iter_next(&iter, &pkey, &pvalue)) {
-		GString *key = pkey, *value = pvalue;
-		char *s = g_malloc(key->len + value->len + 2);
-		memcpy(s, key->str, key->len);
-		memcpy(s + key->len + 1, value->str, value->len);
-		s[key->len] = '=';
-		s[key->len + value->len + 1] = '\0';
-		g_ptr_array_add(env, s);
+/* whether a new request has to be rejected with FCGI_OVERLOADED */
+static gboolean fastcgi_connection_overloaded(fastcgi_connection *fcon) {
+	fastcgi_server *fsrv = fcon->fsrv;
+	if (0 != fsrv->max_requests && fsrv->cur_requests >= fsrv->max_requests) return TRUE;
+	if (0 != fsrv->max_connection_requests && g_hash_table_size(fcon->requests) >= fsrv->max_connection_requests) return TRUE;
+	if (0 != fsrv->memory.hard_limit && fastcgi_server_memory_used(fsrv) >= fsrv->memory.hard_limit) return TRUE;
+	return FALSE;
+}
+
+/* handles (a part of) the content of the current record; returns FALSE on protocol errors */
+static gboolean handle_record_content(fastcgi_connection *fcon, const guint8 *chunk, gsize chunklen) {
+	const fastcgi_callbacks *fcbs = fcon->fsrv->callbacks;
+	/* valid for the record types which need it: records for unknown requests are
+	 * skipped. may get freed by callbacks, so don't use it after them */
+	fastcgi_request *req = fastcgi_connection_get_request(fcon, fcon->decoder.header.requestID);
+	GByteArray *buf;
+
+	switch (fcon->decoder.header.type) {
+	case FCGI_BEGIN_REQUEST:
+		if (8 != fcon->decoder.header.contentLength || 0 == fcon->decoder.header.requestID) return FALSE;
+		g_byte_array_append(fcon->buffer, chunk, chunklen);
+		if (0 == fcon->decoder.content_remaining) {
+			unsigned char *data = (unsigned char*) fcon->buffer->data;
+			if (!fcbs->cb_req_new && NULL != fcon->request) {
+				gboolean had_data = (fcon->write_queue.length > 0);
+				stream_send_end_request(&fcon->write_queue, fcon->decoder.header.requestID, 0, FCGI_CANT_MPX_CONN);
+				if (!had_data) write_queue(fcon);
+			} else if (NULL != req) {
+				/* ignore duplicate requestIDs */
+			} else if (fastcgi_connection_overloaded(fcon)) {
+				gboolean had_data = (fcon->write_queue.length > 0);
+				fcon->fsrv->stats.requests_overloaded++;
+				fcon->flags = data[2];
+				stream_send_end_request(&fcon->write_queue, fcon->decoder.header.requestID, 0, FCGI_OVERLOADED);
+				if (!had_data) write_queue(fcon);
+			} else {
+				fastcgi_request_create(fcon, fcon->decoder.header.requestID, (data[0] << 8) | (data[1]), data[2]);
+			}
+		}
+		break;
+	case FCGI_ABORT_REQUEST:
+		if (0 != fcon->decoder.header.contentLength || 0 == fcon->decoder.header.requestID) return FALSE;
+		fastcgi_request_abort(req);
+		break;
+	case FCGI_END_REQUEST:
+		return FALSE; /* invalid type */
+	case FCGI_PARAMS:
+		if (0 == fcon->decoder.header.requestID) return FALSE;
+		parse_params(req, chunk, chunklen, 0 == fcon->decoder.header.contentLength);
+		break;
+	case FCGI_STDIN:
+		if (0 == fcon->decoder.header.requestID) return FALSE;
+		buf = receive_chunk(&fcon->fsrv->pool, chunk, chunklen);
+		if (!buf) req->stdin_closed = TRUE;
+		if (fcbs->cb_req_new) {
+			if (fcbs->cb_req_received_stdin) {
+				fastcgi_request_input_delivered(req, buf);
+				fcbs->cb_req_received_stdin(req, buf);
+			} else if (buf) {
+				fastcgi_pool_put_chunk(&fcon->fsrv->pool, buf);
+			}
+		} else if (fcbs->cb_received_stdin) {
+			fastcgi_request_input_delivered(req, buf);
+			fcbs->cb_received_stdin(fcon, buf);
+		} else if (buf) {
+			fastcgi_pool_put_chunk(&fcon->fsrv->pool, buf);
+		}
+		fastcgi_connection_input_backpressure(fcon);
+		break;
+	case FCGI_STDOUT:
+		return FALSE; /* invalid type */
+	case FCGI_STDERR:
+		return FALSE; /* invalid type */
+	case FCGI_DATA:
+		if (0 == fcon->decoder.header.requestID) return FALSE;
+		buf = receive_chunk(&fcon->fsrv->pool, chunk, chunklen);
+		if (!buf) req->data_closed = TRUE;
+		if (fcbs->cb_req_new) {
+			if (fcbs->cb_req_received_data) {
+				fastcgi_request_input_delivered(req, buf);
+				fcbs->cb_req_received_data(req, buf);
+			} else if (buf) {
+				fastcgi_pool_put_chunk(&fcon->fsrv->pool, buf);
+			}
+		} else if (fcbs->cb_received_data) {
+			fastcgi_request_input_delivered(req, buf);
+			fcbs->cb_received_data(fcon, buf);
+		} else if (buf) {
+			fastcgi_pool_put_chunk(&fcon->fsrv->pool, buf);
+		}
+		fastcgi_connection_input_backpressure(fcon);
+		break;
+	case FCGI_GET_VALUES:
+		if (0 != fcon->decoder.header.requestID) return FALSE;
+		g_byte_array_append(fcon->buffer, chunk, chunklen);
+		if (0 == fcon->decoder.content_remaining)
+			parse_get_values(fcon);
+		break;
+	case FCGI_GET_VALUES_RESULT:
+		return FALSE; /* invalid type */
+	case FCGI_UNKNOWN_TYPE:
+		/* we didn't send anything fancy, so this is not expected */
+		return FALSE; /* invalid type */
+	default:
+		break;
 	}
-	g_ptr_array_add(env, NULL);
+	return TRUE;
+}
 
-	return (char**) g_ptr_array_free(env, FALSE);
+/* whether the current record belongs to a request that doesn't exist (anymore) */
+static gboolean record_for_unknown_request(fastcgi_connection *fcon) {
+	const fastcgi_record_header *header = &fcon->decoder.header;
+	return header->type != FCGI_BEGIN_REQUEST && 0 != header->requestID &&
+		NULL == fastcgi_connection_get_request(fcon, header->requestID);
 }
 
-const gchar* fastcgi_connection_environ_lookup(fastcgi_connection *fcon, const gchar* key, gsize keylen) {
-	GString s = { (gchar*) key, keylen, 0 };
-	GString *value = g_hash_table_lookup(fcon->environ, &s);
-	return (NULL != value) ? value->str : NULL;
+/* parses records from memory; returns number of bytes consumed.
+ * stops early if the connection gets closed or reading is suspended,
+ * incomplete headers and content are kept in the connection decoder */
+static gsize parse_input(fastcgi_connection *fcon, const guint8 *input, gsize inputlen) {
+	gsize pos = 0;
+
+	for (;;) {
+		const guint8 *chunk = NULL;
+		gsize chunklen = 0, used = 0;
+		guint8 type;
+
+		if (fcon->closing || fcon->read_suspended) return pos;
+
+		switch (fastcgi_decoder_next(&fcon->decoder, input + pos, inputlen - pos, &used, &chunk, &chunklen)) {
+		case FASTCGI_DECODER_NEED_MORE:
+			return pos + used;
+		case FASTCGI_DECODER_RECORD:
+			pos += used;
+			if (fcon->decoder.header.version != FCGI_VERSION_1) {
+				fastcgi_connection_close(fcon);
+				return pos;
+			}
+			type = fcon->decoder.header.type;
+			fcon->fsrv->stats.records_received[type <= FCGI_MAXTYPE ? type : 0]++;
+			g_byte_array_set_size(fcon->buffer, 0);
+			if (record_for_unknown_request(fcon)) {
+				fastcgi_decoder_skip_record(&fcon->decoder); /* ignore packet data */
+			} else if (0 == fcon->decoder.header.contentLength) {
+				/* empty records are end markers, they get an empty chunk */
+				if (!handle_record_content(fcon, input + pos, 0)) goto error;
+			}
+			break;
+		case FASTCGI_DECODER_CONTENT:
+			pos += used;
+			if (record_for_unknown_request(fcon)) {
+				/* the request was ended while receiving the record */
+				fastcgi_decoder_skip_record(&fcon->decoder);
+			} else if (!handle_record_content(fcon, chunk, chunklen)) {
+				goto error;
+			}
+			break;
+		case FASTCGI_DECODER_RECORD_END:
+			pos += used;
+			break;
+		}
+	}
+
+error:
+	fastcgi_connection_abort_requests(fcon);
+	fastcgi_connection_close(fcon);
+	return pos;
+}
+
+/* (re)allocate the shared read buffer if needed */
+static guint8* fastcgi_server_read_buffer(fastcgi_server *fsrv) {
+	if (!fsrv->read_buffer) fsrv->read_buffer = g_malloc(fsrv->read_buffer_size);
+	return fsrv->read_buffer;
+}
+
+/* charge fcon->readbuf in fsrv->memory.readbufs; it doesn't shrink, so the largest length counts */
+static void fastcgi_connection_account_readbuf(fastcgi_connection *fcon) {
+	gsize memory = (NULL != fcon->readbuf) ? MAX(fcon->readbuf_memory, fcon->readbuf->len) : 0;
+	fcon->fsrv->memory.readbufs = fcon->fsrv->memory.readbufs - fcon->readbuf_memory + memory;
+	fcon->readbuf_memory = memory;
+}
+
+static void fastcgi_connection_free_readbuf(fastcgi_connection *fcon) {
+	if (NULL == fcon->readbuf) return;
+	g_byte_array_free(fcon->readbuf, TRUE);
+	fcon->readbuf = NULL;
+	fastcgi_connection_account_readbuf(fcon);
+}
+
+/* parse data left over when reading got suspended; returns TRUE if all of it was handled */
+static gboolean read_stashed(fastcgi_connection *fcon) {
+	gsize used;
+
+	if (NULL == fcon->readbuf) return TRUE;
+
+	used = parse_input(fcon, fcon->readbuf->data, fcon->readbuf->len);
+	if (fcon->closing) return FALSE;
+	if (used < fcon->readbuf->len) {
+		g_byte_array_remove_range(fcon->readbuf, 0, used);
+		return FALSE;
+	}
+	fastcgi_connection_free_readbuf(fcon);
+	return TRUE;
+}
+
+/* complete records are parsed directly from input; only data that couldn't be handled
+ * (suspended reading, incomplete record) is copied into fcon->readbuf */
+static void read_input(fastcgi_connection *fcon, const guint8 *input, gsize len) {
+	gsize used;
+	fcon->last_activity = ev_now(fcon->fsrv->loop);
+	used = parse_input(fcon, input, len);
+	if (fcon->closing) return;
+	if (used < len) {
+		fcon->readbuf = append_chunk(fcon->readbuf, input + used, len - used);
+		fastcgi_connection_account_readbuf(fcon);
+	}
+	fastcgi_connection_schedule_timeout(fcon);
+}
+
+static void read_queue(fastcgi_connection *fcon) {
+	fastcgi_server *fsrv = fcon->fsrv;
+	gssize res;
+
+	if (fcon->closing || fcon->read_suspended) return;
+
+	if (!read_stashed(fcon)) return;
+
+#ifdef HAVE_LIBURING
+	if (fcon->uring) {
+		fastcgi_uring_recv(fcon);
+		return;
+	}
+#endif
+
+	for (;;) {
+		guint8 *input;
+
+		if (fcon->closing || fcon->read_suspended) return;
+
+		/* all connections share the server buffer */
+		input = fastcgi_server_read_buffer(fsrv);
+		res = read(fcon->fd, input, fsrv->read_buffer_size);
+		fsrv->stats.read_syscalls++;
+		if (0 == res) { errno = ECONNRESET; goto handle_error; }
+		if (-1 == res) goto handle_error;
+		fsrv->stats.bytes_read += res;
+
+		read_input(fcon, input, res);
+		if (fcon->closing || NULL != fcon->readbuf) return;
+
+		/* short read: socket is drained, the watcher brings us back when there is more */
+		if ((gsize) res < fsrv->read_buffer_size) return;
+	}
+
+handle_error:
+	switch (errno) {
+	case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+	case EWOULDBLOCK:
+#endif
+		fsrv->stats.read_eagain++;
+		return; /* try again later */
+	case EINTR:
+		return; /* try again later */
+	case ECONNRESET:
+		break;
+	default:
+		ERROR("read from fd=%d failed, %s\n", fcon->fd, g_strerror(errno) );
+		break;
+	}
+
+	fastcgi_connection_abort_requests(fcon);
+	fastcgi_connection_close(fcon);
+}
+
+static void fastcgi_connection_fd_cb(struct ev_loop *loop, ev_io *w, int revents) {
+	fastcgi_connection *fcon = (fastcgi_connection*) w->data;
+	UNUSED(loop);
+
+	if (revents & EV_READ) {
+		read_queue(fcon);
+	}
+
+	if (revents & EV_WRITE) {
+		write_queue(fcon);
+	}
+}
+
+static fastcgi_connection *fastcgi_connecion_create(fastcgi_server *fsrv, gint fd, guint id) {
+	fastcgi_connection *fcon;
+	int on = 1;
+
+	if (fsrv->free_connections->len > 0) {
+		/* zeroed by fastcgi_connection_free, keeps the (empty) requests table and buffers */
+		fcon = g_ptr_array_remove_index_fast(fsrv->free_connections, fsrv->free_connections->len - 1);
+	} else {
+		fcon = fastcgi_mem_alloc0(fsrv->pool.allocator, sizeof(fastcgi_connection));
+		fcon->buffer = g_byte_array_sized_new(0);
+		fcon->requests = g_hash_table_new(g_direct_hash, g_direct_equal);
+	}
+
+	fcon->fsrv = fsrv;
+	fcon->fcon_id = id;
+	fastcgi_decoder_init(&fcon->decoder);
+
+	fcon->write_queue.pool = &fsrv->pool;
+	fcon->write_queue.memory_total = &fsrv->memory.write_queues;
+	fcon->write_queue.records = fsrv->stats.records_sent;
+	fcon->flags = FCGI_KEEP_CONN; /* don't close after management records before the first request */
+
+	fcon->fd = fd; /* already nonblocking, see fastcgi_accept */
+	/* every fastcgi_send_* is written right away (unless coalescing is on); don't let small writes
+	 * wait for the delayed ack of the previous one. fails on unix sockets, which is fine */
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	ev_io_init(&fcon->fd_watcher, fastcgi_connection_fd_cb, fcon->fd, EV_READ);
+	fcon->fd_watcher.data = fcon;
+
+	fcon->last_activity = ev_now(fsrv->loop);
+	fastcgi_connection_schedule_timeout(fcon);
+
+#ifdef HAVE_LIBURING
+	if (fsrv->uring) {
+		/* the watcher is only used for ev_feed_event */
+		fastcgi_uring_connection_start(fcon);
+		return fcon;
+	}
+#endif
+	ev_io_start(fcon->fsrv->loop, &fcon->fd_watcher);
+
+	return fcon;
+}
+
+static void fastcgi_connection_destroy(fastcgi_server *fsrv, fastcgi_connection *fcon) {
+	g_hash_table_destroy(fcon->requests);
+	if (fcon->producers) g_ptr_array_free(fcon->producers, TRUE);
+	g_byte_array_free(fcon->buffer, TRUE);
+	fastcgi_mem_free(fsrv->pool.allocator, fcon, sizeof(fastcgi_connection));
+}
+
+static void fastcgi_connection_free(fastcgi_connection *fcon) {
+	fastcgi_server *fsrv = fcon->fsrv;
+	GList *reqs, *l;
+
+	fsrv->stats.connections_closed++;
+	if (g_hash_table_size(fcon->requests) > 0) fsrv->stats.connections_aborted++;
+
+	reqs = g_hash_table_get_values(fcon->requests);
+	for (l = reqs; NULL != l; l = l->next) {
+		fastcgi_request_free(l->data);
+	}
+	g_list_free(reqs);
+
+	fcon->fsrv->callbacks->cb_reset_connection(fcon);
+
+	if (fcon->fd != -1) {
+		ev_io_stop(fcon->fsrv->loop, &fcon->fd_watcher);
+		close(fcon->fd);
+		fcon->fd = -1;
+	}
+
+	fastcgi_queue_clear(&fcon->write_queue);
+#ifdef HAVE_LIBURING
+	if (fcon->uring) fastcgi_uring_connection_free(fcon);
+#endif
+	if (fsrv->wheel) fastcgi_wheel_remove(fsrv->wheel, fcon);
+	fastcgi_connection_free_readbuf(fcon);
+
+	if (fsrv->free_connections->len < fsrv->max_free_connections) {
+		GHashTable *requests = fcon->requests;
+		GByteArray *buffer = fcon->buffer;
+		GPtrArray *producers = fcon->producers;
+
+		g_byte_array_set_size(buffer, 0);
+		if (producers) g_ptr_array_set_size(producers, 0);
+		memset(fcon, 0, sizeof(*fcon));
+		fcon->requests = requests;
+		fcon->buffer = buffer;
+		fcon->producers = producers;
+		g_ptr_array_add(fsrv->free_connections, fcon);
+		return;
+	}
+
+	fastcgi_connection_destroy(fsrv, fcon);
+}
+
+/* queue the connection for fastcgi_cleanup_connections (once) */
+static void fastcgi_connection_set_closing(fastcgi_connection *fcon) {
+	fcon->closing = TRUE;
+	if (NULL == fcon->closing_link.data) {
+		fcon->closing_link.data = fcon;
+		g_queue_push_tail_link(&fcon->fsrv->closing, &fcon->closing_link);
+	}
+}
+
+void fastcgi_connection_close(fastcgi_connection *fcon) {
+	fastcgi_connection_set_closing(fcon);
+	fastcgi_connection_remove_flush(fcon);
+	if (fcon->fsrv->wheel) fastcgi_wheel_remove(fcon->fsrv->wheel, fcon);
+#ifdef HAVE_LIBURING
+	if (fcon->uring && fastcgi_uring_connection_busy(fcon)) {
+		/* the kernel still uses fd and the write queue: wake the pending operations,
+		 * the connection gets freed after they completed */
+		if (fcon->fd != -1) shutdown(fcon->fd, SHUT_RDWR);
+		g_byte_array_set_size(fcon->buffer, 0);
+		fastcgi_connection_free_readbuf(fcon);
+		return;
+	}
+#endif
+	if (fcon->fd != -1) {
+		ev_io_stop(fcon->fsrv->loop, &fcon->fd_watcher);
+		close(fcon->fd);
+		fcon->fd = -1;
+	}
+
+	fastcgi_queue_clear(&fcon->write_queue);
+
+	g_byte_array_set_size(fcon->buffer, 0);
+	fastcgi_connection_free_readbuf(fcon);
+
+	ev_prepare_start(fcon->fsrv->loop, &fcon->fsrv->closing_watcher);
+}
+
+static gint fastcgi_accept(gint fd) {
+	gint cfd;
+#ifdef HAVE_ACCEPT4
+	/* saves the fcntl() calls of fd_init */
+	cfd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (-1 != cfd || ENOSYS != errno) return cfd;
+#endif
+	cfd = accept(fd, NULL, NULL);
+	if (-1 != cfd) fd_init(cfd);
+	return cfd;
+}
+
+static gint fastcgi_open_reserve_fd(void) {
+#ifdef O_CLOEXEC
+	return open("/dev/null", O_RDONLY | O_CLOEXEC);
+#else
+	return open("/dev/null", O_RDONLY);
+#endif
+}
+
+/* use the spare fd to accept and drop a pending connection,
+ * so the client doesn't hang in the backlog and the listener doesn't stay readable */
+static void fastcgi_server_shed_connection(fastcgi_server *fsrv) {
+	gint fd;
+	if (-1 == fsrv->reserve_fd) return;
+	close(fsrv->reserve_fd);
+	fd = accept(fsrv->fd, NULL, NULL);
+	if (-1 != fd) {
+		close(fd);
+		fsrv->stats.connections_shed++;
+	}
+	fsrv->reserve_fd = fastcgi_open_reserve_fd();
+}
+
+static void fastcgi_server_resume_accept(fastcgi_server *fsrv) {
+	if (fsrv->do_shutdown || fsrv->connections->len >= fsrv->connection_limit) return;
+#ifdef HAVE_LIBURING
+	if (fsrv->uring) {
+		fastcgi_uring_accept(fsrv);
+		return;
+	}
+#endif
+	ev_io_add_events(fsrv->loop, &fsrv->fd_watcher, EV_READ);
+}
+
+static void fastcgi_server_pause_accept(fastcgi_server *fsrv) {
+#ifdef HAVE_LIBURING
+	if (fsrv->uring) {
+		fastcgi_uring_cancel_accept(fsrv);
+		return;
+	}
+#endif
+	ev_io_rem_events(fsrv->loop, &fsrv->fd_watcher, EV_READ);
+}
+
+/* accept() failed with EMFILE/ENFILE */
+static void fastcgi_server_out_of_fds(fastcgi_server *fsrv) {
+	fsrv->stats.accept_emfile++;
+	fastcgi_server_shed_connection(fsrv);
+	/* stay at the current number of connections until one gets closed (or the timer tries again) */
+	fsrv->connection_limit = fsrv->connections->len;
+	ERROR("out of fds, connection limit lowered to %u for now\n", fsrv->connection_limit);
+	fastcgi_server_pause_accept(fsrv);
+	if (!ev_is_active(&fsrv->emfile_timer)) {
+		ev_timer_set(&fsrv->emfile_timer, FASTCGI_EMFILE_RETRY, 0.);
+		ev_timer_start(fsrv->loop, &fsrv->emfile_timer);
+	}
+}
+
+/* returns FALSE if no more connections should be accepted right now */
+static gboolean fastcgi_server_new_connection(fastcgi_server *fsrv, gint fd) {
+	fastcgi_connection *fcon;
+
+	fcon = fastcgi_connecion_create(fsrv, fd, fsrv->connections->len);
+	g_ptr_array_add(fsrv->connections, fcon);
+	if (fsrv->callbacks->cb_new_connection) {
+		fsrv->callbacks->cb_new_connection(fcon);
+	}
+
+	if (fsrv->connections->len >= fsrv->connection_limit) {
+		fastcgi_server_pause_accept(fsrv);
+		return FALSE;
+	}
+
+	return !fsrv->do_shutdown;
+}
+
+/* lift the limit fastcgi_server_out_of_fds set; if fds are still short, accept() lowers it again */
+static void fastcgi_server_restore_connection_limit(fastcgi_server *fsrv) {
+	if (fsrv->connection_limit == fsrv->max_connections) return;
+	fsrv->connection_limit = fsrv->max_connections;
+	fsrv->stats.connection_limit_restored++;
+	ev_timer_stop(fsrv->loop, &fsrv->emfile_timer);
+	if (-1 == fsrv->reserve_fd) fsrv->reserve_fd = fastcgi_open_reserve_fd();
+}
+
+/* fallback if no connection gets closed for a while */
+static void fastcgi_server_emfile_cb(struct ev_loop *loop, ev_timer *w, int revents) {
+	fastcgi_server *fsrv = (fastcgi_server*) w->data;
+	UNUSED(loop);
+	UNUSED(revents);
+
+	fastcgi_server_restore_connection_limit(fsrv);
+	fastcgi_server_resume_accept(fsrv);
+}
+
+static void fastcgi_server_fd_cb(struct ev_loop *loop, ev_io *w, int revents) {
+	fastcgi_server *fsrv = (fastcgi_server*) w->data;
+	guint accepted = 0;
+
+	UNUSED(loop);
+	g_assert(revents & EV_READ);
+
+	for (;;) {
+		gint fd = fastcgi_accept(fsrv->fd);
+		if (-1 == fd) {
+			switch (errno) {
+			case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+			case EWOULDBLOCK:
+#endif
+			case EINTR:
+				/* we were stopped _before_ we had a connection */
+			case ECONNABORTED: /* this is a FreeBSD thingy */
+				/* we were stopped _after_ we had a connection */
+				return;
+			case EMFILE:
+			case ENFILE:
+				fastcgi_server_out_of_fds(fsrv);
+				return;
+			default:
+				ERROR("accept failed on fd=%d with error: %s\nshutting down\n", fsrv->fd, g_strerror(errno));
+				fastcgi_server_stop(fsrv);
+				return;
+			}
+		}
+
+		fsrv->stats.connections_accepted++;
+		if (!fastcgi_server_new_connection(fsrv, fd)) return;
+
+		/* let the other watchers run; the listener is still readable in the next iteration */
+		if (0 != fsrv->accept_budget && ++accepted >= fsrv->accept_budget) {
+			fsrv->stats.accept_budget_exhausted++;
+			return;
+		}
+	}
+}
+
+/* handoff: one tag byte per message, with the fd as SCM_RIGHTS.
+ * sends don't block the loop: if the new process doesn't keep up, the connection is closed instead */
+#define FASTCGI_HANDOFF_LISTENER 'L'
+#define FASTCGI_HANDOFF_CONNECTION 'C'
+#define FASTCGI_HANDOFF_END 'E' /* no fd */
+
+static gboolean fastcgi_handoff_send(gint sock, gchar tag, gint fd) {
+	union {
+		struct cmsghdr hdr;
+		gchar buf[CMSG_SPACE(sizeof(gint))];
+	} control;
+	struct msghdr msg;
+	struct iovec iov;
+	gssize r;
+
+	iov.iov_base = &tag;
+	iov.iov_len = 1;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (-1 != fd) {
+		struct cmsghdr *cmsg;
+		memset(&control, 0, sizeof(control));
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(gint));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(gint));
+	}
+
+	do {
+		r = sendmsg(sock, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+	} while (-1 == r && EINTR == errno);
+	if (1 != r) {
+		ERROR("handoff on fd=%d failed: %s\n", sock, g_strerror(errno));
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/* returns the tag (*fd is -1 if there was none), 0 on eof and -1 on errors (EAGAIN with MSG_DONTWAIT) */
+static gint fastcgi_handoff_recv(gint sock, gint *fd, gint flags) {
+	union {
+		struct cmsghdr hdr;
+		gchar buf[CMSG_SPACE(sizeof(gint))];
+	} control;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	gchar tag;
+	gssize r;
+
+	*fd = -1;
+	iov.iov_base = &tag;
+	iov.iov_len = 1;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+#ifdef MSG_CMSG_CLOEXEC
+	flags |= MSG_CMSG_CLOEXEC;
+#endif
+	do {
+		r = recvmsg(sock, &msg, flags);
+	} while (-1 == r && EINTR == errno);
+	if (r <= 0) return r;
+
+	/* keep the first fd only; close everything else the sender put in the message */
+	for (cmsg = CMSG_FIRSTHDR(&msg); NULL != cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (SOL_SOCKET == cmsg->cmsg_level && SCM_RIGHTS == cmsg->cmsg_type) {
+			guint i, n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(gint);
+			for (i = 0; i < n; i++) {
+				gint rfd;
+				memcpy(&rfd, CMSG_DATA(cmsg) + i * sizeof(gint), sizeof(gint));
+				if (-1 == *fd) {
+					*fd = rfd;
+					fd_init(rfd);
+				} else {
+					close(rfd);
+				}
+			}
+		}
+	}
+	if (msg.msg_flags & MSG_CTRUNC) {
+		/* some fds were dropped by the kernel; the one we got might not belong to the tag */
+		ERROR("handoff on fd=%d: control data truncated\n", sock);
+		if (-1 != *fd) close(*fd);
+		*fd = -1;
+	}
+	return (guint8) tag;
+}
+
+/* while draining: hand over (or close) a connection that is idle between requests.
+ * with io_uring a recv may already be in flight, so those connections are closed */
+static void fastcgi_connection_drain(fastcgi_connection *fcon) {
+	fastcgi_server *fsrv = fcon->fsrv;
+
+	if (fcon->closing || 0 != g_hash_table_size(fcon->requests) || 0 != fcon->write_queue.length
+	    || 0 != fcon->decoder.headerbuf_used || NULL != fcon->readbuf) return;
+
+	if (-1 != fsrv->handoff_fd && NULL == fcon->uring
+	    && fastcgi_handoff_send(fsrv->handoff_fd, FASTCGI_HANDOFF_CONNECTION, fcon->fd)) {
+		fsrv->stats.connections_handed_off++;
+	}
+	fastcgi_connection_close(fcon);
+}
+
+/* all connections of a draining server are gone */
+static void fastcgi_server_drained(fastcgi_server *fsrv) {
+	fsrv->draining = FALSE;
+	ev_timer_stop(fsrv->loop, &fsrv->drain_timer);
+	if (-1 != fsrv->handoff_fd) {
+		fastcgi_handoff_send(fsrv->handoff_fd, FASTCGI_HANDOFF_END, -1);
+		fsrv->handoff_fd = -1;
+	}
+	if (fsrv->callbacks->cb_drained) fsrv->callbacks->cb_drained(fsrv);
+}
+
+static void fastcgi_cleanup_connections(fastcgi_server *fsrv) {
+	GList *link, *next;
+	gboolean released = FALSE;
+
+	for (link = fsrv->closing.head; NULL != link; link = next) {
+		fastcgi_connection *fcon = link->data, *t_fcon;
+		guint l = fsrv->connections->len-1;
+
+		next = link->next;
+#ifdef HAVE_LIBURING
+		/* stays queued, see fastcgi_uring_connection_check_closed */
+		if (fcon->uring && fastcgi_uring_connection_busy(fcon)) continue;
+#endif
+		g_queue_unlink(&fsrv->closing, link);
+
+		/* move the last connection into the gap */
+		t_fcon = g_ptr_array_index(fsrv->connections, fcon->fcon_id) = g_ptr_array_index(fsrv->connections, l);
+		t_fcon->fcon_id = fcon->fcon_id;
+		g_ptr_array_set_size(fsrv->connections, l);
+		fastcgi_connection_free(fcon);
+		released = TRUE;
+	}
+
+	if (fsrv->draining && 0 == fsrv->connections->len) {
+		fastcgi_server_drained(fsrv);
+		return;
+	}
+	/* the fds of the closed connections are free again */
+	if (released) fastcgi_server_restore_connection_limit(fsrv);
+	fastcgi_server_resume_accept(fsrv);
+}
+
+static void fastcgi_closing_cb(struct ev_loop *loop, ev_prepare *w, int revents) {
+	UNUSED(revents);
+	ev_prepare_stop(loop, w);
+	fastcgi_cleanup_connections((fastcgi_server*) w->data);
+}
+
+static void fastcgi_connection_timeout(fastcgi_connection *fcon, guint kind) {
+	fastcgi_server *fsrv = fcon->fsrv;
+
+	switch (kind) {
+	case FASTCGI_TIMEOUT_IDLE: fsrv->stats.timeouts_idle++; break;
+	case FASTCGI_TIMEOUT_READ: fsrv->stats.timeouts_read++; break;
+	case FASTCGI_TIMEOUT_REQUEST: fsrv->stats.timeouts_request++; break;
+	}
+
+	fastcgi_connection_abort_requests(fcon);
+	if (!fcon->closing) fastcgi_connection_close(fcon);
+}
+
+static void fastcgi_wheel_tick_cb(struct ev_loop *loop, ev_timer *w, int revents) {
+	fastcgi_server *fsrv = (fastcgi_server*) w->data;
+	fastcgi_timer_wheel *wheel = fsrv->wheel;
+	ev_tstamp now = ev_now(loop);
+	guint64 target = (guint64) ((now - wheel->start) / FASTCGI_WHEEL_TICK);
+	UNUSED(revents);
+
+	/* after a long stall every slot is visited once */
+	if (target > wheel->now + FASTCGI_WHEEL_SLOTS) wheel->now = target - FASTCGI_WHEEL_SLOTS;
+
+	while (wheel->now < target) {
+		GQueue *slot;
+		GList *l, *next;
+
+		wheel->now++;
+		slot = &wheel->slots[wheel->now & (FASTCGI_WHEEL_SLOTS - 1)];
+
+		/* callbacks may close or reschedule other connections, so collect the due ones first;
+		 * fastcgi_wheel_remove/insert take them out of wheel->due again */
+		for (l = slot->head; NULL != l; l = next) {
+			fastcgi_connection *fcon = l->data;
+			next = l->next;
+			if (fcon->wheel_tick > wheel->now) continue; /* a later round */
+			fastcgi_wheel_remove(wheel, fcon);
+			g_queue_push_tail_link(&wheel->due, &fcon->wheel_link);
+			fcon->wheel_tick = FASTCGI_WHEEL_DUE;
+		}
+
+		while (NULL != (l = g_queue_pop_head_link(&wheel->due))) {
+			fastcgi_connection *fcon = l->data;
+			ev_tstamp deadline;
+			guint kind;
+
+			fcon->wheel_tick = 0;
+			if (fcon->closing) continue;
+			deadline = fastcgi_connection_deadline(fcon, &kind);
+			if (deadline < 0) continue;
+			if (deadline <= now) {
+				fastcgi_connection_timeout(fcon, kind);
+			} else {
+				fastcgi_wheel_insert(wheel, fcon, deadline);
+			}
+		}
+	}
+}
+
+void fastcgi_server_set_timeouts(fastcgi_server *fsrv, ev_tstamp idle, ev_tstamp read, ev_tstamp request) {
+	fastcgi_timer_wheel *wheel = fsrv->wheel;
+	guint i;
+
+	fsrv->idle_timeout = idle;
+	fsrv->read_timeout = read;
+	fsrv->request_timeout = request;
+
+	if (0 == idle && 0 == read && 0 == request) {
+		if (NULL == wheel) return;
+		for (i = 0; i < fsrv->connections->len; i++) {
+			fastcgi_wheel_remove(wheel, g_ptr_array_index(fsrv->connections, i));
+		}
+		ev_ref(fsrv->loop);
+		ev_timer_stop(fsrv->loop, &wheel->tick_watcher);
+		fastcgi_mem_free(fsrv->pool.allocator, wheel, sizeof(fastcgi_timer_wheel));
+		fsrv->wheel = NULL;
+		return;
+	}
+
+	if (NULL == wheel) {
+		wheel = fsrv->wheel = fastcgi_mem_alloc0(fsrv->pool.allocator, sizeof(fastcgi_timer_wheel));
+		wheel->start = ev_now(fsrv->loop);
+		ev_timer_init(&wheel->tick_watcher, fastcgi_wheel_tick_cb, FASTCGI_WHEEL_TICK, FASTCGI_WHEEL_TICK);
+		wheel->tick_watcher.data = fsrv;
+		ev_timer_start(fsrv->loop, &wheel->tick_watcher);
+		ev_unref(fsrv->loop); /* the connections keep the loop alive */
+	}
+
+	/* shorter timeouts have to be inserted earlier */
+	for (i = 0; i < fsrv->connections->len; i++) {
+		fastcgi_connection_schedule_timeout(g_ptr_array_index(fsrv->connections, i));
+	}
+}
+
+static void fastcgi_server_drain_timeout_cb(struct ev_loop *loop, ev_timer *w, int revents) {
+	fastcgi_server *fsrv = (fastcgi_server*) w->data;
+	guint i;
+	UNUSED(loop);
+	UNUSED(revents);
+
+	for (i = 0; i < fsrv->connections->len; i++) {
+		fastcgi_connection *fcon = g_ptr_array_index(fsrv->connections, i);
+		if (fcon->closing) continue;
+		fsrv->stats.connections_drain_expired++;
+		fastcgi_connection_abort_requests(fcon);
+		fastcgi_connection_close(fcon);
+	}
+}
+
+void fastcgi_server_drain(fastcgi_server *fsrv, gint handoff_fd, ev_tstamp timeout) {
+	guint i;
+
+	if (fsrv->draining) return;
+	fsrv->draining = TRUE;
+	fsrv->handoff_fd = handoff_fd;
+
+	/* the new process accepts from now on, pending connections in the backlog stay there */
+	if (-1 != handoff_fd && -1 != fsrv->fd) fastcgi_handoff_send(handoff_fd, FASTCGI_HANDOFF_LISTENER, fsrv->fd);
+	fastcgi_server_stop(fsrv);
+
+	for (i = 0; i < fsrv->connections->len; i++) {
+		fastcgi_connection_drain(g_ptr_array_index(fsrv->connections, i));
+	}
+
+	if (timeout > 0) {
+		ev_timer_set(&fsrv->drain_timer, timeout, 0.);
+		ev_timer_start(fsrv->loop, &fsrv->drain_timer);
+	}
+	/* fastcgi_cleanup_connections finishes the drain, also if there are no connections left */
+	ev_prepare_start(fsrv->loop, &fsrv->closing_watcher);
+}
+
+gint fastcgi_handoff_receive_listener(gint handoff_fd) {
+	gint fd, tag = fastcgi_handoff_recv(handoff_fd, &fd, 0);
+
+	if (FASTCGI_HANDOFF_LISTENER == tag) return fd;
+	if (-1 != fd) close(fd);
+	return -1;
+}
+
+static void fastcgi_server_adopt_cb(struct ev_loop *loop, ev_io *w, int revents) {
+	fastcgi_server *fsrv = (fastcgi_server*) w->data;
+	UNUSED(revents);
+
+	for (;;) {
+		gint fd, tag = fastcgi_handoff_recv(w->fd, &fd, MSG_DONTWAIT);
+
+		if (FASTCGI_HANDOFF_CONNECTION == tag && -1 != fd) {
+			if (fsrv->do_shutdown || fsrv->connections->len >= fsrv->connection_limit) {
+				close(fd);
+				fsrv->stats.connections_adopt_refused++;
+				continue;
+			}
+			fsrv->stats.connections_adopted++;
+			fastcgi_server_new_connection(fsrv, fd);
+			continue;
+		}
+		if (-1 != fd) close(fd); /* not expected here */
+		if (tag > 0 && FASTCGI_HANDOFF_END != tag) continue;
+		if (-1 == tag && (EAGAIN == errno || EWOULDBLOCK == errno)) return;
+
+		/* end, eof or error: the old process is done */
+		ev_io_stop(loop, w);
+		close(w->fd);
+		return;
+	}
+}
+
+void fastcgi_server_adopt_connections(fastcgi_server *fsrv, gint handoff_fd) {
+	if (ev_is_active(&fsrv->adopt_watcher)) return;
+	ev_io_set(&fsrv->adopt_watcher, handoff_fd, EV_READ);
+	ev_io_start(fsrv->loop, &fsrv->adopt_watcher);
+}
+
+static gint fastcgi_connection_memory_cmp(gconstpointer a, gconstpointer b) {
+	const fastcgi_connection *ca = *(fastcgi_connection* const*) a, *cb = *(fastcgi_connection* const*) b;
+	if (ca->write_queue.memory == cb->write_queue.memory) return 0;
+	return (ca->write_queue.memory > cb->write_queue.memory) ? -1 : 1;
+}
+
+/* suspend reading on the connections with the largest write queues until they cover the excess */
+static void fastcgi_server_memory_suspend(fastcgi_server *fsrv, gsize excess) {
+	GPtrArray *heavy = g_ptr_array_new();
+	gsize covered = 0;
+	guint i;
+
+	for (i = 0; i < fsrv->connections->len; i++) {
+		fastcgi_connection *fcon = g_ptr_array_index(fsrv->connections, i);
+		if (fcon->closing || 0 == fcon->write_queue.memory) continue;
+		if (fcon->memory_suspended) {
+			covered += fcon->write_queue.memory;
+		} else {
+			g_ptr_array_add(heavy, fcon);
+		}
+	}
+
+	g_ptr_array_sort(heavy, fastcgi_connection_memory_cmp);
+	for (i = 0; i < heavy->len && covered < excess; i++) {
+		fastcgi_connection *fcon = g_ptr_array_index(heavy, i);
+		covered += fcon->write_queue.memory;
+		fcon->memory_suspended = TRUE;
+		fastcgi_connection_update_read(fcon);
+		fsrv->stats.connections_memory_suspended++;
+	}
+	g_ptr_array_free(heavy, TRUE);
+}
+
+static void fastcgi_server_memory_resume(fastcgi_server *fsrv) {
+	guint i;
+	for (i = 0; i < fsrv->connections->len; i++) {
+		fastcgi_connection *fcon = g_ptr_array_index(fsrv->connections, i);
+		if (!fcon->memory_suspended) continue;
+		fcon->memory_suspended = FALSE;
+		if (!fcon->closing) fastcgi_connection_update_read(fcon);
+	}
+}
+
+static enum fastcgi_memory_level fastcgi_server_memory_level(fastcgi_server *fsrv, gsize used) {
+	if (0 != fsrv->memory.hard_limit && used >= fsrv->memory.hard_limit) return FASTCGI_MEMORY_HARD;
+	if (0 != fsrv->memory.soft_limit && used >= fsrv->memory.soft_limit) return FASTCGI_MEMORY_SOFT;
+	return FASTCGI_MEMORY_NORMAL;
+}
+
+static void fastcgi_server_memory_cb(struct ev_loop *loop, ev_prepare *w, int revents) {
+	fastcgi_server *fsrv = (fastcgi_server*) w->data;
+	gsize used = fastcgi_server_memory_used(fsrv), limit;
+	enum fastcgi_memory_level level = fastcgi_server_memory_level(fsrv, used);
+	UNUSED(loop);
+	UNUSED(revents);
+
+	if (level > FASTCGI_MEMORY_NORMAL && FASTCGI_MEMORY_NORMAL == fsrv->memory.level) {
+		/* cached memory goes first */
+		fastcgi_server_trim_pool(fsrv);
+		used = fastcgi_server_memory_used(fsrv);
+		level = fastcgi_server_memory_level(fsrv, used);
+	}
+
+	if (level != fsrv->memory.level) {
+		if (level > fsrv->memory.level) fsrv->stats.memory_pressure++;
+		if (FASTCGI_MEMORY_NORMAL == level) fastcgi_server_memory_resume(fsrv);
+		fsrv->memory.level = level;
+		if (fsrv->callbacks->cb_memory_pressure) {
+			fsrv->callbacks->cb_memory_pressure(fsrv, level);
+		}
+	}
+
+	if (FASTCGI_MEMORY_NORMAL == fsrv->memory.level) return;
+	limit = (0 != fsrv->memory.soft_limit) ? fsrv->memory.soft_limit : fsrv->memory.hard_limit;
+	used = fastcgi_server_memory_used(fsrv);
+	if (used > limit) fastcgi_server_memory_suspend(fsrv, used - limit);
+}
+
+fastcgi_server *fastcgi_server_create(struct ev_loop *loop, gint socketfd, const fastcgi_callbacks *callbacks, guint max_connections) {
+	fastcgi_server *fsrv = g_slice_new0(fastcgi_server);
+
+	fsrv->callbacks = callbacks;
+
+	fsrv->max_connections = max_connections;
+	fsrv->connection_limit = max_connections;
+	fsrv->accept_budget = FASTCGI_DEFAULT_ACCEPT_BUDGET;
+	fsrv->write_low_watermark = FASTCGI_DEFAULT_WRITE_LOW_WATERMARK;
+	fsrv->write_high_watermark = FASTCGI_DEFAULT_WRITE_HIGH_WATERMARK;
+	fsrv->reserve_fd = fastcgi_open_reserve_fd();
+	fsrv->read_buffer_size = FASTCGI_DEFAULT_READ_BUFFER_SIZE;
+
+	fsrv->connections = g_ptr_array_sized_new(fsrv->max_connections);
+	fsrv->free_requests = g_ptr_array_new();
+	fsrv->free_connections = g_ptr_array_new();
+	fsrv->max_free_connections = FASTCGI_DEFAULT_MAX_FREE_CONNECTIONS;
+	fastcgi_pool_init(&fsrv->pool);
+
+	fsrv->loop = loop;
+	fsrv->fd = socketfd;
+	fd_init(fsrv->fd);
+	ev_io_init(&fsrv->fd_watcher, fastcgi_server_fd_cb, fsrv->fd, EV_READ);
+	fsrv->fd_watcher.data = fsrv;
+	ev_io_start(fsrv->loop, &fsrv->fd_watcher);
+
+	ev_prepare_init(&fsrv->closing_watcher, fastcgi_closing_cb);
+	fsrv->closing_watcher.data = fsrv;
+
+	ev_init(&fsrv->emfile_timer, fastcgi_server_emfile_cb);
+	fsrv->emfile_timer.data = fsrv;
+
+	ev_prepare_init(&fsrv->memory_watcher, fastcgi_server_memory_cb);
+	fsrv->memory_watcher.data = fsrv;
+
+	fsrv->handoff_fd = -1;
+	ev_init(&fsrv->drain_timer, fastcgi_server_drain_timeout_cb);
+	fsrv->drain_timer.data = fsrv;
+	ev_init(&fsrv->adopt_watcher, fastcgi_server_adopt_cb);
+	fsrv->adopt_watcher.data = fsrv;
+	ev_prepare_init(&fsrv->flush_watcher, fastcgi_server_flush_cb);
+	fsrv->flush_watcher.data = fsrv;
+
+	return fsrv;
+}
+
+void fastcgi_server_stop(fastcgi_server *fsrv) {
+	if (fsrv->do_shutdown) return;
+	fsrv->do_shutdown = TRUE;
+
+	ev_io_stop(fsrv->loop, &fsrv->fd_watcher);
+	ev_timer_stop(fsrv->loop, &fsrv->emfile_timer);
+#ifdef HAVE_LIBURING
+	if (fsrv->uring) {
+		fastcgi_uring_cancel_accept(fsrv);
+		fastcgi_uring_check_idle(fsrv);
+	}
+#endif
+	close(fsrv->fd);
+	fsrv->fd = -1;
+}
+
+void fastcgi_server_free(fastcgi_server *fsrv) {
+	GList *l;
+	guint i;
+	if (!fsrv->do_shutdown) fastcgi_server_stop(fsrv);
+	ev_prepare_stop(fsrv->loop, &fsrv->closing_watcher);
+	ev_prepare_stop(fsrv->loop, &fsrv->flush_watcher);
+	while (NULL != (l = g_queue_pop_head_link(&fsrv->flushing))) l->data = NULL; /* unwritten output is dropped */
+	ev_timer_stop(fsrv->loop, &fsrv->drain_timer);
+	fsrv->draining = FALSE;
+	if (ev_is_active(&fsrv->adopt_watcher)) {
+		ev_io_stop(fsrv->loop, &fsrv->adopt_watcher);
+		close(fsrv->adopt_watcher.fd);
+	}
+	if (ev_is_active(&fsrv->memory_watcher)) {
+		ev_ref(fsrv->loop);
+		ev_prepare_stop(fsrv->loop, &fsrv->memory_watcher);
+	}
+	fastcgi_server_set_timeouts(fsrv, 0, 0, 0);
+
+	for (i = 0; i < fsrv->connections->len; i++) {
+		fastcgi_connection *fcon = g_ptr_array_index(fsrv->connections, i);
+		fastcgi_connection_abort_requests(fcon);
+		fastcgi_connection_set_closing(fcon);
+	}
+#ifdef HAVE_LIBURING
+	/* wait until the kernel is done with all connections */
+	if (fsrv->uring) fastcgi_uring_free(fsrv);
+#endif
+	fastcgi_cleanup_connections(fsrv);
+	g_ptr_array_free(fsrv->connections, TRUE);
+	for (i = 0; i < fsrv->free_requests->len; i++) {
+		fastcgi_request *req = g_ptr_array_index(fsrv->free_requests, i);
+		fastcgi_arena_clear(&req->arena);
+		g_byte_array_free(req->parambuf, TRUE);
+		fastcgi_mem_free(fsrv->pool.allocator, req, sizeof(fastcgi_request));
+	}
+	g_ptr_array_free(fsrv->free_requests, TRUE);
+	fastcgi_server_set_free_connections(fsrv, 0);
+	g_ptr_array_free(fsrv->free_connections, TRUE);
+	g_free(fsrv->read_buffer);
+	fastcgi_pool_clear(&fsrv->pool);
+	if (-1 != fsrv->reserve_fd) close(fsrv->reserve_fd);
+
+	g_slice_free(fastcgi_server, fsrv);
+}
+
+void fastcgi_server_set_request_limits(fastcgi_server *fsrv, guint max_requests, guint max_connection_requests) {
+	fsrv->max_requests = max_requests;
+	fsrv->max_connection_requests = max_connection_requests;
+}
+
+void fastcgi_server_get_stats(fastcgi_server *fsrv, fastcgi_server_stats *stats) {
+	*stats = fsrv->stats;
+	stats->connections = fsrv->connections->len;
+	stats->requests = fsrv->cur_requests;
+	stats->write_queue_bytes = fsrv->memory.write_queues;
+}
+
+guint64 fastcgi_histogram_percentile(const fastcgi_histogram *h, gdouble p) {
+	guint64 rank, seen = 0;
+	guint i;
+
+	if (0 == h->count) return 0;
+	/* nearest rank: ceil(p * count), clamped to [1, count] */
+	if (p * h->count <= 1) {
+		rank = 1;
+	} else if (p * h->count >= h->count) {
+		rank = h->count;
+	} else {
+		rank = (guint64) (p * h->count);
+		if ((gdouble) rank < p * h->count) rank++;
+	}
+	for (i = 0; i < FASTCGI_HISTOGRAM_BUCKETS - 1; i++) {
+		seen += h->buckets[i];
+		if (seen >= rank) break;
+	}
+	return G_GUINT64_CONSTANT(1) << i;
+}
+
+void fastcgi_server_set_free_connections(fastcgi_server *fsrv, guint max_free) {
+	fsrv->max_free_connections = max_free;
+	while (fsrv->free_connections->len > max_free) {
+		fastcgi_connection_destroy(fsrv, g_ptr_array_remove_index_fast(fsrv->free_connections, fsrv->free_connections->len - 1));
+	}
+}
+
+void fastcgi_server_set_read_buffer_size(fastcgi_server *fsrv, gsize size) {
+	if (size < FCGI_HEADER_LEN) size = FCGI_HEADER_LEN;
+	if (size == fsrv->read_buffer_size) return;
+	fsrv->read_buffer_size = size;
+	g_free(fsrv->read_buffer); /* reallocated on next read */
+	fsrv->read_buffer = NULL;
+}
+
+void fastcgi_server_set_accept_budget(fastcgi_server *fsrv, guint budget) {
+	fsrv->accept_budget = budget;
+}
+
+void fastcgi_server_release_buffer(fastcgi_server *fsrv, GByteArray *buf) {
+	if (!buf) return;
+	fastcgi_pool_put_chunk(&fsrv->pool, buf);
+}
+
+void fastcgi_server_trim_pool(fastcgi_server *fsrv) {
+	fastcgi_pool_trim(&fsrv->pool);
+}
+
+gboolean fastcgi_server_set_allocator(fastcgi_server *fsrv, const fastcgi_allocator *allocator) {
+	/* objects from the old allocator have to go back to it */
+	if (fsrv->connections->len > 0 || fsrv->free_connections->len > 0 || fsrv->free_requests->len > 0 || NULL != fsrv->pool.links) {
+		return FALSE;
+	}
+	if (NULL != fsrv->wheel) {
+		/* no connections in it: recreate the timer wheel with the new allocator */
+		ev_tstamp idle = fsrv->idle_timeout, read = fsrv->read_timeout, request = fsrv->request_timeout;
+		fastcgi_server_set_timeouts(fsrv, 0, 0, 0);
+		fsrv->pool.allocator = allocator;
+		fastcgi_server_set_timeouts(fsrv, idle, read, request);
+		return TRUE;
+	}
+	fsrv->pool.allocator = allocator;
+	return TRUE;
+}
+
+void fastcgi_server_set_memory_limits(fastcgi_server *fsrv, gsize soft_limit, gsize hard_limit) {
+	fsrv->memory.soft_limit = soft_limit;
+	fsrv->memory.hard_limit = hard_limit;
+	if (0 != soft_limit || 0 != hard_limit) {
+		if (!ev_is_active(&fsrv->memory_watcher)) {
+			ev_prepare_start(fsrv->loop, &fsrv->memory_watcher);
+			ev_unref(fsrv->loop); /* don't keep the loop alive */
+		}
+	} else if (ev_is_active(&fsrv->memory_watcher)) {
+		ev_ref(fsrv->loop);
+		ev_prepare_stop(fsrv->loop, &fsrv->memory_watcher);
+		fastcgi_server_memory_resume(fsrv);
+		fsrv->memory.level = FASTCGI_MEMORY_NORMAL;
+	}
+}
+
+gsize fastcgi_server_memory_used(fastcgi_server *fsrv) {
+	return fsrv->memory.write_queues + fsrv->memory.params + fsrv->memory.readbufs + fsrv->memory.input + fsrv->memory.free_requests + fsrv->pool.resident;
+}
+
+void fastcgi_server_set_input_watermarks(fastcgi_server *fsrv, gsize low, gsize high) {
+	guint i;
+	g_return_if_fail(low <= high);
+	fsrv->input_low_watermark = low;
+	fsrv->input_high_watermark = high;
+	for (i = 0; i < fsrv->connections->len; i++) {
+		fastcgi_connection_input_backpressure(g_ptr_array_index(fsrv->connections, i));
+	}
+}
+
+void fastcgi_server_set_write_watermarks(fastcgi_server *fsrv, gsize low, gsize high) {
+	g_return_if_fail(low <= high && high > 0);
+	fsrv->write_low_watermark = low;
+	fsrv->write_high_watermark = high;
+}
+
+void fastcgi_server_set_output_coalescing(fastcgi_server *fsrv, gsize max_copy) {
+	fsrv->coalesce_max_copy = MIN(max_copy, FASTCGI_RECORD_CHUNK_SIZE);
+}
+
+/* new listening socket on the address of socketfd; -1 if not possible (not tcp, or socketfd was bound without SO_REUSEPORT) */
+static gint fastcgi_reuseport_listener(gint socketfd) {
+#ifdef SO_REUSEPORT
+	struct sockaddr_storage addr;
+	socklen_t addrlen = sizeof(addr);
+	int fd, one = 1;
+
+	if (-1 == getsockname(socketfd, (struct sockaddr*) &addr, &addrlen)) return -1;
+	if (AF_INET != addr.ss_family && AF_INET6 != addr.ss_family) return -1;
+
+	if (-1 == (fd = socket(addr.ss_family, SOCK_STREAM, 0))) return -1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+#ifdef IPV6_V6ONLY
+	if (AF_INET6 == addr.ss_family) {
+		int v6only = 0;
+		socklen_t optlen = sizeof(v6only);
+		if (0 == getsockopt(socketfd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, &optlen)) {
+			setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only));
+		}
+	}
+#endif
+	if (-1 == setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one))
+	 || -1 == bind(fd, (struct sockaddr*) &addr, addrlen)
+	 || -1 == listen(fd, SOMAXCONN)) {
+		/* expected if socketfd wasn't bound with SO_REUSEPORT; the caller falls back to dup() */
+		g_debug("no SO_REUSEPORT listener, sharing the socket: %s", g_strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+#else
+	UNUSED(socketfd);
+	return -1;
+#endif
+}
+
+static void fastcgi_thread_worker_wakeup_cb(struct ev_loop *loop, ev_async *w, int revents) {
+	fastcgi_thread_worker *worker = w->data;
+	fastcgi_server *fsrv = worker->tsrv->workers[worker->id];
+	UNUSED(revents);
+
+	switch (g_atomic_int_get(&worker->state)) {
+	case FASTCGI_WORKER_STOP:
+		fastcgi_server_stop(fsrv);
+		break;
+	case FASTCGI_WORKER_SHUTDOWN:
+		ev_break(loop, EVBREAK_ALL);
+		break;
+	}
+}
+
+static void fastcgi_thread_worker_publish_stats(fastcgi_thread_worker *worker) {
+	g_mutex_lock(&worker->stats_lock);
+	fastcgi_server_get_stats(worker->tsrv->workers[worker->id], &worker->stats);
+	g_mutex_unlock(&worker->stats_lock);
+}
+
+static void fastcgi_thread_worker_stats_cb(struct ev_loop *loop, ev_timer *w, int revents) {
+	UNUSED(loop);
+	UNUSED(revents);
+	fastcgi_thread_worker_publish_stats(w->data);
+}
+
+static gpointer fastcgi_thread_worker_run(gpointer data) {
+	fastcgi_thread_worker *worker = data;
+
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+	if (worker->cpu >= 0) {
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(worker->cpu, &cpus);
+		pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+	}
+#endif
+
+	ev_run(worker->loop, 0);
+	fastcgi_thread_worker_publish_stats(worker);
+
+	/* the server stays around for fastcgi_threaded_server_get_stats, it is freed after the join */
+	return NULL;
+}
+
+fastcgi_threaded_server *fastcgi_threaded_server_create(gint socketfd, const fastcgi_callbacks *callbacks, guint max_connections, guint nthreads, guint flags) {
+	fastcgi_threaded_server *tsrv = g_slice_new0(fastcgi_threaded_server);
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	gboolean reuseport = (0 != (flags & FASTCGI_THREADED_REUSEPORT));
+	guint i;
+
+	if (cpus < 1) cpus = 1;
+	if (0 == nthreads) nthreads = cpus;
+
+	tsrv->workers_count = nthreads;
+	tsrv->workers = g_new0(fastcgi_server*, nthreads);
+	tsrv->threads = g_new0(fastcgi_thread_worker, nthreads);
+
+	for (i = 0; i < nthreads; i++) {
+		fastcgi_thread_worker *worker = &tsrv->threads[i];
+		gint fd = socketfd;
+
+		if (i > 0) {
+			fd = reuseport ? fastcgi_reuseport_listener(socketfd) : -1;
+			if (-1 == fd) {
+				/* share the listening socket instead: all workers wait on it and the kernel decides who gets
+				 * a connection (thundering herd, no balancing) */
+				reuseport = FALSE;
+				fd = dup(socketfd);
+			}
+		}
+
+		worker->tsrv = tsrv;
+		worker->id = i;
+		worker->cpu = (0 != (flags & FASTCGI_THREADED_PIN_CPUS)) ? (gint) (i % cpus) : -1;
+		worker->loop = ev_loop_new(EVFLAG_AUTO);
+		ev_async_init(&worker->wakeup_watcher, fastcgi_thread_worker_wakeup_cb);
+		worker->wakeup_watcher.data = worker;
+		ev_async_start(worker->loop, &worker->wakeup_watcher);
+		g_mutex_init(&worker->stats_lock);
+		ev_timer_init(&worker->stats_watcher, fastcgi_thread_worker_stats_cb, FASTCGI_STATS_PUBLISH_INTERVAL, FASTCGI_STATS_PUBLISH_INTERVAL);
+		worker->stats_watcher.data = worker;
+		ev_timer_start(worker->loop, &worker->stats_watcher);
+		ev_unref(worker->loop); /* don't keep the loop alive */
+
+		tsrv->workers[i] = fastcgi_server_create(worker->loop, fd, callbacks, max_connections);
+	}
+
+	return tsrv;
+}
+
+void fastcgi_threaded_server_start(fastcgi_threaded_server *tsrv) {
+	guint i;
+	if (tsrv->started) return;
+	tsrv->started = TRUE;
+
+	for (i = 0; i < tsrv->workers_count; i++) {
+		fastcgi_thread_worker *worker = &tsrv->threads[i];
+		worker->thread = g_thread_new("fastcgi-worker", fastcgi_thread_worker_run, worker);
+	}
+}
+
+static void fastcgi_threaded_server_signal(fastcgi_threaded_server *tsrv, gint state) {
+	guint i;
+	for (i = 0; i < tsrv->workers_count; i++) {
+		fastcgi_thread_worker *worker = &tsrv->threads[i];
+		g_atomic_int_set(&worker->state, state);
+		ev_async_send(worker->loop, &worker->wakeup_watcher);
+	}
+}
+
+void fastcgi_threaded_server_stop(fastcgi_threaded_server *tsrv) {
+	guint i;
+	if (tsrv->started) {
+		fastcgi_threaded_server_signal(tsrv, FASTCGI_WORKER_STOP);
+	} else {
+		for (i = 0; i < tsrv->workers_count; i++) fastcgi_server_stop(tsrv->workers[i]);
+	}
+}
+
+void fastcgi_threaded_server_free(fastcgi_threaded_server *tsrv) {
+	guint i;
+
+	if (tsrv->started) {
+		fastcgi_threaded_server_signal(tsrv, FASTCGI_WORKER_SHUTDOWN);
+		for (i = 0; i < tsrv->workers_count; i++) g_thread_join(tsrv->threads[i].thread);
+	}
+
+	/* the loops don't run anymore; close the connections now */
+	for (i = 0; i < tsrv->workers_count; i++) {
+		fastcgi_thread_worker *worker = &tsrv->threads[i];
+		if (tsrv->workers[i]) fastcgi_server_free(tsrv->workers[i]);
+		ev_async_stop(worker->loop, &worker->wakeup_watcher);
+		ev_ref(worker->loop);
+		ev_timer_stop(worker->loop, &worker->stats_watcher);
+		g_mutex_clear(&worker->stats_lock);
+		ev_loop_destroy(worker->loop);
+	}
+
+	g_free(tsrv->threads);
+	g_free(tsrv->workers);
+	g_slice_free(fastcgi_threaded_server, tsrv);
+}
+
+/* while the workers run, this adds up the snapshots they published last (at most FASTCGI_STATS_PUBLISH_INTERVAL old) */
+void fastcgi_threaded_server_get_stats(fastcgi_threaded_server *tsrv, fastcgi_server_stats *stats) {
+	guint64 *sum = (guint64*) stats;
+	guint i, j;
+
+	G_STATIC_ASSERT(0 == sizeof(fastcgi_server_stats) % sizeof(guint64));
+	memset(stats, 0, sizeof(*stats));
+	for (i = 0; i < tsrv->workers_count; i++) {
+		fastcgi_server_stats w;
+		const guint64 *add = (const guint64*) &w;
+
+		if (NULL == tsrv->workers[i]) continue;
+		if (tsrv->started) {
+			fastcgi_thread_worker *worker = &tsrv->threads[i];
+			g_mutex_lock(&worker->stats_lock);
+			w = worker->stats;
+			g_mutex_unlock(&worker->stats_lock);
+		} else {
+			fastcgi_server_get_stats(tsrv->workers[i], &w);
+		}
+		for (j = 0; j < sizeof(fastcgi_server_stats) / sizeof(guint64); j++) sum[j] += add[j];
+	}
+}
+
+void fastcgi_suspend_read(fastcgi_connection *fcon) {
+	fcon->user_suspended = TRUE;
+	fastcgi_connection_update_read(fcon);
+}
+
+void fastcgi_resume_read(fastcgi_connection *fcon) {
+	fcon->user_suspended = FALSE;
+	fastcgi_connection_update_read(fcon);
+}
+
+void fastcgi_consume_input(fastcgi_connection *fcon, gsize len) {
+	if (NULL == fcon->request) return;
+	fastcgi_request_consume_input(fcon->request, len);
+}
+
+void fastcgi_release_input(fastcgi_connection *fcon, GByteArray *buf) {
+	if (!buf) return;
+	fastcgi_consume_input(fcon, buf->len);
+	fastcgi_pool_put_chunk(&fcon->fsrv->pool, buf);
+}
+
+void fastcgi_request_consume_input(fastcgi_request *req, gsize len) {
+	fastcgi_request_input_consumed(req, len);
+	fastcgi_connection_input_backpressure(req->fcon);
+}
+
+void fastcgi_request_release_input(fastcgi_request *req, GByteArray *buf) {
+	if (!buf) return;
+	fastcgi_request_consume_input(req, buf->len);
+	fastcgi_pool_put_chunk(&req->fcon->fsrv->pool, buf);
+}
+
+/* kills data */
+static void fastcgi_send_string(fastcgi_connection *fcon, guint8 type, guint16 requestID, GString *data) {
+	gboolean had_data = (fcon->write_queue.length > 0);
+	if (fcon->closing) {
+		if (data) g_string_free(data, TRUE);
+		return;
+	}
+	if (!data) {
+		stream_send_fcgi_record(&fcon->write_queue, type, requestID, 0);
+	} else if (fastcgi_connection_coalesce(fcon, type, requestID, (const guint8*) data->str, data->len)) {
+		g_string_free(data, TRUE);
+	} else {
+		stream_send_string(&fcon->write_queue, type, requestID, data);
+	}
+	fastcgi_connection_queued(fcon, had_data);
+}
+
+/* kills data */
+static void fastcgi_send_bytearray(fastcgi_connection *fcon, guint8 type, guint16 requestID, GByteArray *data) {
+	gboolean had_data = (fcon->write_queue.length > 0);
+	if (fcon->closing) {
+		if (data) g_byte_array_free(data, TRUE);
+		return;
+	}
+	if (!data) {
+		stream_send_fcgi_record(&fcon->write_queue, type, requestID, 0);
+	} else if (fastcgi_connection_coalesce(fcon, type, requestID, data->data, data->len)) {
+		/* copied; the array is the application's, not a pool block */
+		g_byte_array_free(data, TRUE);
+	} else {
+		stream_send_bytearray(&fcon->write_queue, type, requestID, data);
+	}
+	fastcgi_connection_queued(fcon, had_data);
+}
+
+/* kills data (drops the reference) */
+static void fastcgi_send_bytes(fastcgi_connection *fcon, guint8 type, guint16 requestID, GBytes *data) {
+	gboolean had_data = (fcon->write_queue.length > 0);
+	if (fcon->closing) {
+		if (data) g_bytes_unref(data);
+		return;
+	}
+	if (!data) {
+		stream_send_fcgi_record(&fcon->write_queue, type, requestID, 0);
+	} else if (fastcgi_connection_coalesce(fcon, type, requestID, g_bytes_get_data(data, NULL), g_bytes_get_size(data))) {
+		g_bytes_unref(data);
+	} else {
+		stream_send_bytes(&fcon->write_queue, type, requestID, data);
+	}
+	fastcgi_connection_queued(fcon, had_data);
+}
+
+/* takes ownership of fd */
+static void fastcgi_send_file(fastcgi_connection *fcon, guint8 type, guint16 requestID, gint fd, goffset offset, gsize len) {
+	gboolean had_data = (fcon->write_queue.length > 0);
+	if (fcon->closing || 0 == len) {
+		close(fd);
+		return;
+	}
+	stream_send_file(&fcon->write_queue, type, requestID, fd, offset, len);
+	fastcgi_connection_queued(fcon, had_data);
+}
+
+/* fills the queue from the producers and starts writing */
+static void fastcgi_connection_refill(fastcgi_connection *fcon) {
+	gboolean had_data = (fcon->write_queue.length > 0);
+	if (fcon->closing || fcon->write_queue.length >= fcon->fsrv->write_low_watermark) return;
+	fastcgi_connection_produce(fcon);
+	if (!had_data && fcon->write_queue.length > 0) write_queue(fcon);
+}
+
+static void fastcgi_request_set_producers(fastcgi_request *req, fastcgi_producer_cb cb, fastcgi_request_producer_cb req_cb, gpointer ctx) {
+	fastcgi_connection *fcon = req->fcon;
+
+	fastcgi_request_drop_producer(req);
+	if (NULL == cb && NULL == req_cb) return;
+
+	req->producer = cb;
+	req->req_producer = req_cb;
+	req->producer_ctx = ctx;
+	req->producer_waiting = FALSE;
+	if (NULL == fcon->producers) fcon->producers = g_ptr_array_new();
+	g_ptr_array_add(fcon->producers, req);
+	fastcgi_connection_refill(fcon);
+}
+
+/* queues FCGI_END_REQUEST and frees req, doesn't write */
+static void fastcgi_request_finish(fastcgi_request *req, gint32 appStatus, enum FCGI_ProtocolStatus status) {
+	fastcgi_connection *fcon = req->fcon;
+
+	if (!fcon->closing) {
+		stream_send_end_request(&fcon->write_queue, req->requestID, appStatus, status);
+		fcon->fsrv->stats.requests_ended++;
+		fastcgi_histogram_add(&fcon->fsrv->stats.request_latency, ev_time() - req->received);
+	}
+	fastcgi_request_free(req);
+}
+
+void fastcgi_request_end(fastcgi_request *req, gint32 appStatus, enum FCGI_ProtocolStatus status) {
+	fastcgi_connection *fcon = req->fcon;
+	gboolean had_data = (fcon->write_queue.length > 0);
+
+	if (fcon->producing == req) {
+		/* from within the producer: its data isn't queued yet, see fastcgi_connection_produce */
+		req->end_pending = TRUE;
+		req->end_app_status = appStatus;
+		req->end_status = status;
+		return;
+	}
+	fastcgi_request_finish(req, appStatus, status);
+	fastcgi_connection_queued(fcon, had_data);
+}
+
+void fastcgi_request_send_out(fastcgi_request *req, GString *data) {
+	fastcgi_request_stdout_sent(req);
+	fastcgi_send_string(req->fcon, FCGI_STDOUT, req->requestID, data);
+}
+
+void fastcgi_request_send_err(fastcgi_request *req, GString *data) {
+	fastcgi_send_string(req->fcon, FCGI_STDERR, req->requestID, data);
+}
+
+void fastcgi_request_send_out_bytearray(fastcgi_request *req, GByteArray *data) {
+	fastcgi_request_stdout_sent(req);
+	fastcgi_send_bytearray(req->fcon, FCGI_STDOUT, req->requestID, data);
+}
+
+void fastcgi_request_send_err_bytearray(fastcgi_request *req, GByteArray *data) {
+	fastcgi_send_bytearray(req->fcon, FCGI_STDERR, req->requestID, data);
+}
+
+void fastcgi_request_send_out_bytes(fastcgi_request *req, GBytes *data) {
+	fastcgi_request_stdout_sent(req);
+	fastcgi_send_bytes(req->fcon, FCGI_STDOUT, req->requestID, data);
+}
+
+void fastcgi_request_send_err_bytes(fastcgi_request *req, GBytes *data) {
+	fastcgi_send_bytes(req->fcon, FCGI_STDERR, req->requestID, data);
+}
+
+void fastcgi_request_send_out_file(fastcgi_request *req, gint fd, goffset offset, gsize len) {
+	fastcgi_request_stdout_sent(req);
+	fastcgi_send_file(req->fcon, FCGI_STDOUT, req->requestID, fd, offset, len);
+}
+
+void fastcgi_request_set_producer(fastcgi_request *req, fastcgi_request_producer_cb cb, gpointer ctx) {
+	fastcgi_request_set_producers(req, NULL, cb, ctx);
+}
+
+void fastcgi_request_producer_wakeup(fastcgi_request *req) {
+	if (!req->producer_waiting) return;
+	req->producer_waiting = FALSE;
+	fastcgi_connection_refill(req->fcon);
+}
+
+void fastcgi_request_flush(fastcgi_request *req) {
+	fastcgi_flush(req->fcon);
+}
+
+gpointer fastcgi_request_alloc(fastcgi_request *req, gsize size) {
+	gpointer mem = fastcgi_arena_alloc(&req->arena, size);
+	fastcgi_request_account(req);
+	return mem;
+}
+
+gchar* fastcgi_request_strndup(fastcgi_request *req, const gchar *s, gsize len) {
+	gchar *d = fastcgi_arena_strndup(&req->arena, s, len);
+	fastcgi_request_account(req);
+	return d;
+}
+
+void fastcgi_end_request(fastcgi_connection *fcon, gint32 appStatus, enum FCGI_ProtocolStatus status) {
+	if (NULL == fcon->request) return;
+	fastcgi_request_end(fcon->request, appStatus, status);
+}
+
+void fastcgi_send_out(fastcgi_connection *fcon, GString *data) {
+	if (fcon->request) fastcgi_request_stdout_sent(fcon->request);
+	fastcgi_send_string(fcon, FCGI_STDOUT, fcon->requestID, data);
+}
+
+void fastcgi_send_err(fastcgi_connection *fcon, GString *data) {
+	fastcgi_send_string(fcon, FCGI_STDERR, fcon->requestID, data);
+}
+
+void fastcgi_send_out_bytearray(fastcgi_connection *fcon, GByteArray *data) {
+	if (fcon->request) fastcgi_request_stdout_sent(fcon->request);
+	fastcgi_send_bytearray(fcon, FCGI_STDOUT, fcon->requestID, data);
+}
+
+void fastcgi_send_err_bytearray(fastcgi_connection *fcon, GByteArray *data) {
+	fastcgi_send_bytearray(fcon, FCGI_STDERR, fcon->requestID, data);
+}
+
+void fastcgi_send_out_bytes(fastcgi_connection *fcon, GBytes *data) {
+	if (fcon->request) fastcgi_request_stdout_sent(fcon->request);
+	fastcgi_send_bytes(fcon, FCGI_STDOUT, fcon->requestID, data);
+}
+
+void fastcgi_send_err_bytes(fastcgi_connection *fcon, GBytes *data) {
+	fastcgi_send_bytes(fcon, FCGI_STDERR, fcon->requestID, data);
+}
+
+void fastcgi_send_out_file(fastcgi_connection *fcon, gint fd, goffset offset, gsize len) {
+	if (fcon->request) fastcgi_request_stdout_sent(fcon->request);
+	fastcgi_send_file(fcon, FCGI_STDOUT, fcon->requestID, fd, offset, len);
+}
+
+void fastcgi_set_producer(fastcgi_connection *fcon, fastcgi_producer_cb cb, gpointer ctx) {
+	if (NULL == fcon->request) return;
+	fastcgi_request_set_producers(fcon->request, cb, NULL, ctx);
+}
+
+void fastcgi_producer_wakeup(fastcgi_connection *fcon) {
+	if (NULL == fcon->request) return;
+	fastcgi_request_producer_wakeup(fcon->request);
+}
+
+void fastcgi_flush(fastcgi_connection *fcon) {
+	/* otherwise the queue is empty or waits for the socket */
+	if (fastcgi_connection_remove_flush(fcon)) write_queue(fcon);
+}
+
+gpointer fastcgi_connection_alloc(fastcgi_connection *fcon, gsize size) {
+	if (NULL == fcon->request) return NULL;
+	return fastcgi_request_alloc(fcon->request, size);
+}
+
+gchar* fastcgi_connection_strndup(fastcgi_connection *fcon, const gchar *s, gsize len) {
+	if (NULL == fcon->request) return NULL;
+	return fastcgi_request_strndup(fcon->request, s, len);
+}
+
+gsize fastcgi_write_space(fastcgi_connection *fcon) {
+	gsize high = fcon->fsrv->write_high_watermark;
+	return (fcon->write_queue.length < high) ? high - fcon->write_queue.length : 0;
+}
+
+static char** build_env(const fastcgi_environ *environ) {
+	GPtrArray *env = g_ptr_array_new();
+	fastcgi_environ_iter iter;
+	const gchar *key, *value;
+	gsize keylen, valuelen;
+
+	fastcgi_environ_iter_init(&iter, environ);
+	while (fastcgi_environ_iter_next(&iter, &key, &keylen, &value, &valuelen)) {
+		char *s = g_malloc(keylen + valuelen + 2);
+		memcpy(s, key, keylen);
+		memcpy(s + keylen + 1, value, valuelen);
+		s[keylen] = '=';
+		s[keylen + valuelen + 1] = '\0';
+		g_ptr_array_add(env, s);
+	}
+	g_ptr_array_add(env, NULL);
+
+	return (char**) g_ptr_array_free(env, FALSE);
+}
+
+gsize fastcgi_environ_build_size(const fastcgi_environ *env) {
+	gsize size = sizeof(char*); /* NULL terminator */
+	guint i;
+	if (NULL == env) return size;
+	for (i = 0; i < env->count; i++) {
+		size += sizeof(char*) + env->entries[i].keylen + env->entries[i].valuelen + 2;
+	}
+	return size;
+}
+
+char** fastcgi_environ_build(const fastcgi_environ *env, gpointer buf, gsize bufsize) {
+	guint i, count = (NULL != env) ? env->count : 0;
+	char **ptrs = buf;
+	char *s = (char*) (ptrs + count + 1);
+
+	if (bufsize < fastcgi_environ_build_size(env)) return NULL;
+	g_return_val_if_fail(0 == ((guintptr) buf % sizeof(char*)), NULL);
+
+	for (i = 0; i < count; i++) {
+		const fastcgi_environ_entry *e = &env->entries[i];
+		ptrs[i] = s;
+		memcpy(s, e->key, e->keylen);
+		s += e->keylen;
+		*s++ = '=';
+		memcpy(s, e->value, e->valuelen + 1); /* including '\0' */
+		s += e->valuelen + 1;
+	}
+	ptrs[count] = NULL;
+
+	return ptrs;
+}
+
+char** fastcgi_environ_build_packed(const fastcgi_environ *env) {
+	gsize size = fastcgi_environ_build_size(env);
+	return fastcgi_environ_build(env, g_malloc(size), size);
+}
+
+char** fastcgi_build_env(fastcgi_connection *con) {
+	return build_env(con->environ);
+}
+
+const gchar* fastcgi_connection_environ_lookup(fastcgi_connection *fcon, const gchar* key, gsize keylen) {
+	return fastcgi_environ_lookup(fcon->environ, key, keylen);
+}
+
+char** fastcgi_request_build_env(fastcgi_request *req) {
+	return build_env(&req->environ);
+}
+
+const gchar* fastcgi_request_environ_lookup(fastcgi_request *req, const gchar* key, gsize keylen) {
+	return fastcgi_environ_lookup(&req->environ, key, keylen);
+}
+
+const gchar* fastcgi_environ_lookup(const fastcgi_environ *env, const gchar* key, gsize keylen) {
+	fastcgi_environ_entry *e;
+	gint var;
+	if (NULL == env) return NULL;
+	if ((var = environ_known_var(key, keylen)) >= 0) return fastcgi_environ_get(env, var);
+	e = environ_find(env, environ_hash(key, keylen), key, keylen);
+	return (NULL != e) ? e->value : NULL;
+}
+
+const gchar* fastcgi_environ_get(const fastcgi_environ *env, enum fastcgi_env_var var) {
+	guint i;
+	if (NULL == env || (guint) var >= FASTCGI_ENV_COUNT) return NULL;
+	i = env->known[var];
+	return (0 != i) ? env->entries[i - 1].value : NULL;
+}
+
+gint64 fastcgi_environ_get_int(const fastcgi_environ *env, enum fastcgi_env_var var) {
+	const gchar *s = fastcgi_environ_get(env, var);
+	gint64 v = 0;
+	if (NULL == s || '\0' == *s) return -1;
+	for (; '\0' != *s; s++) {
+		if (*s < '0' || *s > '9') return -1;
+		if (v > (G_MAXINT64 - 9) / 10) return -1; /* overflow */
+		v = v * 10 + (*s - '0');
+	}
+	return v;
+}
+
+gint64 fastcgi_environ_content_length(const fastcgi_environ *env) {
+	return fastcgi_environ_get_int(env, FASTCGI_ENV_CONTENT_LENGTH);
+}
+
+gboolean fastcgi_environ_https(const fastcgi_environ *env) {
+	const gchar *s = fastcgi_environ_get(env, FASTCGI_ENV_HTTPS);
+	return NULL != s && (0 == g_ascii_strcasecmp(s, "on") || 0 == strcmp(s, "1"));
+}
+
+void fastcgi_environ_iter_init(fastcgi_environ_iter *iter, const fastcgi_environ *env) {
+	iter->env = env;
+	iter->pos = 0;
+}
+
+gboolean fastcgi_environ_iter_next(fastcgi_environ_iter *iter, const gchar **key, gsize *keylen, const gchar **value, gsize *valuelen) {
+	const fastcgi_environ_entry *e;
+	if (NULL == iter->env || iter->pos >= iter->env->count) return FALSE;
+	e = &iter->env->entries[iter->pos++];
+	if (key) *key = e->key;
+	if (keylen) *keylen = e->keylen;
+	if (value) *value = e->value;
+	if (valuelen) *valuelen = e->valuelen;
+	return TRUE;
+}
+
+/* client: requests to an upstream FastCGI application over pooled keep-alive connections.
+ * user callbacks only run from the connection watchers, never from within the API calls */
+
+typedef struct fastcgi_client_connection {
+	fastcgi_upstream *up;
+	guint ccon_id; /* index in up->connections */
+	gint fd;
+	ev_io fd_watcher;
+	gboolean connecting, closing;
+	gint connect_error; /* connect() failed right away, reported from the watcher */
+	ev_tstamp connect_started;
+	GList idle_link; /* data: ccon while in up->idle */
+	GList closing_link; /* data: ccon while in up->closing */
+
+	GHashTable *requests; /* requestID -> fastcgi_client_request */
+	guint max_requests; /* 1 until the peer reported FCGI_MPXS_CONNS */
+	guint16 last_id;
+
+	fastcgi_decoder decoder;
+	GByteArray *buffer; /* content of FCGI_END_REQUEST and FCGI_GET_VALUES_RESULT */
+	fastcgi_queue write_queue;
+} fastcgi_client_connection;
+
+#define FASTCGI_UPSTREAM_DEFAULT_MAX_IDLE 16
+#define FASTCGI_UPSTREAM_DEFAULT_CONNECTION_REQUESTS 16
+
+static void fastcgi_upstream_dispatch(fastcgi_upstream *up);
+
+static void fastcgi_client_request_free(fastcgi_client_request *creq) {
+	GBytes *bytes;
+	if (creq->params) g_byte_array_free(creq->params, TRUE);
+	while (NULL != (bytes = g_queue_pop_head(&creq->pending_stdin))) g_bytes_unref(bytes);
+	g_slice_free(fastcgi_client_request, creq);
+}
+
+/* creq must not be attached to a connection anymore */
+static void fastcgi_client_request_fail(fastcgi_client_request *creq) {
+	creq->up->stats.requests_failed++;
+	creq->up->callbacks->cb_error(creq);
+	fastcgi_client_request_free(creq);
+}
+
+static void fastcgi_client_connection_want_write(fastcgi_client_connection *ccon) {
+	/* writes happen in the watcher, so a failing write can't call back into the user from an API call */
+	if (ccon->connecting || ccon->closing) return;
+	ev_io_add_events(ccon->up->loop, &ccon->fd_watcher, EV_WRITE);
+}
+
+static void fastcgi_client_connection_close(fastcgi_client_connection *ccon) {
+	fastcgi_upstream *up = ccon->up;
+	fastcgi_client_connection *t_ccon;
+	guint l = up->connections->len - 1;
+	GList *reqs, *link;
+
+	if (ccon->closing) return;
+	ccon->closing = TRUE;
+
+	ev_io_stop(up->loop, &ccon->fd_watcher); /* also drops a fed event */
+	if (-1 != ccon->fd) {
+		close(ccon->fd);
+		ccon->fd = -1;
+	}
+	fastcgi_queue_clear(&ccon->write_queue);
+	if (NULL != ccon->idle_link.data) {
+		g_queue_unlink(&up->idle, &ccon->idle_link);
+		ccon->idle_link.data = NULL;
+	}
+
+	/* move the last connection into the gap, the slot is free for new connects right away */
+	t_ccon = g_ptr_array_index(up->connections, ccon->ccon_id) = g_ptr_array_index(up->connections, l);
+	t_ccon->ccon_id = ccon->ccon_id;
+	g_ptr_array_set_size(up->connections, l);
+	up->stats.connections_closed++;
+
+	ccon->closing_link.data = ccon;
+	g_queue_push_tail_link(&up->closing, &ccon->closing_link);
+	ev_prepare_start(up->loop, &up->closing_watcher);
+
+	reqs = g_hash_table_get_values(ccon->requests);
+	g_hash_table_remove_all(ccon->requests);
+	for (link = reqs; NULL != link; link = link->next) {
+		fastcgi_client_request *creq = link->data;
+		creq->ccon = NULL;
+		fastcgi_client_request_fail(creq);
+	}
+	g_list_free(reqs);
+}
+
+static void fastcgi_client_connection_free(fastcgi_client_connection *ccon) {
+	g_hash_table_destroy(ccon->requests);
+	g_byte_array_free(ccon->buffer, TRUE);
+	g_slice_free(fastcgi_client_connection, ccon);
+}
+
+/* connection without requests: keep it for the next one or close it */
+static void fastcgi_client_connection_idle(fastcgi_client_connection *ccon) {
+	fastcgi_upstream *up = ccon->up;
+
+	if (0 == up->max_idle) {
+		fastcgi_client_connection_close(ccon);
+		return;
+	}
+	ccon->idle_link.data = ccon;
+	g_queue_push_head_link(&up->idle, &ccon->idle_link);
+	if (up->idle.length > up->max_idle) {
+		fastcgi_client_connection_close(g_queue_peek_tail(&up->idle));
+	}
+}
+
+static void fastcgi_client_connection_write(fastcgi_client_connection *ccon) {
+	fastcgi_upstream *up = ccon->up;
+	gsize had_length = ccon->write_queue.length;
+	GList *reqs, *link;
+
+	if (fastcgi_queue_writev(ccon->fd, &ccon->write_queue, 256*1024, NULL) < 0) {
+		fastcgi_client_connection_close(ccon);
+		return;
+	}
+	up->stats.bytes_written += had_length - ccon->write_queue.length;
+
+	if (ccon->write_queue.length > 0) {
+		ev_io_add_events(up->loop, &ccon->fd_watcher, EV_WRITE);
+	} else {
+		ev_io_rem_events(up->loop, &ccon->fd_watcher, EV_WRITE);
+	}
+
+	if (NULL == up->callbacks->cb_wrote_stdin || had_length == ccon->write_queue.length
+	    || ccon->write_queue.length >= up->write_high_watermark) return;
+
+	/* requests only go away in the read path, the list stays valid */
+	reqs = g_hash_table_get_values(ccon->requests);
+	for (link = reqs; NULL != link; link = link->next) {
+		fastcgi_client_request *creq = link->data;
+		if (!creq->stdin_closed && !creq->aborted) up->callbacks->cb_wrote_stdin(creq);
+	}
+	g_list_free(reqs);
+}
+
+static guint16 fastcgi_client_connection_next_id(fastcgi_client_connection *ccon) {
+	do {
+		ccon->last_id = (G_MAXUINT16 == ccon->last_id) ? 1 : ccon->last_id + 1;
+	} while (NULL != g_hash_table_lookup(ccon->requests, GUINT_TO_POINTER(ccon->last_id)));
+	return ccon->last_id;
+}
+
+/* queue everything the request has so far */
+static void fastcgi_client_request_attach(fastcgi_client_request *creq, fastcgi_client_connection *ccon) {
+	fastcgi_queue *out = &ccon->write_queue;
+	GBytes *bytes;
+
+	creq->ccon = ccon;
+	creq->requestID = fastcgi_client_connection_next_id(ccon);
+	g_hash_table_insert(ccon->requests, GUINT_TO_POINTER(creq->requestID), creq);
+
+	fastcgi_record_encode_begin_request(fastcgi_queue_append_inline(out, 16), creq->requestID, creq->role, FCGI_KEEP_CONN);
+	if (creq->params->len > 0) {
+		stream_send_bytearray(out, FCGI_PARAMS, creq->requestID, creq->params);
+	} else {
+		g_byte_array_free(creq->params, TRUE);
+	}
+	creq->params = NULL;
+	stream_send_fcgi_record(out, FCGI_PARAMS, creq->requestID, 0);
+
+	while (NULL != (bytes = g_queue_pop_head(&creq->pending_stdin))) {
+		stream_send_bytes(out, FCGI_STDIN, creq->requestID, bytes);
+	}
+	creq->pending_stdin_length = 0;
+	if (creq->stdin_closed) stream_send_fcgi_record(out, FCGI_STDIN, creq->requestID, 0);
+
+	fastcgi_client_connection_want_write(ccon);
+}
+
+static void fastcgi_client_connection_fd_cb(struct ev_loop *loop, ev_io *w, int revents);
+
+static fastcgi_client_connection* fastcgi_client_connection_create(fastcgi_upstream *up) {
+	fastcgi_client_connection *ccon = g_slice_new0(fastcgi_client_connection);
+	gint on = 1;
+
+	ccon->up = up;
+	ccon->requests = g_hash_table_new(g_direct_hash, g_direct_equal);
+	ccon->max_requests = 1;
+	ccon->buffer = g_byte_array_sized_new(0);
+	fastcgi_decoder_init(&ccon->decoder);
+	ccon->write_queue.pool = &up->pool;
+
+	ccon->ccon_id = up->connections->len;
+	g_ptr_array_add(up->connections, ccon);
+	up->stats.connects++;
+
+	ccon->connecting = TRUE;
+	ccon->connect_started = ev_time();
+	ccon->fd = socket(up->addr->sa_family, SOCK_STREAM, 0);
+	ev_io_init(&ccon->fd_watcher, fastcgi_client_connection_fd_cb, ccon->fd, EV_READ | EV_WRITE);
+	ccon->fd_watcher.data = ccon;
+
+	if (-1 == ccon->fd) {
+		ccon->connect_error = errno;
+	} else {
+		fd_init(ccon->fd);
+		if (AF_UNIX != up->addr->sa_family) setsockopt(ccon->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		if (-1 == connect(ccon->fd, up->addr, up->addrlen) && EINPROGRESS != errno) {
+			ccon->connect_error = errno;
+		}
+	}
+	if (0 != ccon->connect_error) {
+		ev_feed_event(up->loop, &ccon->fd_watcher, EV_WRITE);
+	} else {
+		ev_io_start(up->loop, &ccon->fd_watcher);
+	}
+
+	if (up->flags & FASTCGI_UPSTREAM_MULTIPLEX) {
+		GByteArray *query = g_byte_array_sized_new(32);
+		g_byte_array_set_size(query, fastcgi_param_encoded_size(sizeof("FCGI_MPXS_CONNS")-1, 0) + fastcgi_param_encoded_size(sizeof("FCGI_MAX_REQS")-1, 0));
+		fastcgi_param_encode(query->data + fastcgi_param_encode(query->data, CONST_STR_LEN("FCGI_MPXS_CONNS"), "", 0),
+			CONST_STR_LEN("FCGI_MAX_REQS"), "", 0);
+		stream_send_bytearray(&ccon->write_queue, FCGI_GET_VALUES, 0, query);
+	}
+
+	return ccon;
+}
+
+static void fastcgi_client_connection_connected(fastcgi_client_connection *ccon) {
+	fastcgi_upstream *up = ccon->up;
+	gint err = ccon->connect_error;
+	socklen_t len = sizeof(err);
+
+	if (0 == err && -1 == getsockopt(ccon->fd, SOL_SOCKET, SO_ERROR, &err, &len)) err = errno;
+	if (0 != err) {
+		up->stats.connect_errors++;
+		fastcgi_client_connection_close(ccon);
+		return;
+	}
+
+	ccon->connecting = FALSE;
+	fastcgi_histogram_add(&up->stats.connect_latency, ev_time() - ccon->connect_started);
+	fastcgi_client_connection_write(ccon);
+}
+
+/* a connection for the next waiting request, NULL if all are busy */
+static fastcgi_client_connection* fastcgi_upstream_get_connection(fastcgi_upstream *up) {
+	guint i;
+
+	if (up->idle.length > 0) {
+		fastcgi_client_connection *ccon = up->idle.head->data;
+		g_queue_unlink(&up->idle, &ccon->idle_link);
+		ccon->idle_link.data = NULL;
+		up->stats.pool_hits++;
+		return ccon;
+	}
+
+	if (up->flags & FASTCGI_UPSTREAM_MULTIPLEX) {
+		for (i = 0; i < up->connections->len; i++) {
+			fastcgi_client_connection *ccon = g_ptr_array_index(up->connections, i);
+			guint active = g_hash_table_size(ccon->requests);
+			if (active > 0 && active < ccon->max_requests) {
+				up->stats.mpx_hits++;
+				return ccon;
+			}
+		}
+	}
+
+	if (up->connections->len < up->max_connections) {
+		up->stats.pool_misses++;
+		return fastcgi_client_connection_create(up);
+	}
+
+	return NULL;
+}
+
+static void fastcgi_upstream_dispatch(fastcgi_upstream *up) {
+	while (up->waiting.length > 0) {
+		fastcgi_client_connection *ccon = fastcgi_upstream_get_connection(up);
+		fastcgi_client_request *creq;
+
+		if (NULL == ccon) return;
+		creq = up->waiting.head->data;
+		g_queue_unlink(&up->waiting, &creq->link);
+		creq->link.data = NULL;
+		fastcgi_client_request_attach(creq, ccon);
+	}
+}
+
+static void fastcgi_client_request_end(fastcgi_client_request *creq, gint32 appStatus, enum FCGI_ProtocolStatus status) {
+	fastcgi_client_connection *ccon = creq->ccon;
+	fastcgi_upstream *up = creq->up;
+
+	g_hash_table_remove(ccon->requests, GUINT_TO_POINTER(creq->requestID));
+	creq->ccon = NULL;
+	up->stats.requests_ended++;
+	fastcgi_histogram_add(&up->stats.request_latency, ev_time() - creq->started);
+	if (FCGI_CANT_MPX_CONN == status) ccon->max_requests = 1;
+
+	up->callbacks->cb_end_request(creq, appStatus, status);
+	fastcgi_client_request_free(creq);
+
+	if (ccon->closing) return;
+	if (0 == g_hash_table_size(ccon->requests)) fastcgi_client_connection_idle(ccon);
+	fastcgi_upstream_dispatch(up);
+}
+
+static void fastcgi_client_connection_get_values_result(fastcgi_client_connection *ccon) {
+	fastcgi_upstream *up = ccon->up;
+	gboolean mpxs = FALSE;
+	guint max_reqs = up->max_connection_requests;
+	fastcgi_param param;
+	guint pos = 0;
+	gssize n;
+
+	while (0 < (n = fastcgi_param_decode(ccon->buffer->data + pos, ccon->buffer->len - pos, &param))) {
+		pos += n;
+		if (key_equal(param.key, param.keylen, CONST_STR_LEN("FCGI_MPXS_CONNS"))) {
+			mpxs = (1 == param.valuelen && '1' == param.value[0]);
+		} else if (key_equal(param.key, param.keylen, CONST_STR_LEN("FCGI_MAX_REQS"))) {
+			gchar str[16];
+			guint64 v;
+			if (param.valuelen >= sizeof(str)) continue;
+			memcpy(str, param.value, param.valuelen);
+			str[param.valuelen] = '\0';
+			v = g_ascii_strtoull(str, NULL, 10);
+			if (v > 0 && v < max_reqs) max_reqs = v;
+		}
+	}
+
+	ccon->max_requests = mpxs ? MAX(max_reqs, 1) : 1;
+	if (ccon->max_requests > 1) fastcgi_upstream_dispatch(up);
+}
+
+/* returns FALSE on protocol errors */
+static gboolean fastcgi_client_connection_content(fastcgi_client_connection *ccon, const guint8 *chunk, gsize chunklen) {
+	fastcgi_upstream *up = ccon->up;
+	const fastcgi_record_header *header = &ccon->decoder.header;
+	fastcgi_client_request *creq = g_hash_table_lookup(ccon->requests, GUINT_TO_POINTER(header->requestID));
+	GByteArray *buf;
+
+	switch (header->type) {
+	case FCGI_STDOUT:
+	case FCGI_STDERR:
+		if (NULL == creq) break; /* after FCGI_END_REQUEST, ignore */
+		buf = receive_chunk(&up->pool, chunk, chunklen);
+		if (FCGI_STDOUT == header->type) {
+			if (!buf) creq->stdout_closed = TRUE;
+			up->callbacks->cb_stdout(creq, buf);
+		} else {
+			if (!buf) creq->stderr_closed = TRUE;
+			up->callbacks->cb_stderr(creq, buf);
+		}
+		break;
+	case FCGI_END_REQUEST:
+		if (8 != header->contentLength) return FALSE;
+		g_byte_array_append(ccon->buffer, chunk, chunklen);
+		if (0 == ccon->decoder.content_remaining && NULL != creq) {
+			const guint8 *data = ccon->buffer->data;
+			gint32 appStatus = (gint32) (((guint32) data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3]);
+			fastcgi_client_request_end(creq, appStatus, data[4]);
+		}
+		break;
+	case FCGI_GET_VALUES_RESULT:
+		if (0 != header->requestID) return FALSE;
+		g_byte_array_append(ccon->buffer, chunk, chunklen);
+		if (0 == ccon->decoder.content_remaining) fastcgi_client_connection_get_values_result(ccon);
+		break;
+	case FCGI_UNKNOWN_TYPE:
+		break; /* we only send well known types */
+	default:
+		return FALSE; /* only the application side gets the other types */
+	}
+	return TRUE;
+}
+
+static void fastcgi_client_connection_parse(fastcgi_client_connection *ccon, const guint8 *input, gsize inputlen) {
+	gsize pos = 0;
+
+	while (!ccon->closing) {
+		const guint8 *chunk = NULL;
+		gsize chunklen = 0, used = 0;
+
+		switch (fastcgi_decoder_next(&ccon->decoder, input + pos, inputlen - pos, &used, &chunk, &chunklen)) {
+		case FASTCGI_DECODER_NEED_MORE:
+			return;
+		case FASTCGI_DECODER_RECORD:
+			pos += used;
+			if (ccon->decoder.header.version != FCGI_VERSION_1) goto error;
+			g_byte_array_set_size(ccon->buffer, 0);
+			if (0 == ccon->decoder.header.contentLength && !fastcgi_client_connection_content(ccon, input + pos, 0)) goto error;
+			break;
+		case FASTCGI_DECODER_CONTENT:
+			pos += used;
+			if (!fastcgi_client_connection_content(ccon, chunk, chunklen)) goto error;
+			break;
+		case FASTCGI_DECODER_RECORD_END:
+			pos += used;
+			break;
+		}
+	}
+	return;
+
+error:
+	fastcgi_client_connection_close(ccon);
+}
+
+static void fastcgi_client_connection_read(fastcgi_client_connection *ccon) {
+	fastcgi_upstream *up = ccon->up;
+	guint i;
+
+	if (!up->read_buffer) up->read_buffer = g_malloc(FASTCGI_DEFAULT_READ_BUFFER_SIZE);
+
+	for (i = 0; i < 16 && !ccon->closing; i++) {
+		gssize r = read(ccon->fd, up->read_buffer, FASTCGI_DEFAULT_READ_BUFFER_SIZE);
+		if (-1 == r) {
+			switch (errno) {
+			case EINTR:
+				continue;
+			case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+			case EWOULDBLOCK:
+#endif
+				return;
+			default:
+				break;
+			}
+		}
+		if (r <= 0) {
+			/* closed by the peer; a keep-alive connection without requests just goes away */
+			fastcgi_client_connection_close(ccon);
+			return;
+		}
+		up->stats.bytes_read += r;
+		fastcgi_client_connection_parse(ccon, up->read_buffer, r);
+		if (r < FASTCGI_DEFAULT_READ_BUFFER_SIZE) return;
+	}
+}
+
+static void fastcgi_client_connection_fd_cb(struct ev_loop *loop, ev_io *w, int revents) {
+	fastcgi_client_connection *ccon = (fastcgi_client_connection*) w->data;
+	UNUSED(loop);
+
+	if (ccon->connecting) {
+		fastcgi_client_connection_connected(ccon);
+		return;
+	}
+	if (revents & EV_READ) fastcgi_client_connection_read(ccon);
+	if ((revents & EV_WRITE) && !ccon->closing) fastcgi_client_connection_write(ccon);
+}
+
+static void fastcgi_upstream_closing_cb(struct ev_loop *loop, ev_prepare *w, int revents) {
+	fastcgi_upstream *up = (fastcgi_upstream*) w->data;
+	GList *link;
+	UNUSED(revents);
+
+	ev_prepare_stop(loop, w);
+	while (NULL != (link = g_queue_pop_head_link(&up->closing))) {
+		fastcgi_client_connection_free(link->data);
+	}
+	/* slots got free */
+	fastcgi_upstream_dispatch(up);
+}
+
+fastcgi_upstream* fastcgi_upstream_create(struct ev_loop *loop, const struct sockaddr *addr, guint addrlen, const fastcgi_upstream_callbacks *callbacks, guint max_connections, guint flags) {
+	fastcgi_upstream *up = g_slice_new0(fastcgi_upstream);
+
+	up->loop = loop;
+	up->callbacks = callbacks;
+	up->addr = g_malloc(addrlen);
+	memcpy(up->addr, addr, addrlen);
+	up->addrlen = addrlen;
+	up->flags = flags;
+
+	up->max_connections = MAX(max_connections, 1);
+	up->max_idle = FASTCGI_UPSTREAM_DEFAULT_MAX_IDLE;
+	up->max_connection_requests = FASTCGI_UPSTREAM_DEFAULT_CONNECTION_REQUESTS;
+	up->write_high_watermark = FASTCGI_DEFAULT_WRITE_HIGH_WATERMARK;
+	up->connections = g_ptr_array_new();
+	fastcgi_pool_init(&up->pool);
+
+	ev_prepare_init(&up->closing_watcher, fastcgi_upstream_closing_cb);
+	up->closing_watcher.data = up;
+
+	return up;
+}
+
+void fastcgi_upstream_free(fastcgi_upstream *up) {
+	GList *link;
+
+	while (NULL != (link = g_queue_pop_head_link(&up->waiting))) {
+		fastcgi_client_request *creq = link->data;
+		link->data = NULL;
+		fastcgi_client_request_fail(creq);
+	}
+	while (up->connections->len > 0) {
+		fastcgi_client_connection_close(g_ptr_array_index(up->connections, up->connections->len - 1));
+	}
+	ev_prepare_stop(up->loop, &up->closing_watcher);
+	while (NULL != (link = g_queue_pop_head_link(&up->closing))) {
+		fastcgi_client_connection_free(link->data);
+	}
+
+	g_ptr_array_free(up->connections, TRUE);
+	fastcgi_pool_clear(&up->pool);
+	g_free(up->read_buffer);
+	g_free(up->addr);
+	g_slice_free(fastcgi_upstream, up);
+}
+
+void fastcgi_upstream_set_max_idle(fastcgi_upstream *up, guint max_idle) {
+	up->max_idle = max_idle;
+	while (up->idle.length > max_idle) {
+		fastcgi_client_connection_close(g_queue_peek_tail(&up->idle));
+	}
+}
+
+void fastcgi_upstream_set_connection_requests(fastcgi_upstream *up, guint max_requests) {
+	up->max_connection_requests = MAX(max_requests, 1);
+}
+
+void fastcgi_upstream_set_write_watermark(fastcgi_upstream *up, gsize high) {
+	g_return_if_fail(high > 0);
+	up->write_high_watermark = high;
+}
+
+void fastcgi_upstream_get_stats(fastcgi_upstream *up, fastcgi_upstream_stats *stats) {
+	*stats = up->stats;
+	stats->connections = up->connections->len;
+	stats->idle_connections = up->idle.length;
+	stats->requests_waiting = up->waiting.length;
+}
+
+void fastcgi_upstream_release_buffer(fastcgi_upstream *up, GByteArray *buf) {
+	fastcgi_pool_put_chunk(&up->pool, buf);
+}
+
+fastcgi_client_request* fastcgi_client_request_new(fastcgi_upstream *up, enum FCGI_Role role, gpointer data) {
+	fastcgi_client_request *creq = g_slice_new0(fastcgi_client_request);
+
+	creq->data = data;
+	creq->up = up;
+	creq->role = role;
+	creq->params = g_byte_array_sized_new(512);
+	up->stats.requests++;
+	return creq;
+}
+
+void fastcgi_client_request_add_param(fastcgi_client_request *creq, const gchar *key, gsize keylen, const gchar *value, gsize valuelen) {
+	guint oldlen;
+
+	g_return_if_fail(!creq->params_done);
+	oldlen = creq->params->len;
+	g_byte_array_set_size(creq->params, oldlen + fastcgi_param_encoded_size(keylen, valuelen));
+	fastcgi_param_encode(creq->params->data + oldlen, key, keylen, value, valuelen);
+}
+
+void fastcgi_client_request_end_params(fastcgi_client_request *creq) {
+	fastcgi_upstream *up = creq->up;
+
+	if (creq->params_done) return;
+	creq->params_done = TRUE;
+	creq->started = ev_time();
+
+	creq->link.data = creq;
+	g_queue_push_tail_link(&up->waiting, &creq->link);
+	fastcgi_upstream_dispatch(up);
+	if (NULL != creq->link.data) up->stats.requests_queued++;
+}
+
+/* kills data or bytes (one of them is set, both NULL: eof) */
+static void fastcgi_client_request_stdin(fastcgi_client_request *creq, GByteArray *data, GBytes *bytes) {
+	if (creq->stdin_closed || creq->aborted) goto drop;
+	if (!creq->params_done) fastcgi_client_request_end_params(creq);
+
+	if (NULL == creq->ccon) {
+		if (data) bytes = g_byte_array_free_to_bytes(data);
+		if (bytes) {
+			creq->pending_stdin_length += g_bytes_get_size(bytes);
+			g_queue_push_tail(&creq->pending_stdin, bytes);
+		} else {
+			creq->stdin_closed = TRUE;
+		}
+		return;
+	}
+
+	if (data) {
+		stream_send_bytearray(&creq->ccon->write_queue, FCGI_STDIN, creq->requestID, data);
+	} else if (bytes) {
+		stream_send_bytes(&creq->ccon->write_queue, FCGI_STDIN, creq->requestID, bytes);
+	} else {
+		stream_send_fcgi_record(&creq->ccon->write_queue, FCGI_STDIN, creq->requestID, 0);
+		creq->stdin_closed = TRUE;
+	}
+	fastcgi_client_connection_want_write(creq->ccon);
+	return;
+
+drop:
+	if (data) g_byte_array_free(data, TRUE);
+	if (bytes) g_bytes_unref(bytes);
+}
+
+void fastcgi_client_request_send_stdin(fastcgi_client_request *creq, GByteArray *data) {
+	if (NULL != data && 0 == data->len) {
+		g_byte_array_free(data, TRUE); /* an empty record would be eof */
+		return;
+	}
+	fastcgi_client_request_stdin(creq, data, NULL);
+}
+
+void fastcgi_client_request_send_stdin_bytes(fastcgi_client_request *creq, GBytes *data) {
+	if (NULL != data && 0 == g_bytes_get_size(data)) {
+		g_bytes_unref(data);
+		return;
+	}
+	fastcgi_client_request_stdin(creq, NULL, data);
+}
+
+gsize fastcgi_client_request_write_space(fastcgi_client_request *creq) {
+	gsize used = creq->ccon ? creq->ccon->write_queue.length : creq->pending_stdin_length;
+	return (used < creq->up->write_high_watermark) ? creq->up->write_high_watermark - used : 0;
+}
+
+void fastcgi_client_request_abort(fastcgi_client_request *creq) {
+	if (NULL == creq->ccon) {
+		if (NULL != creq->link.data) g_queue_unlink(&creq->up->waiting, &creq->link);
+		fastcgi_client_request_free(creq);
+		return;
+	}
+	if (creq->aborted) return;
+	creq->aborted = TRUE;
+	stream_send_fcgi_record(&creq->ccon->write_queue, FCGI_ABORT_REQUEST, creq->requestID, 0);
+	fastcgi_client_connection_want_write(creq->ccon);
+}
+
+/* end: client */
+
+#ifdef HAVE_LIBURING
+static struct io_uring_sqe* fastcgi_uring_get_sqe(fastcgi_server *fsrv) {
+	struct io_uring *ring = &fsrv->uring->ring;
+	struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+	if (NULL == sqe) {
+		/* submission queue full, flush it now */
+		io_uring_submit(ring);
+		sqe = io_uring_get_sqe(ring);
+	}
+	return sqe;
+}
+
+static void fastcgi_uring_submit_op(fastcgi_server *fsrv, struct io_uring_sqe *sqe, fastcgi_uring_op *op) {
+	io_uring_sqe_set_data(sqe, op);
+	op->pending = TRUE;
+	fsrv->uring->pending++;
+}
+
+static void fastcgi_uring_op_done(fastcgi_server *fsrv, fastcgi_uring_op *op) {
+	op->pending = FALSE;
+	fsrv->uring->pending--;
+}
+
+static void fastcgi_uring_cancel(fastcgi_server *fsrv, fastcgi_uring_op *op) {
+	struct io_uring_sqe *sqe = fastcgi_uring_get_sqe(fsrv);
+	if (NULL == sqe) return;
+	io_uring_prep_cancel(sqe, op, 0);
+	io_uring_sqe_set_data(sqe, NULL);
+}
+
+static void fastcgi_uring_accept(fastcgi_server *fsrv) {
+	struct io_uring_sqe *sqe;
+	if (fsrv->uring->accept_op.pending) return;
+	if (NULL == (sqe = fastcgi_uring_get_sqe(fsrv))) return;
+	/* one submission keeps accepting until it gets canceled */
+	io_uring_prep_multishot_accept(sqe, fsrv->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	fastcgi_uring_submit_op(fsrv, sqe, &fsrv->uring->accept_op);
+}
+
+static void fastcgi_uring_cancel_accept(fastcgi_server *fsrv) {
+	if (fsrv->uring->accept_op.pending) fastcgi_uring_cancel(fsrv, &fsrv->uring->accept_op);
+}
+
+static void fastcgi_uring_connection_start(fastcgi_connection *fcon) {
+	fcon->uring = fastcgi_mem_alloc0(fcon->fsrv->pool.allocator, sizeof(struct fastcgi_uring_connection));
+	fcon->uring->recv_op.type = FASTCGI_URING_RECV;
+	fcon->uring->recv_op.ctx = fcon;
+	fcon->uring->send_op.ctx = fcon;
+	fastcgi_uring_recv(fcon);
+}
+
+static void fastcgi_uring_connection_free(fastcgi_connection *fcon) {
+	g_assert(!fastcgi_uring_connection_busy(fcon));
+	fastcgi_mem_free(fcon->fsrv->pool.allocator, fcon->uring, sizeof(struct fastcgi_uring_connection));
+	fcon->uring = NULL;
+}
+
+static gboolean fastcgi_uring_connection_busy(fastcgi_connection *fcon) {
+	return fcon->uring->recv_op.pending || fcon->uring->send_op.pending;
+}
+
+static void fastcgi_uring_recv(fastcgi_connection *fcon) {
+	fastcgi_server *fsrv = fcon->fsrv;
+	struct io_uring_sqe *sqe;
+
+	if (fcon->uring->recv_op.pending || fcon->closing || fcon->read_suspended) return;
+	if (NULL == (sqe = fastcgi_uring_get_sqe(fsrv))) return;
+
+	/* the kernel picks a buffer from the ring when data arrives */
+	io_uring_prep_recv(sqe, fcon->fd, NULL, FASTCGI_URING_BUFFER_SIZE, 0);
+	io_uring_sqe_set_flags(sqe, IOSQE_BUFFER_SELECT);
+	sqe->buf_group = FASTCGI_URING_BGID;
+	fastcgi_uring_submit_op(fsrv, sqe, &fcon->uring->recv_op);
+}
+
+static void fastcgi_uring_send(fastcgi_connection *fcon) {
+	fastcgi_server *fsrv = fcon->fsrv;
+	struct fastcgi_uring_connection *ucon = fcon->uring;
+	struct io_uring_sqe *sqe;
+	gsize len;
+	guint niov;
+
+	if (ucon->send_op.pending || fcon->closing || 0 == fcon->write_queue.length) return;
+	if (NULL == (sqe = fastcgi_uring_get_sqe(fsrv))) return;
+
+	/* the queue must not change in front until the send completed */
+	niov = fastcgi_queue_fill_iovec(&fcon->write_queue, ucon->iov, FASTCGI_URING_IOV_MAX, 256*1024, &len);
+	if (0 == niov) {
+		/* file chunk: wait until the socket is writable, then sendfile() */
+		io_uring_prep_poll_add(sqe, fcon->fd, POLLOUT);
+		ucon->send_op.type = FASTCGI_URING_POLLOUT;
+	} else {
+		memset(&ucon->msg, 0, sizeof(ucon->msg));
+		ucon->msg.msg_iov = ucon->iov;
+		ucon->msg.msg_iovlen = niov;
+		io_uring_prep_sendmsg(sqe, fcon->fd, &ucon->msg, MSG_NOSIGNAL);
+		ucon->send_op.type = FASTCGI_URING_SEND;
+	}
+	fastcgi_uring_submit_op(fsrv, sqe, &ucon->send_op);
+}
+
+/* a closing connection can be freed once the kernel is done with it */
+static void fastcgi_uring_connection_check_closed(fastcgi_connection *fcon) {
+	if (fcon->closing && !fastcgi_uring_connection_busy(fcon)) {
+		ev_prepare_start(fcon->fsrv->loop, &fcon->fsrv->closing_watcher);
+	}
+}
+
+static void fastcgi_uring_complete_accept(fastcgi_server *fsrv, gint res, guint flags) {
+	fastcgi_uring_op *op = &fsrv->uring->accept_op;
+
+	if (!(flags & IORING_CQE_F_MORE)) fastcgi_uring_op_done(fsrv, op);
+
+	if (res >= 0) {
+		if (fsrv->do_shutdown) {
+			close(res);
+		} else {
+			fsrv->stats.connections_accepted++;
+			fastcgi_server_new_connection(fsrv, res);
+		}
+	} else switch (-res) {
+	case ECANCELED:
+	case EINTR:
+	case EAGAIN:
+	case ECONNABORTED:
+		break;
+	case EMFILE:
+	case ENFILE:
+		fastcgi_server_out_of_fds(fsrv);
+		return;
+	default:
+		if (fsrv->do_shutdown) return;
+		ERROR("accept failed on fd=%d with error: %s\nshutting down\n", fsrv->fd, g_strerror(-res));
+		fastcgi_server_stop(fsrv);
+		return;
+	}
+
+	/* multishot accept ends on errors or if the kernel is out of completion slots */
+	if (!op->pending) fastcgi_server_resume_accept(fsrv);
+}
+
+static void fastcgi_uring_complete_recv(fastcgi_connection *fcon, gint res, guint flags) {
+	fastcgi_server *fsrv = fcon->fsrv;
+	struct fastcgi_uring *uring = fsrv->uring;
+
+	fastcgi_uring_op_done(fsrv, &fcon->uring->recv_op);
+	fsrv->stats.read_syscalls++;
+
+	if (flags & IORING_CQE_F_BUFFER) {
+		guint bid = flags >> IORING_CQE_BUFFER_SHIFT;
+		guint8 *buf = uring->buffers + bid * FASTCGI_URING_BUFFER_SIZE;
+
+		if (res > 0 && !fcon->closing) {
+			fsrv->stats.bytes_read += res;
+			read_input(fcon, buf, res);
+		}
+
+		/* give the buffer back to the kernel */
+		io_uring_buf_ring_add(uring->buf_ring, buf, FASTCGI_URING_BUFFER_SIZE, bid, io_uring_buf_ring_mask(FASTCGI_URING_BUFFERS), 0);
+		io_uring_buf_ring_advance(uring->buf_ring, 1);
+	}
+
+	if (fcon->closing) {
+		fastcgi_uring_connection_check_closed(fcon);
+		return;
+	}
+
+	if (res > 0 || -ENOBUFS == res) {
+		/* ENOBUFS: all buffers were in use, they are back now */
+		if (NULL == fcon->readbuf) fastcgi_uring_recv(fcon);
+		return;
+	}
+
+	if (0 != res && -ECONNRESET != res) {
+		ERROR("recv from fd=%d failed, %s\n", fcon->fd, g_strerror(-res));
+	}
+	fastcgi_connection_abort_requests(fcon);
+	fastcgi_connection_close(fcon);
+}
+
+static void fastcgi_uring_complete_send(fastcgi_connection *fcon, fastcgi_uring_op *op, gint res) {
+	fastcgi_server *fsrv = fcon->fsrv;
+
+	fastcgi_uring_op_done(fsrv, op);
+
+	if (fcon->closing) {
+		fastcgi_uring_connection_check_closed(fcon);
+		return;
+	}
+
+	if (FASTCGI_URING_POLLOUT == op->type) {
+		gsize had_length = fcon->write_queue.length;
+		if (res >= 0) res = fastcgi_queue_writev(fcon->fd, &fcon->write_queue, 256*1024, &fsrv->stats);
+		if (res < 0) {
+			fastcgi_connection_close(fcon);
+			return;
+		}
+		fsrv->stats.bytes_written += had_length - fcon->write_queue.length;
+		if (had_length != fcon->write_queue.length) fcon->last_activity = ev_now(fsrv->loop);
+	} else {
+		fsrv->stats.write_syscalls++;
+		if (res < 0) {
+			if (-EPIPE != res && -ECONNRESET != res) {
+				ERROR("sendmsg to fd=%d failed, %s\n", fcon->fd, g_strerror(-res));
+			}
+			fastcgi_connection_close(fcon);
+			return;
+		}
+		fastcgi_queue_skip(&fcon->write_queue, res);
+		fsrv->stats.bytes_written += res;
+		fcon->last_activity = ev_now(fsrv->loop);
+	}
+
+	if (fcon->write_queue.length < fsrv->write_low_watermark) fastcgi_connection_produce(fcon);
+
+	if (fsrv->callbacks->cb_wrote_data) {
+		fsrv->callbacks->cb_wrote_data(fcon);
+	}
+
+	if (!fcon->closing) {
+		if (fcon->write_queue.length > 0) {
+			fastcgi_uring_send(fcon);
+		} else {
+			fastcgi_connection_check_idle(fcon);
+		}
+	}
+}
+
+static void fastcgi_uring_complete(fastcgi_server *fsrv, fastcgi_uring_op *op, gint res, guint flags) {
+	switch (op->type) {
+	case FASTCGI_URING_ACCEPT:
+		fastcgi_uring_complete_accept(fsrv, res, flags);
+		break;
+	case FASTCGI_URING_RECV:
+		fastcgi_uring_complete_recv(op->ctx, res, flags);
+		break;
+	case FASTCGI_URING_SEND:
+	case FASTCGI_URING_POLLOUT:
+		fastcgi_uring_complete_send(op->ctx, op, res);
+		break;
+	}
+}
+
+/* don't keep the loop alive after fastcgi_server_stop() */
+static void fastcgi_uring_check_idle(fastcgi_server *fsrv) {
+	if (fsrv->do_shutdown && 0 == fsrv->uring->pending) ev_io_stop(fsrv->loop, &fsrv->uring->ring_watcher);
+}
+
+static void fastcgi_uring_ring_cb(struct ev_loop *loop, ev_io *w, int revents) {
+	fastcgi_server *fsrv = (fastcgi_server*) w->data;
+	struct io_uring *ring = &fsrv->uring->ring;
+	struct io_uring_cqe *cqe;
+	UNUSED(loop);
+	UNUSED(revents);
+
+	while (0 == io_uring_peek_cqe(ring, &cqe)) {
+		fastcgi_uring_op *op = io_uring_cqe_get_data(cqe);
+		gint res = cqe->res;
+		guint flags = cqe->flags;
+
+		/* handlers submit new operations, free the slot first */
+		io_uring_cqe_seen(ring, cqe);
+		if (NULL != op) fastcgi_uring_complete(fsrv, op, res, flags); /* NULL: cancel requests */
+	}
+
+	fastcgi_uring_check_idle(fsrv);
+}
+
+static void fastcgi_uring_submit_cb(struct ev_loop *loop, ev_prepare *w, int revents) {
+	fastcgi_server *fsrv = (fastcgi_server*) w->data;
+	UNUSED(loop);
+	UNUSED(revents);
+
+	if (io_uring_sq_ready(&fsrv->uring->ring) > 0) io_uring_submit(&fsrv->uring->ring);
+}
+
+static gboolean fastcgi_uring_init(fastcgi_server *fsrv) {
+	struct fastcgi_uring *uring = g_slice_new0(struct fastcgi_uring);
+	gint res;
+	guint i;
+
+	if ((res = io_uring_queue_init(FASTCGI_URING_ENTRIES, &uring->ring, 0)) < 0) {
+		ERROR("io_uring_queue_init failed: %s\n", g_strerror(-res));
+		g_slice_free(struct fastcgi_uring, uring);
+		return FALSE;
+	}
+	uring->buf_ring = io_uring_setup_buf_ring(&uring->ring, FASTCGI_URING_BUFFERS, FASTCGI_URING_BGID, 0, &res);
+	if (NULL == uring->buf_ring) {
+		ERROR("io_uring_setup_buf_ring failed: %s\n", g_strerror(-res));
+		io_uring_queue_exit(&uring->ring);
+		g_slice_free(struct fastcgi_uring, uring);
+		return FALSE;
+	}
+	uring->buffers = g_malloc(FASTCGI_URING_BUFFERS * FASTCGI_URING_BUFFER_SIZE);
+	for (i = 0; i < FASTCGI_URING_BUFFERS; i++) {
+		io_uring_buf_ring_add(uring->buf_ring, uring->buffers + i * FASTCGI_URING_BUFFER_SIZE, FASTCGI_URING_BUFFER_SIZE, i, io_uring_buf_ring_mask(FASTCGI_URING_BUFFERS), i);
+	}
+	io_uring_buf_ring_advance(uring->buf_ring, FASTCGI_URING_BUFFERS);
+
+	uring->accept_op.type = FASTCGI_URING_ACCEPT;
+	uring->accept_op.ctx = fsrv;
+
+	ev_io_init(&uring->ring_watcher, fastcgi_uring_ring_cb, uring->ring.ring_fd, EV_READ);
+	uring->ring_watcher.data = fsrv;
+	ev_io_start(fsrv->loop, &uring->ring_watcher);
+
+	ev_prepare_init(&uring->submit_watcher, fastcgi_uring_submit_cb);
+	uring->submit_watcher.data = fsrv;
+	ev_prepare_start(fsrv->loop, &uring->submit_watcher);
+	ev_unref(fsrv->loop); /* the submit watcher alone shouldn't keep the loop alive */
+
+	fsrv->uring = uring;
+	return TRUE;
+}
+
+/* waits for all pending operations, then switches back to libev */
+static void fastcgi_uring_free(fastcgi_server *fsrv) {
+	struct fastcgi_uring *uring = fsrv->uring;
+	guint i;
+
+	for (i = 0; i < fsrv->connections->len; i++) {
+		fastcgi_connection *fcon = g_ptr_array_index(fsrv->connections, i);
+		if (-1 != fcon->fd && fastcgi_uring_connection_busy(fcon)) shutdown(fcon->fd, SHUT_RDWR);
+	}
+	fastcgi_uring_cancel_accept(fsrv);
+	io_uring_submit(&uring->ring);
+
+	while (uring->pending > 0) {
+		struct io_uring_cqe *cqe = NULL;
+		fastcgi_uring_op *op;
+		gint res;
+		guint flags;
+
+		if (io_uring_wait_cqe(&uring->ring, &cqe) < 0 || NULL == cqe) break;
+		op = io_uring_cqe_get_data(cqe);
+		res = cqe->res;
+		flags = cqe->flags;
+		io_uring_cqe_seen(&uring->ring, cqe);
+		if (NULL != op) fastcgi_uring_complete(fsrv, op, res, flags);
+		io_uring_submit(&uring->ring);
+	}
+
+	ev_io_stop(fsrv->loop, &uring->ring_watcher);
+	ev_ref(fsrv->loop);
+	ev_prepare_stop(fsrv->loop, &uring->submit_watcher);
+
+	io_uring_free_buf_ring(&uring->ring, uring->buf_ring, FASTCGI_URING_BUFFERS, FASTCGI_URING_BGID);
+	io_uring_queue_exit(&uring->ring);
+	g_free(uring->buffers);
+	g_slice_free(struct fastcgi_uring, uring);
+	fsrv->uring = NULL;
+}
+#endif
+
+gboolean fastcgi_server_set_backend(fastcgi_server *fsrv, enum fastcgi_backend backend) {
+#ifndef HAVE_LIBURING
+	UNUSED(fsrv);
+#endif
+	switch (backend) {
+	case FASTCGI_BACKEND_LIBEV:
+#ifdef HAVE_LIBURING
+		if (fsrv->uring) {
+			if (fsrv->connections->len > 0) return FALSE;
+			fastcgi_uring_free(fsrv);
+			if (!fsrv->do_shutdown) ev_io_start(fsrv->loop, &fsrv->fd_watcher);
+		}
+#endif
+		return TRUE;
+	case FASTCGI_BACKEND_URING:
+#ifdef HAVE_LIBURING
+		if (fsrv->uring) return TRUE;
+		if (fsrv->do_shutdown || fsrv->connections->len > 0) return FALSE;
+		if (!fastcgi_uring_init(fsrv)) return FALSE;
+		ev_io_stop(fsrv->loop, &fsrv->fd_watcher);
+		fastcgi_server_resume_accept(fsrv);
+		return TRUE;
+#else
+		return FALSE;
+#endif
+	}
+	return FALSE;
 }
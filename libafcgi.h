@@ -3,7 +3,7 @@
 
 #include "libafcgi-config.h"
 
-/* NO multiplexing support */
+/* multiplexing is supported with the request based callbacks (cb_req_*) and functions (fastcgi_request_*) */
 
 #include <glib.h>
 #include <ev.h>
@@ -44,6 +44,29 @@
 		FCGI_UNKNOWN_ROLE     = 3
 	};
 
+/* well known CGI variables, recognized while parsing the params */
+enum fastcgi_env_var {
+	FASTCGI_ENV_REQUEST_METHOD,
+	FASTCGI_ENV_REQUEST_URI,
+	FASTCGI_ENV_SCRIPT_NAME,
+	FASTCGI_ENV_SCRIPT_FILENAME,
+	FASTCGI_ENV_PATH_INFO,
+	FASTCGI_ENV_QUERY_STRING,
+	FASTCGI_ENV_DOCUMENT_ROOT,
+	FASTCGI_ENV_CONTENT_LENGTH,
+	FASTCGI_ENV_CONTENT_TYPE,
+	FASTCGI_ENV_REMOTE_ADDR,
+	FASTCGI_ENV_REMOTE_PORT,
+	FASTCGI_ENV_SERVER_NAME,
+	FASTCGI_ENV_SERVER_PORT,
+	FASTCGI_ENV_SERVER_PROTOCOL,
+	FASTCGI_ENV_HTTPS,
+	FASTCGI_ENV_HTTP_HOST,
+	FASTCGI_ENV_HTTP_COOKIE,
+	FASTCGI_ENV_HTTP_USER_AGENT,
+	FASTCGI_ENV_COUNT
+};
+
 #define FASTCGI_MAX_KEYLEN 1024
 #define FASTCGI_MAX_VALUELEN 64*1024
 /* end FastCGI constants */
@@ -57,9 +80,161 @@ typedef struct fastcgi_callbacks fastcgi_callbacks;
 struct fastcgi_connection;
 typedef struct fastcgi_connection fastcgi_connection;
 
+struct fastcgi_request;
+typedef struct fastcgi_request fastcgi_request;
+
+struct fastcgi_arena;
+typedef struct fastcgi_arena fastcgi_arena;
+
+struct fastcgi_environ;
+typedef struct fastcgi_environ fastcgi_environ;
+
+struct fastcgi_environ_entry;
+typedef struct fastcgi_environ_entry fastcgi_environ_entry;
+
+struct fastcgi_environ_iter;
+typedef struct fastcgi_environ_iter fastcgi_environ_iter;
+
 struct fastcgi_queue;
 typedef struct fastcgi_queue fastcgi_queue;
 
+struct fastcgi_record_header;
+typedef struct fastcgi_record_header fastcgi_record_header;
+
+struct fastcgi_decoder;
+typedef struct fastcgi_decoder fastcgi_decoder;
+
+struct fastcgi_param;
+typedef struct fastcgi_param fastcgi_param;
+
+struct fastcgi_pool;
+typedef struct fastcgi_pool fastcgi_pool;
+
+struct fastcgi_allocator;
+typedef struct fastcgi_allocator fastcgi_allocator;
+
+struct fastcgi_histogram;
+typedef struct fastcgi_histogram fastcgi_histogram;
+
+struct fastcgi_server_stats;
+typedef struct fastcgi_server_stats fastcgi_server_stats;
+
+struct fastcgi_memory;
+typedef struct fastcgi_memory fastcgi_memory;
+
+struct fastcgi_threaded_server;
+typedef struct fastcgi_threaded_server fastcgi_threaded_server;
+
+struct fastcgi_upstream;
+typedef struct fastcgi_upstream fastcgi_upstream;
+
+struct fastcgi_upstream_callbacks;
+typedef struct fastcgi_upstream_callbacks fastcgi_upstream_callbacks;
+
+struct fastcgi_upstream_stats;
+typedef struct fastcgi_upstream_stats fastcgi_upstream_stats;
+
+struct fastcgi_client_request;
+typedef struct fastcgi_client_request fastcgi_client_request;
+
+struct sockaddr;
+
+/* pull based stdout, see fastcgi_set_producer: write up to len bytes to buf and return how many.
+ * 0: nothing ready right now, call fastcgi_producer_wakeup later; -1: done, the producer is removed */
+typedef gssize (*fastcgi_producer_cb)(fastcgi_connection *fcon, gpointer ctx, guint8 *buf, gsize len);
+typedef gssize (*fastcgi_request_producer_cb)(fastcgi_request *req, gpointer ctx, guint8 *buf, gsize len);
+
+/* replaces g_slice for connections, requests, write queue links, file chunks, the timer wheel and arena chunks
+ * (not for glib containers) */
+struct fastcgi_allocator {
+	gpointer (*alloc)(gsize size, gpointer ctx); /* must not fail */
+	void (*free)(gpointer mem, gsize size, gpointer ctx); /* size as passed to alloc */
+	gpointer ctx;
+};
+
+/* free lists for write queue links and receive buffers (4k and 64k size classes) */
+struct fastcgi_pool {
+/* private data */
+	const fastcgi_allocator *allocator; /* NULL: g_slice */
+	GList *links; /* unused queue links, chained through next */
+	guint links_count;
+	GPtrArray *blocks; /* unused 64k GByteArray buffers */
+	GPtrArray *small_blocks; /* unused 4k GByteArray buffers */
+
+/* statistics (read only) */
+	guint64 link_hits, link_misses;
+	guint64 block_hits, block_misses;
+	gsize resident; /* bytes kept in the free lists */
+};
+
+#define FASTCGI_HISTOGRAM_BUCKETS 32
+
+/* latencies in log2 buckets: bucket 0 counts values below 1us, bucket i values in [2^(i-1), 2^i) us;
+ * the last one also counts everything above */
+struct fastcgi_histogram {
+	guint64 count;
+	guint64 sum_usec;
+	guint64 buckets[FASTCGI_HISTOGRAM_BUCKETS];
+};
+
+/* counters are updated without locks by the thread running the server; only guint64 members,
+ * fastcgi_threaded_server_get_stats adds them up as an array */
+struct fastcgi_server_stats {
+	guint64 read_syscalls; /* read() calls on connections */
+	guint64 read_eagain; /* read() found nothing */
+	guint64 bytes_read;
+	guint64 write_syscalls; /* writev() calls on connections */
+	guint64 write_eagain; /* writev() found the socket buffer full */
+	guint64 bytes_written;
+	guint64 records_received[FCGI_MAXTYPE + 1], records_sent[FCGI_MAXTYPE + 1]; /* by type; unknown types in [0] */
+	guint64 requests_accepted;
+	guint64 requests_ended; /* fastcgi_request_end() while the connection was alive */
+	guint64 requests_aborted; /* cb_request_aborted/cb_req_aborted */
+	guint64 requests_overloaded; /* rejected with FCGI_OVERLOADED */
+	guint64 connections_accepted; /* from the listener; adopted connections are counted separately */
+	guint64 connections_closed;
+	guint64 connections_aborted; /* closed with active requests */
+	guint64 accept_budget_exhausted; /* accept loop stopped by the budget */
+	guint64 accept_emfile; /* accept() failed with EMFILE/ENFILE */
+	guint64 connections_shed; /* accepted with the reserve fd and closed right away */
+	guint64 connection_limit_restored;
+	guint64 memory_pressure; /* memory usage went above the soft or hard limit */
+	guint64 connections_memory_suspended; /* reading suspended because of the memory limit */
+	guint64 input_suspended; /* reading suspended because of unconsumed stdin/data */
+	guint64 timeouts_idle, timeouts_read, timeouts_request; /* connections closed by fastcgi_server_set_timeouts */
+	guint64 connections_handed_off; /* idle connections passed to the new process while draining */
+	guint64 connections_adopted; /* idle connections received from the old process */
+	guint64 connections_adopt_refused; /* received from the old process and closed because of the connection limit */
+	guint64 connections_drain_expired; /* closed when the drain deadline passed */
+	guint64 sends_coalesced; /* small sends copied into an open record instead of starting a new one */
+	guint64 flushes_deferred; /* connections flushed at the end of a loop iteration (output coalescing) */
+
+	fastcgi_histogram request_latency; /* FCGI_BEGIN_REQUEST received to FCGI_END_REQUEST queued */
+	fastcgi_histogram first_stdout_latency; /* FCGI_BEGIN_REQUEST received to the first FCGI_STDOUT queued */
+
+	/* current values, only set in snapshots (fastcgi_server_get_stats) */
+	guint64 connections, requests;
+	guint64 write_queue_bytes;
+};
+
+enum fastcgi_memory_level {
+	FASTCGI_MEMORY_NORMAL,
+	FASTCGI_MEMORY_SOFT, /* above the soft limit: reading is suspended on the connections with the largest write queues */
+	FASTCGI_MEMORY_HARD /* above the hard limit: new requests are rejected with FCGI_OVERLOADED */
+};
+
+/* memory held by a server; used = write_queues + params + readbufs + input + free_requests + pool.resident */
+struct fastcgi_memory {
+/* read only */
+	gsize write_queues; /* output waiting in the write queues (file chunks don't count) */
+	gsize params; /* param buffers and environ of the active requests */
+	gsize readbufs; /* input read but not parsed yet (largest length of each buffer) */
+	gsize input; /* receive buffers of stdin/data given to the callbacks and not consumed yet (allocated size) */
+	gsize free_requests; /* request objects kept for reuse, with their arenas and param buffers */
+	gsize soft_limit, hard_limit; /* 0: unlimited */
+	enum fastcgi_memory_level level; /* as of the last loop iteration */
+};
+
 struct fastcgi_server {
 /* custom user data */
 	gpointer data;
@@ -70,13 +245,79 @@ struct fastcgi_server {
 	const fastcgi_callbacks *callbacks;
 
 	guint max_connections;
+	guint connection_limit; /* max_connections, lowered while we run out of fds */
+	guint accept_budget; /* max accept() calls per loop iteration, 0: unlimited */
+	gsize write_low_watermark, write_high_watermark; /* producers refill the write queue from low up to high */
+	gsize input_low_watermark, input_high_watermark; /* unconsumed stdin/data buffers per connection (allocated size), 0: no backpressure */
+	ev_tstamp idle_timeout, read_timeout, request_timeout; /* seconds, 0: off */
+	struct fastcgi_timer_wheel *wheel; /* NULL while all timeouts are off */
+	gint reserve_fd; /* spare fd to shed connections on EMFILE */
+	ev_timer emfile_timer; /* restores connection_limit if no connection gets closed before */
 	GPtrArray *connections;
+	GPtrArray *free_requests; /* request objects for reuse */
+	GPtrArray *free_connections; /* reset connection objects for reuse */
+	guint max_free_connections;
+	GQueue closing; /* connections to free, linked through fcon->closing_link */
 	guint cur_requests;
+	guint max_requests, max_connection_requests; /* 0: unlimited */
 
 	gint fd;
 	struct ev_loop *loop;
 	ev_io fd_watcher;
 	ev_prepare closing_watcher;
+
+	/* input buffer shared by all connections */
+	guint8 *read_buffer;
+	gsize read_buffer_size;
+
+	/* recycled write queue links and stdin/data buffers */
+	fastcgi_pool pool;
+
+	struct fastcgi_uring *uring; /* NULL: libev backend */
+
+	ev_prepare memory_watcher; /* checks the limits once per loop iteration */
+
+	/* zero-downtime restart, see fastcgi_server_drain */
+	gboolean draining;
+	gint handoff_fd; /* draining: idle connections are sent here, -1: closed instead */
+	ev_timer drain_timer; /* drain deadline */
+	ev_io adopt_watcher; /* receives connections from the old process */
+
+	/* output coalescing, see fastcgi_server_set_output_coalescing */
+	gsize coalesce_max_copy; /* 0: off */
+	GQueue flushing; /* connections with unwritten output, linked through fcon->flush_link */
+	ev_prepare flush_watcher; /* writes them once per loop iteration */
+
+/* statistics (read only) */
+	fastcgi_server_stats stats;
+	fastcgi_memory memory;
+};
+
+enum fastcgi_backend {
+	FASTCGI_BACKEND_LIBEV, /* readiness via ev_io + read()/writev() */
+	FASTCGI_BACKEND_URING /* completions via io_uring (linux, --with-liburing) */
+};
+
+enum fastcgi_threaded_flags {
+	/* own SO_REUSEPORT listening socket per worker (tcp only; the kernel hashes connections over them), else the
+	 * workers share dup()s of the socket: every worker is woken for a connection and whoever accepts first gets
+	 * it, there is no balancing between them */
+	FASTCGI_THREADED_REUSEPORT = 0x1,
+	FASTCGI_THREADED_PIN_CPUS = 0x2 /* pin worker i to cpu i % cpus */
+};
+
+/* N workers, each with its own ev_loop and fastcgi_server; the callbacks run in the worker threads */
+struct fastcgi_threaded_server {
+/* custom user data */
+	gpointer data;
+
+/* read only */
+	guint workers_count;
+	fastcgi_server **workers; /* configure them (data, limits) before fastcgi_threaded_server_start */
+
+/* private data */
+	struct fastcgi_thread_worker *threads;
+	gboolean started;
 };
 
 struct fastcgi_callbacks {
@@ -87,6 +328,20 @@ struct fastcgi_callbacks {
 	void (*cb_received_data)(fastcgi_connection *fcon, GByteArray *data); /* data == NULL => eof */
 	void (*cb_request_aborted)(fastcgi_connection *fcon);
 	void (*cb_reset_connection)(fastcgi_connection *fcon); /* cleanup custom data before fcon is freed, not for keep-alive */
+
+	/* request based callbacks: if cb_req_new is set, multiple requests per connection are accepted
+	 * and cb_new_request, cb_received_stdin, cb_received_data and cb_request_aborted are not used */
+	void (*cb_req_new)(fastcgi_request *req); /* new request, env/params are ready */
+	void (*cb_req_received_stdin)(fastcgi_request *req, GByteArray *data); /* data == NULL => eof */
+	void (*cb_req_received_data)(fastcgi_request *req, GByteArray *data); /* data == NULL => eof */
+	void (*cb_req_aborted)(fastcgi_request *req); /* you still have to call fastcgi_request_end */
+	void (*cb_req_reset)(fastcgi_request *req); /* cleanup custom data before req is freed (fastcgi_request_end or connection closed) */
+
+	/* memory usage moved to another level (see fastcgi_server_set_memory_limits); stop producing output above FASTCGI_MEMORY_NORMAL */
+	void (*cb_memory_pressure)(fastcgi_server *fsrv, enum fastcgi_memory_level level);
+
+	/* fastcgi_server_drain is done: all connections are finished, handed off or closed */
+	void (*cb_drained)(fastcgi_server *fsrv);
 };
 
 struct fastcgi_queue {
@@ -94,74 +349,428 @@ struct fastcgi_queue {
 	gsize offset; /* offset in first chunk */
 	gsize length;
 	gboolean closed;
+	fastcgi_pool *pool; /* may be NULL */
+	gsize memory; /* bytes of length held in memory (not in files) */
+	gsize *memory_total; /* server wide counter for memory, may be NULL */
+	guint64 *records; /* server wide counters per record type (fastcgi_server_stats.records_sent), may be NULL */
+	/* output coalescing: the last record while small sends still get appended to it (nothing of it written yet) */
+	guint8 *open_header; /* inline header of the record, NULL if none is open */
+	GByteArray *open_record; /* content and padding */
 };
 
-struct fastcgi_connection {
+struct fastcgi_arena {
+/* private data */
+	const fastcgi_allocator *allocator; /* NULL: g_slice */
+	struct fastcgi_arena_chunk *chunks;
+	gsize size; /* allocated bytes */
+};
+
+struct fastcgi_environ_entry {
+	const gchar *key, *value; /* '\0' terminated */
+	gsize keylen, valuelen;
+	guint32 hash;
+};
+
+/* key/value pairs in the order they were received; duplicate keys replace the earlier value */
+struct fastcgi_environ {
+	fastcgi_environ_entry *entries;
+	guint count;
+/* private data */
+	guint size;
+	guint *index; /* 2 * size slots: entry index + 1, 0: empty */
+	guint known[FASTCGI_ENV_COUNT]; /* entry index + 1 of well known variables, 0: not set */
+};
+
+struct fastcgi_environ_iter {
+/* private data */
+	const fastcgi_environ *env;
+	guint pos;
+};
+
+struct fastcgi_record_header {
+	guint8 version;
+	guint8 type;
+	guint16 requestID;
+	guint16 contentLength;
+	guint8 paddingLength;
+};
+
+enum fastcgi_decoder_event {
+	FASTCGI_DECODER_NEED_MORE, /* all input used */
+	FASTCGI_DECODER_RECORD, /* dec->header is the header of a new record */
+	FASTCGI_DECODER_CONTENT, /* a (non empty) part of the content; the last one if dec->content_remaining == 0 */
+	FASTCGI_DECODER_RECORD_END /* content and padding of the record are complete */
+};
+
+/* incremental record decoder, works on memory only (see fastcgi_decoder_next) */
+struct fastcgi_decoder {
+/* read only */
+	fastcgi_record_header header; /* current record */
+	guint content_remaining, padding_remaining;
+
+/* private data */
+	guint8 headerbuf[FCGI_HEADER_LEN];
+	guint headerbuf_used; /* > 0: within a record */
+	gboolean skip; /* see fastcgi_decoder_skip_record */
+};
+
+/* a name-value pair, pointing into the decoded buffer (not '\0' terminated) */
+struct fastcgi_param {
+	const gchar *key, *value;
+	gsize keylen, valuelen;
+};
+
+struct fastcgi_request {
 /* custom user data */
 	gpointer data;
 
-/* read/write */
-	GHashTable *environ; /* GString -> GString */
+/* read only */
+	fastcgi_environ environ; /* valid until the request is freed */
+	fastcgi_connection *fcon;
+	guint16 requestID;
+	guint16 role;
+	guint8 flags;
+	gboolean aborted; /* received FCGI_ABORT_REQUEST or the connection died */
+	gboolean stdin_closed, data_closed; /* received eof */
+
+/* private data */
+	fastcgi_arena arena; /* environ and fastcgi_request_alloc memory, reset when the request is freed */
+	GByteArray *parambuf;
+	gboolean params_done;
+	gsize memory; /* counted in fsrv->memory.params, or memory.free_requests while in the free list */
+
+	/* either one is set while the request has a producer */
+	fastcgi_producer_cb producer;
+	fastcgi_request_producer_cb req_producer;
+	gpointer producer_ctx;
+	gboolean producer_waiting; /* returned 0, waits for fastcgi_request_producer_wakeup */
+	gboolean end_pending; /* fastcgi_request_end was called from the producer, done after it returned */
+	gint32 end_app_status;
+	enum FCGI_ProtocolStatus end_status;
+
+	gsize input_pending; /* stdin/data given to the callbacks and not consumed yet */
+	gsize input_memory; /* allocated size of the buffers holding input_pending */
+	ev_tstamp started; /* FCGI_BEGIN_REQUEST received */
+	ev_tstamp received; /* same as ev_time(), for the latency histograms */
+	gboolean stdout_sent; /* first_stdout_latency counted */
+};
+
+struct fastcgi_connection {
+/* custom user data */
+	gpointer data;
 
 /* read only */
+	fastcgi_environ *environ; /* current request only (NULL if none) */
 	fastcgi_server *fsrv;
 	guint fcon_id; /* index in server con array */
 	gboolean closing; /* "dead" connection */
+	GList closing_link; /* data: fcon while in fsrv->closing */
 
-	/* current request */
+	/* current request (without multiplexing) */
+	fastcgi_request *request;
 	guint16 requestID;
 	guint16 role;
-	guint8 flags;
+	guint8 flags; /* flags of the last request */
 
 /* private data */
-	unsigned char headerbuf[8];
-	guint headerbuf_used;
-	gboolean first;
-
-	struct {
-		guint8 version;
-		guint8 type;
-		guint16 requestID;
-		guint16 contentLength;
-		guint8 paddingLength;
-	} current_header;
+	GHashTable *requests; /* requestID -> fastcgi_request */
 
-	guint content_remaining, padding_remaining;
+	fastcgi_decoder decoder;
 
-	GByteArray *buffer, *parambuf;
+	GByteArray *buffer;
+	GByteArray *readbuf; /* unparsed input while reading is suspended, NULL if empty */
+	gsize readbuf_memory; /* counted in fsrv->memory.readbufs */
 
 	gint fd;
 	ev_io fd_watcher;
+	struct fastcgi_uring_connection *uring; /* pending io_uring operations, NULL with libev */
 
-	gboolean read_suspended;
+	gboolean read_suspended; /* by the user, the memory limit or input backpressure */
+	gboolean user_suspended, memory_suspended, input_suspended;
+	gsize input_pending, input_memory; /* sum of the requests */
 
 	/* write queue */
 	fastcgi_queue write_queue;
+	GPtrArray *producers; /* requests with a producer, NULL if there never was one */
+	fastcgi_request *producing; /* request whose producer is running, reset if it gets freed */
+	GList flush_link; /* data: fcon while in fsrv->flushing */
+
+	/* timeouts */
+	ev_tstamp last_activity; /* data was received or sent */
+	GList wheel_link; /* data: fcon */
+	guint64 wheel_tick; /* timeouts get checked in this tick, 0: not in the wheel */
+};
+
+enum fastcgi_upstream_flags {
+	FASTCGI_UPSTREAM_MULTIPLEX = 0x1 /* ask new connections for FCGI_MPXS_CONNS and share them between requests if the peer supports it */
+};
+
+struct fastcgi_upstream_callbacks {
+	void (*cb_stdout)(fastcgi_client_request *creq, GByteArray *data); /* data == NULL => eof */
+	void (*cb_stderr)(fastcgi_client_request *creq, GByteArray *data); /* data == NULL => eof */
+	void (*cb_wrote_stdin)(fastcgi_client_request *creq); /* optional: stdin went out, see fastcgi_client_request_write_space */
+
+	/* exactly one of them is called last, the request is freed after it returns */
+	void (*cb_end_request)(fastcgi_client_request *creq, gint32 appStatus, enum FCGI_ProtocolStatus status);
+	void (*cb_error)(fastcgi_client_request *creq); /* connect failed, connection lost or protocol error */
+};
+
+struct fastcgi_upstream_stats {
+	guint64 requests; /* fastcgi_client_request_new */
+	guint64 requests_ended; /* FCGI_END_REQUEST received */
+	guint64 requests_failed; /* cb_error */
+	guint64 pool_hits; /* request got an idle keep-alive connection */
+	guint64 pool_misses; /* request needed a new connection */
+	guint64 mpx_hits; /* request shared a busy connection (FASTCGI_UPSTREAM_MULTIPLEX) */
+	guint64 requests_queued; /* request had to wait for a connection (max_connections reached) */
+	guint64 connects, connect_errors;
+	guint64 connections_closed;
+	guint64 bytes_read, bytes_written;
+
+	fastcgi_histogram connect_latency; /* connect() until the connection is established */
+	fastcgi_histogram request_latency; /* fastcgi_client_request_end_params to FCGI_END_REQUEST */
+
+	/* current values, only set in snapshots (fastcgi_upstream_get_stats) */
+	guint64 connections, idle_connections, requests_waiting;
 };
 
+/* pool of FCGI_KEEP_CONN connections to one FastCGI application, on one ev_loop */
+struct fastcgi_upstream {
+/* custom user data */
+	gpointer data;
+
+/* private data */
+	struct ev_loop *loop;
+	const fastcgi_upstream_callbacks *callbacks;
+	struct sockaddr *addr;
+	guint addrlen;
+	guint flags;
+
+	guint max_connections, max_idle, max_connection_requests;
+	gsize write_high_watermark;
+	GPtrArray *connections; /* all, including the ones still connecting */
+	GQueue idle; /* open connections without requests, the most recently used first */
+	GQueue waiting; /* requests without connection, linked through creq->link */
+	GQueue closing; /* connections to free, see fastcgi_upstream_closing_cb */
+	ev_prepare closing_watcher;
+
+	guint8 *read_buffer;
+	fastcgi_pool pool;
+
+/* statistics (read only) */
+	fastcgi_upstream_stats stats;
+};
+
+struct fastcgi_client_request {
+/* custom user data */
+	gpointer data;
+
+/* read only */
+	fastcgi_upstream *up;
+	guint16 requestID; /* 0 while waiting for a connection */
+	guint16 role;
+	gboolean aborted; /* fastcgi_client_request_abort was called */
+	gboolean stdout_closed, stderr_closed; /* received eof */
+
+/* private data */
+	struct fastcgi_client_connection *ccon; /* NULL while waiting for a connection */
+	GByteArray *params; /* encoded pairs not sent yet */
+	gboolean params_done, stdin_closed;
+	GQueue pending_stdin; /* GBytes waiting for a connection */
+	gsize pending_stdin_length;
+	GList link; /* data: creq while in up->waiting */
+	ev_tstamp started; /* params done, for the latency histogram */
+};
+
+/* accepted tcp connections get TCP_NODELAY: without output coalescing every send is its own write */
 fastcgi_server *fastcgi_server_create(struct ev_loop *loop, gint socketfd, const fastcgi_callbacks *callbacks, guint max_connections);
 void fastcgi_server_stop(fastcgi_server *fsrv); /* stop accepting new connections, closes listening socket */
 void fastcgi_server_free(fastcgi_server *fsrv);
+/* new requests above the limits (server wide / per connection) are rejected with FCGI_OVERLOADED; 0: unlimited */
+void fastcgi_server_set_request_limits(fastcgi_server *fsrv, guint max_requests, guint max_connection_requests);
+/* max number of closed connection objects kept for reuse (with their buffers), default 64 */
+void fastcgi_server_set_free_connections(fastcgi_server *fsrv, guint max_free);
+void fastcgi_server_set_read_buffer_size(fastcgi_server *fsrv, gsize size); /* size of the read() buffer, default 64k */
+void fastcgi_server_set_accept_budget(fastcgi_server *fsrv, guint budget); /* max accept() per loop iteration, default 32, 0: unlimited */
+/* copy of fsrv->stats with the current values filled in */
+void fastcgi_server_get_stats(fastcgi_server *fsrv, fastcgi_server_stats *stats);
+/* upper bound in microseconds of the bucket holding the p-quantile (0 < p <= 1); 0 if empty */
+guint64 fastcgi_histogram_percentile(const fastcgi_histogram *h, gdouble p);
+/* switch the I/O backend; only before the first connection. FALSE: backend not available, server keeps the old one */
+gboolean fastcgi_server_set_backend(fastcgi_server *fsrv, enum fastcgi_backend backend);
+/* give a buffer from cb_(req_)received_stdin/data back to the pool instead of g_byte_array_free()ing it;
+ * its length must be unchanged (it picks the size class) */
+void fastcgi_server_release_buffer(fastcgi_server *fsrv, GByteArray *buf);
+void fastcgi_server_trim_pool(fastcgi_server *fsrv); /* free all unused pooled memory */
+/* only before the first connection (FALSE afterwards); allocator has to stay valid until fastcgi_server_free.
+ * NULL: g_slice (default). with the threaded server every worker can get its own */
+gboolean fastcgi_server_set_allocator(fastcgi_server *fsrv, const fastcgi_allocator *allocator);
+/* 0: unlimited; see enum fastcgi_memory_level. the limits are checked once per loop iteration */
+void fastcgi_server_set_memory_limits(fastcgi_server *fsrv, gsize soft_limit, gsize hard_limit);
+gsize fastcgi_server_memory_used(fastcgi_server *fsrv); /* see fsrv->memory for the parts */
+/* producers are asked for data when the write queue drops below low and until it reaches high; default 64k/256k */
+void fastcgi_server_set_write_watermarks(fastcgi_server *fsrv, gsize low, gsize high);
+/* input backpressure: reading stops when the buffers of stdin/data the callbacks didn't consume yet (see
+ * fastcgi_consume_input) take high bytes on a connection, and goes on below low. the allocated size counts
+ * (4k or 64k per chunk), not the payload. high == 0: off (default) */
+void fastcgi_server_set_input_watermarks(fastcgi_server *fsrv, gsize low, gsize high);
+/* output coalescing: stdout/stderr sends of up to max_copy bytes are copied into the previous record of the
+ * same stream (up to 64k), and the connections are written once at the end of the loop iteration instead of
+ * after every send; see fastcgi_flush. 0: off (default), every send is written right away */
+void fastcgi_server_set_output_coalescing(fastcgi_server *fsrv, gsize max_copy);
+/* in seconds, 0: off. connections are closed if they are
+ *   idle: without requests and nothing received/sent (keep-alive),
+ *   read: stalled within a record, or a request still waits for params/stdin (not while reading is suspended),
+ *   request: a request is active for longer than this.
+ * active requests are aborted first (cb_request_aborted/cb_req_aborted); checked with a granularity of 0.25s */
+void fastcgi_server_set_timeouts(fastcgi_server *fsrv, ev_tstamp idle, ev_tstamp read, ev_tstamp request);
+
+/* zero-downtime restart over a connected unix socket between the old and the new process (SCM_RIGHTS).
+ * old process: fastcgi_server_drain stops accepting and passes the listening socket to the new process
+ * right away. active requests go on (keep-alive connections may still start new ones); connections are
+ * handed over as soon as they are idle between requests. at the deadline the remaining requests are
+ * aborted and their connections closed (timeout <= 0: no deadline); then cb_drained is called.
+ * handoff_fd is not closed; -1: no new process, the listener and idle connections are just closed */
+void fastcgi_server_drain(fastcgi_server *fsrv, gint handoff_fd, ev_tstamp timeout);
+/* new process: blocks until the listening socket arrives (for fastcgi_server_create), -1 on error */
+gint fastcgi_handoff_receive_listener(gint handoff_fd);
+/* new process: serve the connections the old process hands over; handoff_fd is closed when it is drained */
+void fastcgi_server_adopt_connections(fastcgi_server *fsrv, gint handoff_fd);
+
+/* nthreads == 0: one per cpu; max_connections is per worker.
+ * socketfd is used by the first worker, the others get their own listener (see fastcgi_threaded_flags) */
+fastcgi_threaded_server *fastcgi_threaded_server_create(gint socketfd, const fastcgi_callbacks *callbacks, guint max_connections, guint nthreads, guint flags);
+void fastcgi_threaded_server_start(fastcgi_threaded_server *tsrv);
+void fastcgi_threaded_server_stop(fastcgi_threaded_server *tsrv); /* stop accepting new connections in all workers */
+void fastcgi_threaded_server_free(fastcgi_threaded_server *tsrv); /* closes all connections and joins the threads */
+/* sum of all workers; running workers publish their stats every 100ms, so the sum lags up to that much */
+void fastcgi_threaded_server_get_stats(fastcgi_threaded_server *tsrv, fastcgi_server_stats *stats);
 
 void fastcgi_suspend_read(fastcgi_connection *fcon);
 void fastcgi_resume_read(fastcgi_connection *fcon);
+/* the application is done with len bytes of stdin/data it got from the callbacks (input backpressure) */
+void fastcgi_consume_input(fastcgi_connection *fcon, gsize len);
+void fastcgi_release_input(fastcgi_connection *fcon, GByteArray *buf); /* consume buf->len and give buf back to the pool */
+void fastcgi_request_consume_input(fastcgi_request *req, gsize len);
+void fastcgi_request_release_input(fastcgi_request *req, GByteArray *buf);
 
 void fastcgi_end_request(fastcgi_connection *fcon, gint32 appStatus, enum FCGI_ProtocolStatus status);
 void fastcgi_send_out(fastcgi_connection *fcon, GString *data);
 void fastcgi_send_err(fastcgi_connection *fcon, GString *data);
 void fastcgi_send_out_bytearray(fastcgi_connection *fcon, GByteArray *data);
 void fastcgi_send_err_bytearray(fastcgi_connection *fcon, GByteArray *data);
+/* takes over the reference to data; the memory isn't copied, so one GBytes can be sent to many connections */
+void fastcgi_send_out_bytes(fastcgi_connection *fcon, GBytes *data);
+void fastcgi_send_err_bytes(fastcgi_connection *fcon, GBytes *data);
+/* sends len bytes from fd at offset as stdout without copying them through userspace (sendfile);
+ * takes ownership of fd: it is closed after the data was sent or the connection was closed */
+void fastcgi_send_out_file(fastcgi_connection *fcon, gint fd, goffset offset, gsize len);
+/* stdout of the current request is pulled from cb (see fastcgi_producer_cb) instead of pushed; cb == NULL removes it.
+ * the producer goes away with the request, you still have to end the request (also possible from within cb:
+ * the bytes cb returns in that call are sent before FCGI_END_REQUEST) */
+void fastcgi_set_producer(fastcgi_connection *fcon, fastcgi_producer_cb cb, gpointer ctx);
+void fastcgi_producer_wakeup(fastcgi_connection *fcon); /* producer has data again after returning 0 */
+gsize fastcgi_write_space(fastcgi_connection *fcon); /* bytes until the write queue reaches the high watermark */
+void fastcgi_flush(fastcgi_connection *fcon); /* output coalescing: write now instead of at the end of the loop iteration */
+/* see fastcgi_request_alloc; arena of the current request, NULL without one */
+gpointer fastcgi_connection_alloc(fastcgi_connection *fcon, gsize size);
+gchar* fastcgi_connection_strndup(fastcgi_connection *fcon, const gchar *s, gsize len);
 
 void fastcgi_connection_close(fastcgi_connection *fcon); /* shouldn't be needed */
 
+/* req is freed after fastcgi_request_end */
+void fastcgi_request_end(fastcgi_request *req, gint32 appStatus, enum FCGI_ProtocolStatus status);
+void fastcgi_request_send_out(fastcgi_request *req, GString *data);
+void fastcgi_request_send_err(fastcgi_request *req, GString *data);
+void fastcgi_request_send_out_bytearray(fastcgi_request *req, GByteArray *data);
+void fastcgi_request_send_err_bytearray(fastcgi_request *req, GByteArray *data);
+void fastcgi_request_send_out_bytes(fastcgi_request *req, GBytes *data);
+void fastcgi_request_send_err_bytes(fastcgi_request *req, GBytes *data);
+void fastcgi_request_send_out_file(fastcgi_request *req, gint fd, goffset offset, gsize len); /* see fastcgi_send_out_file */
+/* see fastcgi_set_producer; all producers of a connection share its write queue (round robin) */
+void fastcgi_request_set_producer(fastcgi_request *req, fastcgi_request_producer_cb cb, gpointer ctx);
+void fastcgi_request_producer_wakeup(fastcgi_request *req);
+void fastcgi_request_flush(fastcgi_request *req); /* see fastcgi_flush */
+/* request arena: 8 byte aligned memory that is released at once when the request is freed
+ * (fastcgi_request_end or connection closed); nothing is freed on its own */
+gpointer fastcgi_request_alloc(fastcgi_request *req, gsize size);
+gchar* fastcgi_request_strndup(fastcgi_request *req, const gchar *s, gsize len); /* '\0' terminated */
+
 void fastcgi_queue_append_string(fastcgi_queue *queue, GString *buf);
 void fastcgi_queue_append_bytearray(fastcgi_queue *queue, GByteArray *buf);
+void fastcgi_queue_append_bytes(fastcgi_queue *queue, GBytes *bytes); /* takes over the reference */
+void fastcgi_queue_append_file(fastcgi_queue *queue, gint fd, goffset offset, gsize length); /* raw data, takes ownership of fd */
 void fastcgi_queue_clear(fastcgi_queue *queue);
 
 /* return values: 0 ok, -1 error, -2 con closed */
 gint fastcgi_queue_write(int fd, fastcgi_queue *queue, gsize max_write);
 
-char** fastcgi_build_env(fastcgi_connection *con);
+char** fastcgi_build_env(fastcgi_connection *con); /* every entry and the array have to be freed, see fastcgi_environ_build_packed */
 const gchar* fastcgi_connection_environ_lookup(fastcgi_connection *fcon, const gchar* key, gsize keylen);
+char** fastcgi_request_build_env(fastcgi_request *req);
+const gchar* fastcgi_request_environ_lookup(fastcgi_request *req, const gchar* key, gsize keylen);
+
+const gchar* fastcgi_environ_lookup(const fastcgi_environ *env, const gchar* key, gsize keylen); /* env may be NULL */
+void fastcgi_environ_iter_init(fastcgi_environ_iter *iter, const fastcgi_environ *env); /* env may be NULL */
+/* returns FALSE at the end; all out parameters are optional */
+gboolean fastcgi_environ_iter_next(fastcgi_environ_iter *iter, const gchar **key, gsize *keylen, const gchar **value, gsize *valuelen);
+
+/* O(1) access to well known variables, env may be NULL */
+const gchar* fastcgi_environ_get(const fastcgi_environ *env, enum fastcgi_env_var var); /* NULL if not set */
+gint64 fastcgi_environ_get_int(const fastcgi_environ *env, enum fastcgi_env_var var); /* -1 if not set or not a number */
+gint64 fastcgi_environ_content_length(const fastcgi_environ *env); /* -1 if not set or invalid */
+gboolean fastcgi_environ_https(const fastcgi_environ *env); /* HTTPS is "on" or "1" */
+
+/* "KEY=VALUE" environment (for exec) with the pointer array and all strings in one block */
+gsize fastcgi_environ_build_size(const fastcgi_environ *env); /* bytes needed by fastcgi_environ_build */
+/* buf must be aligned for pointers; returns NULL if bufsize is too small. doesn't allocate */
+char** fastcgi_environ_build(const fastcgi_environ *env, gpointer buf, gsize bufsize);
+char** fastcgi_environ_build_packed(const fastcgi_environ *env); /* free with a single g_free() */
+
+/* sans-I/O codec: decodes from and encodes into caller memory, no allocations */
+void fastcgi_decoder_init(fastcgi_decoder *dec);
+/* uses input up to the next event, *used is set to the number of bytes taken; for FASTCGI_DECODER_CONTENT
+ * chunk and chunklen are set to the content part in input. call again with the rest of the input until FASTCGI_DECODER_NEED_MORE */
+enum fastcgi_decoder_event fastcgi_decoder_next(fastcgi_decoder *dec, const guint8 *input, gsize len, gsize *used, const guint8 **chunk, gsize *chunklen);
+void fastcgi_decoder_skip_record(fastcgi_decoder *dec); /* no more FASTCGI_DECODER_CONTENT events for the current record */
+
+/* name-value pair at the start of data: returns the number of bytes used, 0 if the pair is incomplete,
+ * -1 if a length is above FASTCGI_MAX_KEYLEN/FASTCGI_MAX_VALUELEN */
+gssize fastcgi_param_decode(const guint8 *data, gsize len, fastcgi_param *param);
+gsize fastcgi_param_encoded_size(gsize keylen, gsize valuelen);
+gsize fastcgi_param_encode(guint8 *buf, const gchar *key, gsize keylen, const gchar *value, gsize valuelen); /* returns bytes written */
+
+/* record size with header and padding */
+#define FASTCGI_RECORD_SIZE(contentLength) (FCGI_HEADER_LEN + (contentLength) + ((8 - ((contentLength) & 7)) & 7))
+/* writes FCGI_HEADER_LEN bytes, returns the padding length that has to follow the content */
+guint8 fastcgi_record_encode_header(guint8 *buf, guint8 type, guint16 requestID, guint16 contentLength);
+/* writes header, content and padding (FASTCGI_RECORD_SIZE(len) bytes), returns bytes written */
+gsize fastcgi_record_encode(guint8 *buf, guint8 type, guint16 requestID, const guint8 *content, guint16 len);
+gsize fastcgi_record_encode_begin_request(guint8 *buf, guint16 requestID, enum FCGI_Role role, guint8 flags); /* 16 bytes */
+gsize fastcgi_record_encode_end_request(guint8 *buf, guint16 requestID, gint32 appStatus, enum FCGI_ProtocolStatus status); /* 16 bytes */
+
+/* client side: requests to a FastCGI application through a pool of keep-alive connections.
+ * requests wait in a queue while max_connections are busy. addr is copied */
+fastcgi_upstream* fastcgi_upstream_create(struct ev_loop *loop, const struct sockaddr *addr, guint addrlen, const fastcgi_upstream_callbacks *callbacks, guint max_connections, guint flags);
+void fastcgi_upstream_free(fastcgi_upstream *up); /* active and waiting requests fail (cb_error); not from within callbacks */
+void fastcgi_upstream_set_max_idle(fastcgi_upstream *up, guint max_idle); /* idle connections kept open, default 16 */
+/* requests per connection with FASTCGI_UPSTREAM_MULTIPLEX, default 16 (lowered to FCGI_MAX_REQS of the peer) */
+void fastcgi_upstream_set_connection_requests(fastcgi_upstream *up, guint max_requests);
+void fastcgi_upstream_set_write_watermark(fastcgi_upstream *up, gsize high); /* see fastcgi_client_request_write_space, default 256k */
+void fastcgi_upstream_get_stats(fastcgi_upstream *up, fastcgi_upstream_stats *stats); /* copy of up->stats with the current values */
+/* give a buffer from cb_stdout/cb_stderr back to the pool instead of g_byte_array_free()ing it; length unchanged */
+void fastcgi_upstream_release_buffer(fastcgi_upstream *up, GByteArray *buf);
+
+fastcgi_client_request* fastcgi_client_request_new(fastcgi_upstream *up, enum FCGI_Role role, gpointer data);
+void fastcgi_client_request_add_param(fastcgi_client_request *creq, const gchar *key, gsize keylen, const gchar *value, gsize valuelen);
+/* the request gets a connection once the params are done */
+void fastcgi_client_request_end_params(fastcgi_client_request *creq);
+/* takes over data, NULL: eof. ends the params if needed */
+void fastcgi_client_request_send_stdin(fastcgi_client_request *creq, GByteArray *data);
+void fastcgi_client_request_send_stdin_bytes(fastcgi_client_request *creq, GBytes *data);
+/* bytes of stdin until the connection write queue reaches the watermark; wait for cb_wrote_stdin if 0 */
+gsize fastcgi_client_request_write_space(fastcgi_client_request *creq);
+/* waiting requests are freed right away (no callbacks); others send FCGI_ABORT_REQUEST and still end with cb_end_request/cb_error */
+void fastcgi_client_request_abort(fastcgi_client_request *creq);
 
 #endif